@@ -0,0 +1,21 @@
+#!/bin/sh
+# Allocator microbenchmark: run a malloc/free loop with the size-class heap allocator and with -bump-heap, and report the time and the peak resident set size of both
+# Usage: alloc.sh <llvm-interpreter> [module]. The module defaults to malloc_loop.ll next to this script
+set -e
+
+interpreter=$1
+module=${2:-$(dirname "$0")/malloc_loop.ll}
+if [ -z "$interpreter" ]; then
+	echo "Usage: $0 <llvm-interpreter> [module]" >&2
+	exit 1
+fi
+
+printf "%-14s %12s %16s %16s\n" "heap" "time (s)" "peak live (B)" "peak RSS (KB)"
+for flag in "" -bump-heap; do
+	stats=$("$interpreter" -stats $flag "$module" 2>&1 >/dev/null)
+	mode=$(echo "$stats" | sed -n 's/^Heap allocator: //p')
+	seconds=$(echo "$stats" | sed -n 's/^Execution time: \(.*\)s$/\1/p')
+	heap=$(echo "$stats" | sed -n 's/^Peak heap in use: \(.*\) bytes$/\1/p')
+	rss=$(echo "$stats" | sed -n 's/^Peak resident set size: \(.*\) KB$/\1/p')
+	printf "%-14s %12s %16s %16s\n" "$mode" "$seconds" "$heap" "$rss"
+done
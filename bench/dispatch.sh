@@ -0,0 +1,39 @@
+#!/bin/sh
+# Dispatch benchmark: build the interpreter with THREADED_DISPATCH on and off, run the same module with both builds, and report the instructions per second of each
+# Usage: dispatch.sh <source dir> <build dir> [module [cmake options...]]. The two builds go to <build dir>/dispatch-on and <build dir>/dispatch-off, and the module defaults to dispatch_loop.ll next to this script. Each build runs the module three times, and the best rate is reported
+set -e
+
+source=$1
+build=$2
+module=${3:-$(dirname "$0")/dispatch_loop.ll}
+if [ -z "$source" ] || [ -z "$build" ]; then
+	echo "Usage: $0 <source dir> <build dir> [module [cmake options...]]" >&2
+	exit 1
+fi
+[ $# -gt 3 ] && shift 3 || shift $#
+# cmake runs from inside the build directories
+source=$(cd "$source" && pwd)
+
+for mode in ON OFF; do
+	dir=$build/dispatch-$(echo $mode | tr A-Z a-z)
+	mkdir -p "$dir" && (cd "$dir" && cmake "$source" -DTHREADED_DISPATCH=$mode "$@" >/dev/null)
+	cmake --build "$dir" --target llvm-interpreter >/dev/null
+done
+
+printf "%-10s %16s %20s\n" "dispatch" "instructions" "instructions/s"
+for mode in on off; do
+	best=0
+	for run in 1 2 3; do
+		stats=$("$build/dispatch-$mode/bin/llvm-interpreter" -stats "$module" 2>&1 >/dev/null) || true
+		name=$(echo "$stats" | sed -n 's/^Dispatch mode: //p')
+		insts=$(echo "$stats" | sed -n 's/^Executed instructions: //p')
+		rate=$(echo "$stats" | sed -n 's/^Instructions per second: //p')
+		if [ -z "$rate" ]; then
+			echo "No instructions per second in the -stats output of the dispatch-$mode build:" >&2
+			echo "$stats" >&2
+			exit 1
+		fi
+		[ "$rate" -gt "$best" ] && best=$rate
+	done
+	printf "%-10s %16s %20s\n" "$name" "$insts" "$best"
+done
@@ -0,0 +1,102 @@
+; Dispatch benchmark (see bench/dispatch.sh). The mix is meant to look like ordinary compiled code rather than a single tight loop: a sieve of Eratosthenes over a global array (loads, stores, compares and branches), a recursive Fibonacci (calls and returns) and a switch, repeated 100 times
+
+@sieve = global [20000 x i8] zeroinitializer
+@fmt = private constant [21 x i8] c"primes %d, check %d\0A\00"
+
+declare i32 @printf(i8*, ...)
+
+define i32 @fib(i32 %n) {
+entry:
+  %small = icmp slt i32 %n, 2
+  br i1 %small, label %base, label %rec
+base:
+  ret i32 %n
+rec:
+  %n1 = sub i32 %n, 1
+  %f1 = call i32 @fib(i32 %n1)
+  %n2 = sub i32 %n, 2
+  %f2 = call i32 @fib(i32 %n2)
+  %f = add i32 %f1, %f2
+  ret i32 %f
+}
+
+define i32 @classify(i32 %x) {
+entry:
+  %r = urem i32 %x, 5
+  switch i32 %r, label %other [ i32 0, label %zero
+                                i32 1, label %one
+                                i32 3, label %three ]
+zero:
+  ret i32 7
+one:
+  %a = shl i32 %x, 1
+  ret i32 %a
+three:
+  %b = xor i32 %x, 85
+  ret i32 %b
+other:
+  ret i32 1
+}
+
+define i32 @countPrimes() {
+entry:
+  br label %clear
+clear:
+  %c = phi i32 [ 2, %entry ], [ %c.next, %clear ]
+  %cp = getelementptr [20000 x i8]* @sieve, i32 0, i32 %c
+  store i8 1, i8* %cp
+  %c.next = add i32 %c, 1
+  %clear.more = icmp slt i32 %c.next, 20000
+  br i1 %clear.more, label %clear, label %outer
+outer:
+  %i = phi i32 [ 2, %clear ], [ %i.next, %outer.next ]
+  %ip = getelementptr [20000 x i8]* @sieve, i32 0, i32 %i
+  %isPrime = load i8* %ip
+  %prime = icmp ne i8 %isPrime, 0
+  %sq = mul i32 %i, %i
+  %inRange = icmp slt i32 %sq, 20000
+  %mark = and i1 %prime, %inRange
+  br i1 %mark, label %inner, label %outer.next
+inner:
+  %j = phi i32 [ %sq, %outer ], [ %j.next, %inner ]
+  %jp = getelementptr [20000 x i8]* @sieve, i32 0, i32 %j
+  store i8 0, i8* %jp
+  %j.next = add i32 %j, %i
+  %inner.more = icmp slt i32 %j.next, 20000
+  br i1 %inner.more, label %inner, label %outer.next
+outer.next:
+  %i.next = add i32 %i, 1
+  %outer.more = icmp slt i32 %i.next, 20000
+  br i1 %outer.more, label %outer, label %count
+count:
+  %k = phi i32 [ 2, %outer.next ], [ %k.next, %count ]
+  %n = phi i32 [ 0, %outer.next ], [ %n.next, %count ]
+  %kp = getelementptr [20000 x i8]* @sieve, i32 0, i32 %k
+  %kv = load i8* %kp
+  %kv32 = zext i8 %kv to i32
+  %n.next = add i32 %n, %kv32
+  %k.next = add i32 %k, 1
+  %count.more = icmp slt i32 %k.next, 20000
+  br i1 %count.more, label %count, label %done
+done:
+  ret i32 %n.next
+}
+
+define i32 @main() {
+entry:
+  br label %loop
+loop:
+  %r = phi i32 [ 0, %entry ], [ %r.next, %loop ]
+  %check = phi i32 [ 0, %entry ], [ %check.next, %loop ]
+  %primes = call i32 @countPrimes()
+  %f = call i32 @fib(i32 18)
+  %cl = call i32 @classify(i32 %r)
+  %s1 = add i32 %check, %f
+  %check.next = add i32 %s1, %cl
+  %r.next = add i32 %r, 1
+  %more = icmp slt i32 %r.next, 100
+  br i1 %more, label %loop, label %exit
+exit:
+  %p = call i32 (i8*, ...)* @printf(i8* getelementptr ([21 x i8]* @fmt, i32 0, i32 0), i32 %primes, i32 %check.next)
+  ret i32 0
+}
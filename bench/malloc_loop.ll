@@ -0,0 +1,71 @@
+; Allocator microbenchmark (see bench/alloc.sh). Every round allocates 64 blocks, fills them with memset and frees them in reverse order
+; Seven blocks out of eight are small (16 to 1039 bytes), the eighth is large (64KB to 128KB), and sizes come from a linear congruential generator so that the free lists see a mix of size classes
+; A heap that never reuses memory needs the sum of all the blocks (about 400MB over the 500 rounds), while a reusing one needs a single round
+
+@fmt = private constant [41 x i8] c"checksum %u, %llu bytes allocated total\0A\00"
+
+declare i8* @malloc(i64)
+declare void @free(i8*)
+declare i8* @memset(i8*, i32, i64)
+declare i32 @printf(i8*, ...)
+
+define i32 @main() {
+entry:
+  %blocks = alloca [64 x i8*]
+  br label %round
+
+round:
+  %r = phi i32 [ 0, %entry ], [ %r.next, %release.done ]
+  %seed = phi i32 [ 12345, %entry ], [ %s.next, %release.done ]
+  %total = phi i64 [ 0, %entry ], [ %t.next, %release.done ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %release.done ]
+  br label %alloc
+
+alloc:
+  %i = phi i32 [ 0, %round ], [ %i.next, %alloc ]
+  %s = phi i32 [ %seed, %round ], [ %s.next, %alloc ]
+  %t = phi i64 [ %total, %round ], [ %t.next, %alloc ]
+  %s.mul = mul i32 %s, 1103515245
+  %s.next = add i32 %s.mul, 12345
+  %bits = lshr i32 %s.next, 8
+  %small.bits = and i32 %bits, 1023
+  %small = add i32 %small.bits, 16
+  %large.bits = and i32 %bits, 65535
+  %large = add i32 %large.bits, 65536
+  %kind = and i32 %i, 7
+  %is.large = icmp eq i32 %kind, 7
+  %size = select i1 %is.large, i32 %large, i32 %small
+  %size64 = zext i32 %size to i64
+  %p = call i8* @malloc(i64 %size64)
+  %tag = and i32 %i, 255
+  %m = call i8* @memset(i8* %p, i32 %tag, i64 %size64)
+  %slot = getelementptr [64 x i8*]* %blocks, i32 0, i32 %i
+  store i8* %p, i8** %slot
+  %t.next = add i64 %t, %size64
+  %i.next = add i32 %i, 1
+  %alloc.more = icmp slt i32 %i.next, 64
+  br i1 %alloc.more, label %alloc, label %release
+
+release:
+  %k = phi i32 [ 63, %alloc ], [ %k.next, %release ]
+  %acc = phi i32 [ %sum, %alloc ], [ %acc.next, %release ]
+  %slot2 = getelementptr [64 x i8*]* %blocks, i32 0, i32 %k
+  %q = load i8** %slot2
+  %byte = load i8* %q
+  %byte32 = zext i8 %byte to i32
+  %acc.next = add i32 %acc, %byte32
+  call void @free(i8* %q)
+  %k.next = sub i32 %k, 1
+  %release.more = icmp sge i32 %k.next, 0
+  br i1 %release.more, label %release, label %release.done
+
+release.done:
+  %sum.next = phi i32 [ %acc.next, %release ]
+  %r.next = add i32 %r, 1
+  %round.more = icmp slt i32 %r.next, 500
+  br i1 %round.more, label %round, label %done
+
+done:
+  %c = call i32 (i8*, ...)* @printf(i8* getelementptr ([41 x i8]* @fmt, i32 0, i32 0), i32 %sum.next, i64 %t.next)
+  ret i32 0
+}
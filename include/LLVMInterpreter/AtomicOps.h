@@ -0,0 +1,165 @@
+#ifndef DYNPTS_ATOMIC_OPS_H
+#define DYNPTS_ATOMIC_OPS_H
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <cstdint>
+#include <type_traits>
+
+namespace llvm_interpreter
+{
+
+// The atomic instructions of the guest. The threads of a guest program run on host threads and share its memory, so a guest atomic is a host atomic on the same bytes. Every operation is sequentially consistent, which is at least as strong as whatever ordering the guest asked for
+// The guest bytes are not std::atomic objects, hence the __atomic builtins of GCC and Clang. Operands and results are zero-extended to 64 bits
+
+namespace detail
+{
+
+template <typename T>
+uint64_t atomicLoad(const void* ptr)
+{
+	return __atomic_load_n(static_cast<const T*>(ptr), __ATOMIC_SEQ_CST);
+}
+
+template <typename T>
+void atomicStore(void* ptr, uint64_t val)
+{
+	__atomic_store_n(static_cast<T*>(ptr), static_cast<T>(val), __ATOMIC_SEQ_CST);
+}
+
+template <typename T>
+uint64_t atomicCompareExchange(void* ptr, uint64_t expected, uint64_t desired, bool& success)
+{
+	auto oldVal = static_cast<T>(expected);
+	success = __atomic_compare_exchange_n(static_cast<T*>(ptr), &oldVal, static_cast<T>(desired), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	return oldVal;
+}
+
+template <typename T>
+uint64_t atomicReadModifyWrite(void* ptr, llvm::AtomicRMWInst::BinOp op, uint64_t operand)
+{
+	using SignedT = typename std::make_signed<T>::type;
+	auto addr = static_cast<T*>(ptr);
+	auto val = static_cast<T>(operand);
+	switch (op)
+	{
+		case llvm::AtomicRMWInst::Xchg:
+			return __atomic_exchange_n(addr, val, __ATOMIC_SEQ_CST);
+		case llvm::AtomicRMWInst::Add:
+			return __atomic_fetch_add(addr, val, __ATOMIC_SEQ_CST);
+		case llvm::AtomicRMWInst::Sub:
+			return __atomic_fetch_sub(addr, val, __ATOMIC_SEQ_CST);
+		case llvm::AtomicRMWInst::And:
+			return __atomic_fetch_and(addr, val, __ATOMIC_SEQ_CST);
+		case llvm::AtomicRMWInst::Nand:
+			return __atomic_fetch_nand(addr, val, __ATOMIC_SEQ_CST);
+		case llvm::AtomicRMWInst::Or:
+			return __atomic_fetch_or(addr, val, __ATOMIC_SEQ_CST);
+		case llvm::AtomicRMWInst::Xor:
+			return __atomic_fetch_xor(addr, val, __ATOMIC_SEQ_CST);
+		case llvm::AtomicRMWInst::Max:
+		case llvm::AtomicRMWInst::Min:
+		case llvm::AtomicRMWInst::UMax:
+		case llvm::AtomicRMWInst::UMin:
+		{
+			// There is no builtin for these, so retry until nobody else wrote in between
+			auto oldVal = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+			while (true)
+			{
+				auto newVal = oldVal;
+				if (op == llvm::AtomicRMWInst::Max)
+					newVal = (static_cast<SignedT>(val) > static_cast<SignedT>(oldVal)) ? val : oldVal;
+				else if (op == llvm::AtomicRMWInst::Min)
+					newVal = (static_cast<SignedT>(val) < static_cast<SignedT>(oldVal)) ? val : oldVal;
+				else if (op == llvm::AtomicRMWInst::UMax)
+					newVal = (val > oldVal) ? val : oldVal;
+				else
+					newVal = (val < oldVal) ? val : oldVal;
+
+				if (__atomic_compare_exchange_n(addr, &oldVal, newVal, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+					return oldVal;
+			}
+		}
+		default:
+			llvm_unreachable("Unsupported atomicrmw operation");
+	}
+}
+
+}
+
+// Read the size bytes at ptr
+inline uint64_t atomicLoad(const void* ptr, unsigned size)
+{
+	switch (size)
+	{
+		case 1:
+			return detail::atomicLoad<uint8_t>(ptr);
+		case 2:
+			return detail::atomicLoad<uint16_t>(ptr);
+		case 4:
+			return detail::atomicLoad<uint32_t>(ptr);
+		case 8:
+			return detail::atomicLoad<uint64_t>(ptr);
+		default:
+			llvm_unreachable("Atomic operations are only supported on 1, 2, 4 and 8 bytes");
+	}
+}
+
+// Write the low size bytes of val to ptr
+inline void atomicStore(void* ptr, unsigned size, uint64_t val)
+{
+	switch (size)
+	{
+		case 1:
+			return detail::atomicStore<uint8_t>(ptr, val);
+		case 2:
+			return detail::atomicStore<uint16_t>(ptr, val);
+		case 4:
+			return detail::atomicStore<uint32_t>(ptr, val);
+		case 8:
+			return detail::atomicStore<uint64_t>(ptr, val);
+		default:
+			llvm_unreachable("Atomic operations are only supported on 1, 2, 4 and 8 bytes");
+	}
+}
+
+// Compare the size bytes at ptr with expected and replace them with desired if they are equal. Return the old value, and whether the replacement happened in success
+inline uint64_t atomicCompareExchange(void* ptr, unsigned size, uint64_t expected, uint64_t desired, bool& success)
+{
+	switch (size)
+	{
+		case 1:
+			return detail::atomicCompareExchange<uint8_t>(ptr, expected, desired, success);
+		case 2:
+			return detail::atomicCompareExchange<uint16_t>(ptr, expected, desired, success);
+		case 4:
+			return detail::atomicCompareExchange<uint32_t>(ptr, expected, desired, success);
+		case 8:
+			return detail::atomicCompareExchange<uint64_t>(ptr, expected, desired, success);
+		default:
+			llvm_unreachable("Atomic operations are only supported on 1, 2, 4 and 8 bytes");
+	}
+}
+
+// Apply op to the size bytes at ptr and operand, and return the old value
+inline uint64_t atomicReadModifyWrite(void* ptr, unsigned size, llvm::AtomicRMWInst::BinOp op, uint64_t operand)
+{
+	switch (size)
+	{
+		case 1:
+			return detail::atomicReadModifyWrite<uint8_t>(ptr, op, operand);
+		case 2:
+			return detail::atomicReadModifyWrite<uint16_t>(ptr, op, operand);
+		case 4:
+			return detail::atomicReadModifyWrite<uint32_t>(ptr, op, operand);
+		case 8:
+			return detail::atomicReadModifyWrite<uint64_t>(ptr, op, operand);
+		default:
+			llvm_unreachable("Atomic operations are only supported on 1, 2, 4 and 8 bytes");
+	}
+}
+
+}
+
+#endif
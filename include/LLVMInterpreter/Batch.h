@@ -0,0 +1,65 @@
+#ifndef DYNPTS_BATCH_H
+#define DYNPTS_BATCH_H
+
+#include "Memory.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace llvm
+{
+	class Function;
+	class Module;
+	class raw_ostream;
+}
+
+namespace llvm_interpreter
+{
+
+class Interpreter;
+
+// The outcome of one run of main() in a batch
+struct BatchRunResult
+{
+	std::vector<std::string> args;
+	int exitCode;
+	// Everything the guest printed
+	std::string output;
+	// Why the run failed, or an empty string if it completed
+	std::string error;
+	uint64_t numExecutedInstructions;
+	double seconds;
+};
+
+// BatchRunner runs main() once per argument vector, on a pool of host threads. All runs share the module and its translated code, while every run gets an interpreter of its own, with private memory and stack. The initialized globals are captured once, and every run maps them copy-on-write, so the runs share the pages they only read
+// The native tier compiles through the LLVMContext of the module, which cannot be shared across threads. Hence the interpreters of a batch never tier up
+class BatchRunner
+{
+private:
+	llvm::Module* module;
+	const llvm::Function* entryFn;
+	// The interpreter whose globals every run copies
+	const Interpreter& globalsTemplate;
+	unsigned numThreads;
+	bool fuseInstructions;
+	bool bumpHeap;
+	MemoryLimits limits;
+public:
+	// globalsTemplate must have its globals set up, and must outlive the runner. A numThreads of 0 uses one thread per hardware thread
+	BatchRunner(llvm::Module* m, const llvm::Function* entry, const Interpreter& globals, unsigned threads);
+
+	void setInstructionFusion(bool fuse) { fuseInstructions = fuse; }
+	void setBumpHeap(bool bump) { bumpHeap = bump; }
+	void setMemoryLimits(const MemoryLimits& l) { limits = l; }
+
+	// Run entryFn once per element of argvs. The results come back in the order of argvs
+	std::vector<BatchRunResult> run(const std::vector<std::vector<std::string>>& argvs) const;
+
+	// Print one JSON object per run, one per line
+	static void printResults(llvm::raw_ostream& os, const std::vector<BatchRunResult>& results);
+};
+
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef DYNPTS_CONSTANT_POOL_H
+#define DYNPTS_CONSTANT_POOL_H
+
+#include "llvm/ADT/DenseMap.h"
+
+#include <vector>
+
+namespace llvm
+{
+	class Constant;
+}
+
+namespace llvm_interpreter
+{
+
+// ConstantPool gives every constant used as an operand a dense index, so that the evaluated values can be cached in a plain array
+class ConstantPool
+{
+private:
+	llvm::DenseMap<const llvm::Constant*, unsigned> indices;
+	std::vector<const llvm::Constant*> constants;
+public:
+	ConstantPool() = default;
+
+	unsigned getIndex(const llvm::Constant* c)
+	{
+		auto itr = indices.find(c);
+		if (itr != indices.end())
+			return itr->second;
+
+		auto idx = constants.size();
+		indices.insert(std::make_pair(c, idx));
+		constants.push_back(c);
+		return idx;
+	}
+
+	const llvm::Constant* getConstant(unsigned idx) const
+	{
+		return constants.at(idx);
+	}
+
+	unsigned size() const { return constants.size(); }
+};
+
+}
+
+#endif
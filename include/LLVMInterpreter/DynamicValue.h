@@ -3,36 +3,56 @@
 
 #include "llvm/ADT/APInt.h"
 
+#include <cassert>
 #include <cstdint>
 #include <map>
 #include <string>
+#include <vector>
 
 namespace llvm_interpreter
 {
 
 using Address = uint64_t;
 
-enum class DynamicValueType
+enum class DynamicValueType: std::uint8_t
 {
 	INT_VALUE,
 	FLOAT_VALUE,
 	POINTER_VALUE,
 	ARRAY_VALUE,
 	STRUCT_VALUE,
+	VECTOR_VALUE,
 	UNDEF_VALUE
 };
 
-// Integer value
+// Integer value. IntValue is a view returned by DynamicValue::getAsIntValue(): integers of at most 64 bits are copied into it, wider integers are referenced and therefore must not outlive the DynamicValue they come from
 class IntValue
 {
 private:
-	llvm::APInt intVal;
+	uint64_t bits;
+	unsigned bitWidth;
+	const llvm::APInt* wideInt;
 
-	explicit IntValue(const llvm::APInt& i): intVal(i) {}
+	IntValue(uint64_t b, unsigned w): bits(b), bitWidth(w), wideInt(nullptr) {}
+	explicit IntValue(const llvm::APInt& i): bits(0), bitWidth(i.getBitWidth()), wideInt(&i) {}
 
 	std::string toString() const;
 public:
-	const llvm::APInt& getInt() const { return intVal; }
+	llvm::APInt getInt() const { return (wideInt != nullptr) ? *wideInt : llvm::APInt(bitWidth, bits); }
+	unsigned getBitWidth() const { return bitWidth; }
+
+	// Direct access to integers of at most 64 bits, bypassing APInt arithmetic
+	uint64_t getZExtValue() const
+	{
+		assert(wideInt == nullptr);
+		return bits;
+	}
+	int64_t getSExtValue() const
+	{
+		assert(wideInt == nullptr);
+		auto shift = 64 - bitWidth;
+		return static_cast<int64_t>(bits << shift) >> shift;
+	}
 
 	friend class DynamicValue;
 };
@@ -65,8 +85,6 @@ enum class PointerAddressSpace: std::uint8_t
 class PointerValue
 {
 private:
-	static size_t PointerSize;
-
 	PointerAddressSpace addrSpace;
 	Address ptr;
 
@@ -77,95 +95,111 @@ public:
 	Address getAddress() const { return ptr; }
 	PointerAddressSpace getAddressSpace() const { return addrSpace; }
 
-	static size_t getPointerSize() { return PointerSize; }
-	static void setPointerSize(size_t sz) { PointerSize = sz; }
-
 	friend class DynamicValue;
 };
 
-class DynamicValue;
-
-class ArrayValue
-{
-private:
-	using ArrayType = std::vector<DynamicValue>;
-	ArrayType array;
-	unsigned elemSize;
-
-	ArrayValue(const ArrayType& a, unsigned e): array(a), elemSize(e) {}
-	ArrayValue(unsigned elemCnt, unsigned elemSize);
-
-	std::string toString() const;
-public:
-	void setElementAtIndex(unsigned idx, DynamicValue&& val);
-	DynamicValue getElementAtIndex(unsigned idx) const;
-
-	unsigned getElementSize() const { return elemSize; }
-	unsigned getNumElements() const { return array.size(); }
-
-	friend class DynamicValue;
-};
+class ArrayValue;
+class StructValue;
+class VectorValue;
 
-class StructValue
+// DynamicValue is the value of a register. It is a 16-byte tagged union: scalars (integers of at most 64 bits, floats, pointers and undef) live inline, so that copying them is a plain copy of two words
+// Values that do not fit, namely aggregates, vectors and integers wider than 64 bits, are kept in reference-counted heap storage that is shared between copies. The storage of an aggregate is cloned before it is modified through a shared handle (copy-on-write)
+class DynamicValue
 {
 private:
-	using StructMapType = std::map<unsigned, DynamicValue>;
-	StructMapType structMap;
-	unsigned structSize;
-
-	StructValue(const StructMapType& s, unsigned sz): structMap(s), structSize(sz) {}
-	StructValue(unsigned sz): structSize(sz) {}
-
-	std::string toString() const;
-public:
-	void addField(unsigned offset, DynamicValue&& val);
-	DynamicValue getFieldAtNum(unsigned num) const;
-	unsigned getOffsetAtNum(unsigned num) const;
-
-	unsigned getNumElements() const { return structMap.size(); }
+	// The header of the heap storage. HeapBox<T> holds a T behind it
+	struct HeapStorage
+	{
+		unsigned refCount;
+	};
+	template <typename T>
+	struct HeapBox: public HeapStorage
+	{
+		T value;
 
-	friend class DynamicValue;
-};
+		HeapBox(T&& v): value(std::move(v)) { refCount = 1; }
+	};
 
-// We have two choices to make DynamicValue a polymorphic value type: using union, or using concept-based polymorphism. We choose the former here because of its efficiency
-class DynamicValue
-{
-private:
-	DynamicValueType type;
-	
-	// Since C++11, union may contain non-POD data members
-	// However, care must be taken when those member contains nontrivial special member functions. We define the constructor/destructor of Data to do nothing, but instead do all the work in the special member function of DynamicValue
 	union ValueData
 	{
-		IntValue intVal;
-		FloatValue floatVal;
-		PointerValue ptrVal;
-		ArrayValue arrayVal;
-		StructValue structVal;
-		uint8_t placeHolder;
-
-		ValueData(): placeHolder(0) {}
-		~ValueData() {}
+		uint64_t intBits;
+		double fpVal;
+		Address ptrAddr;
+		HeapStorage* heapVal;
 	} data;
 
-	// Destruct any existing data values. Must be called if the data member is a pointer to somewhere else
-	void clear();
+	// The bit width of an integer, or 32/64 for a float
+	unsigned bitWidth;
+	PointerAddressSpace addrSpace;
+	DynamicValueType type;
+	// Whether data.heapVal is in use
+	bool onHeap;
 
-	DynamicValue();	// Undef constructor
-	DynamicValue(IntValue&& intVal);	// Int constructor
-	DynamicValue(FloatValue&& floatVal);	// Float constructor
-	DynamicValue(PointerValue&& ptrVal);	// Pointer constructor
-	DynamicValue(ArrayValue&& arrayVal);	// Array constructor
-	DynamicValue(StructValue&& structVal);	// Struct constructor
+	DynamicValue(DynamicValueType t, unsigned w, PointerAddressSpace s): bitWidth(w), addrSpace(s), type(t), onHeap(false)
+	{
+		data.intBits = 0;
+	}
+
+	template <typename T>
+	HeapBox<T>& getHeapBox() const
+	{
+		assert(onHeap);
+		return *static_cast<HeapBox<T>*>(data.heapVal);
+	}
 
-	inline void copyFrom(const DynamicValue& other);
-	inline void moveFrom(DynamicValue&& other);
+	void retain() const
+	{
+		if (onHeap)
+			++data.heapVal->refCount;
+	}
+	void release()
+	{
+		if (onHeap && --data.heapVal->refCount == 0)
+			destroyHeapValue();
+	}
+	// Free the heap storage once the last reference to it is gone
+	void destroyHeapValue();
+	// Clone the heap storage if it is shared, so that it can be modified
+	void makeUnique();
 public:
-	~DynamicValue();
-	DynamicValue(const DynamicValue&);
-	DynamicValue(DynamicValue&&);
-	DynamicValue& operator=(const DynamicValue&);
-	DynamicValue& operator=(DynamicValue&&);
+	DynamicValue(): DynamicValue(DynamicValueType::UNDEF_VALUE, 0, PointerAddressSpace::GLOBAL_SPACE) {}
+	~DynamicValue() { release(); }
+	DynamicValue(const DynamicValue& other): data(other.data), bitWidth(other.bitWidth), addrSpace(other.addrSpace), type(other.type), onHeap(other.onHeap)
+	{
+		retain();
+	}
+	DynamicValue(DynamicValue&& other): data(other.data), bitWidth(other.bitWidth), addrSpace(other.addrSpace), type(other.type), onHeap(other.onHeap)
+	{
+		other.onHeap = false;
+		other.type = DynamicValueType::UNDEF_VALUE;
+	}
+	DynamicValue& operator=(const DynamicValue& other)
+	{
+		// Retain first, in case other shares our heap storage
+		other.retain();
+		release();
+		data = other.data;
+		bitWidth = other.bitWidth;
+		addrSpace = other.addrSpace;
+		type = other.type;
+		onHeap = other.onHeap;
+		return *this;
+	}
+	DynamicValue& operator=(DynamicValue&& other)
+	{
+		if (this != &other)
+		{
+			release();
+			data = other.data;
+			bitWidth = other.bitWidth;
+			addrSpace = other.addrSpace;
+			type = other.type;
+			onHeap = other.onHeap;
+			other.onHeap = false;
+			other.type = DynamicValueType::UNDEF_VALUE;
+		}
+		return *this;
+	}
 
 	std::string toString() const;
 	DynamicValueType getType() const { return type; }
@@ -198,21 +232,188 @@ public:
 	{
 		return isArrayValue() || isStructValue();
 	}
+	bool isVectorValue() const
+	{
+		return type == DynamicValueType::VECTOR_VALUE;
+	}
 
-	const IntValue& getAsIntValue() const;
-	const FloatValue& getAsFloatValue() const;
-	const PointerValue& getAsPointerValue() const;
+	IntValue getAsIntValue() const
+	{
+		assert(type == DynamicValueType::INT_VALUE);
+		if (onHeap)
+			return IntValue(getHeapBox<llvm::APInt>().value);
+		return IntValue(data.intBits, bitWidth);
+	}
+	FloatValue getAsFloatValue() const
+	{
+		assert(type == DynamicValueType::FLOAT_VALUE);
+		return FloatValue(data.fpVal, bitWidth == 64);
+	}
+	PointerValue getAsPointerValue() const
+	{
+		assert(type == DynamicValueType::POINTER_VALUE);
+		return PointerValue(addrSpace, data.ptrAddr);
+	}
 	ArrayValue& getAsArrayValue();
 	const ArrayValue& getAsArrayValue() const;
 	StructValue& getAsStructValue();
 	const StructValue& getAsStructValue() const;
+	VectorValue& getAsVectorValue();
+	const VectorValue& getAsVectorValue() const;
 
-	static DynamicValue getUndefValue();
+	static DynamicValue getUndefValue() { return DynamicValue(); }
 	static DynamicValue getIntValue(const llvm::APInt& i);
-	static DynamicValue getFloatValue(double f, bool i);
-	static DynamicValue getPointerValue(PointerAddressSpace s, Address a);
+	// Create an integer of at most 64 bits. The bits of val above bitWidth must be clear
+	static DynamicValue getIntValue(unsigned bitWidth, uint64_t val)
+	{
+		assert(bitWidth <= 64 && (bitWidth == 64 || (val >> bitWidth) == 0));
+		auto ret = DynamicValue(DynamicValueType::INT_VALUE, bitWidth, PointerAddressSpace::GLOBAL_SPACE);
+		ret.data.intBits = val;
+		return ret;
+	}
+	static DynamicValue getFloatValue(double f, bool i)
+	{
+		auto ret = DynamicValue(DynamicValueType::FLOAT_VALUE, i ? 64 : 32, PointerAddressSpace::GLOBAL_SPACE);
+		ret.data.fpVal = f;
+		return ret;
+	}
+	static DynamicValue getPointerValue(PointerAddressSpace s, Address a)
+	{
+		auto ret = DynamicValue(DynamicValueType::POINTER_VALUE, 0, s);
+		ret.data.ptrAddr = a;
+		return ret;
+	}
 	static DynamicValue getArrayValue(unsigned elemCnt, unsigned elemSize);
 	static DynamicValue getStructValue(unsigned sz);
+
+	// Overwrite the value with a scalar in place. The typed loads fill their destination register this way
+	void setIntValue(unsigned w, uint64_t val)
+	{
+		assert(w <= 64 && (w == 64 || (val >> w) == 0));
+		release();
+		data.intBits = val;
+		bitWidth = w;
+		type = DynamicValueType::INT_VALUE;
+		onHeap = false;
+	}
+	void setFloatValue(double f, bool i)
+	{
+		release();
+		data.fpVal = f;
+		bitWidth = i ? 64 : 32;
+		type = DynamicValueType::FLOAT_VALUE;
+		onHeap = false;
+	}
+	void setPointerValue(PointerAddressSpace s, Address a)
+	{
+		release();
+		data.ptrAddr = a;
+		bitWidth = 0;
+		addrSpace = s;
+		type = DynamicValueType::POINTER_VALUE;
+		onHeap = false;
+	}
+	// Create a vector whose lanes are all zero
+	static DynamicValue getVectorValue(unsigned elemCnt, unsigned elemBitWidth, bool isFloat);
+};
+
+static_assert(sizeof(DynamicValue) == 16, "DynamicValue is supposed to fit in 16 bytes");
+
+class ArrayValue
+{
+private:
+	using ArrayType = std::vector<DynamicValue>;
+	ArrayType array;
+	unsigned elemSize;
+
+	ArrayValue(unsigned elemCnt, unsigned elemSize);
+
+	std::string toString() const;
+public:
+	void setElementAtIndex(unsigned idx, DynamicValue&& val);
+	DynamicValue getElementAtIndex(unsigned idx) const;
+
+	unsigned getElementSize() const { return elemSize; }
+	unsigned getNumElements() const { return array.size(); }
+
+	friend class DynamicValue;
+};
+
+class StructValue
+{
+private:
+	using StructMapType = std::map<unsigned, DynamicValue>;
+	StructMapType structMap;
+	unsigned structSize;
+
+	StructValue(unsigned sz): structSize(sz) {}
+
+	std::string toString() const;
+public:
+	void addField(unsigned offset, DynamicValue&& val);
+	void setFieldAtNum(unsigned num, DynamicValue&& val);
+	DynamicValue getFieldAtNum(unsigned num) const;
+	unsigned getOffsetAtNum(unsigned num) const;
+
+	unsigned getNumElements() const { return structMap.size(); }
+
+	friend class DynamicValue;
+};
+
+// Vector value. The lanes are packed the way a host SIMD register holds them: each lane takes the smallest of 1, 2, 4 or 8 bytes that fits the element, which is also how vectors of byte-sized elements are laid out in memory. Integer lanes are kept zero-extended like scalar integers, float lanes hold a float rather than a double
+// Integer elements wider than 64 bits and pointer elements are not supported
+class VectorValue
+{
+private:
+	// 8-byte words, so that lanes of every size are naturally aligned
+	std::vector<uint64_t> storage;
+	unsigned numElems;
+	unsigned elemBitWidth;
+	bool floatFlag;
+
+	VectorValue(unsigned elemCnt, unsigned bitWidth, bool isFloat);
+
+	std::string toString() const;
+public:
+	unsigned getNumElements() const { return numElems; }
+	unsigned getElementBitWidth() const { return elemBitWidth; }
+	bool isFloatVector() const { return floatFlag; }
+	unsigned getLaneSize() const { return getLaneSize(elemBitWidth); }
+	// Whether the elements fill their lanes, i.e. the element width is 8, 16, 32 or 64 bits
+	bool hasFullLanes() const { return elemBitWidth == getLaneSize() * 8; }
+
+	uint8_t* getData() { return reinterpret_cast<uint8_t*>(storage.data()); }
+	const uint8_t* getData() const { return reinterpret_cast<const uint8_t*>(storage.data()); }
+	unsigned getDataSize() const { return numElems * getLaneSize(); }
+
+	// The lanes as an array of T, which must be as large as a lane
+	template <typename T>
+	T* getLanes()
+	{
+		assert(sizeof(T) == getLaneSize());
+		return reinterpret_cast<T*>(storage.data());
+	}
+	template <typename T>
+	const T* getLanes() const
+	{
+		assert(sizeof(T) == getLaneSize());
+		return reinterpret_cast<const T*>(storage.data());
+	}
+
+	// The bits of a lane, zero-extended. A float lane yields the bits of the float
+	uint64_t getRawLane(unsigned idx) const;
+	void setRawLane(unsigned idx, uint64_t bits);
+
+	DynamicValue getElementAtIndex(unsigned idx) const;
+	// An undef element is stored as zero
+	void setElementAtIndex(unsigned idx, const DynamicValue& val);
+
+	static unsigned getLaneSize(unsigned bitWidth)
+	{
+		return (bitWidth <= 8) ? 1 : (bitWidth <= 16) ? 2 : (bitWidth <= 32) ? 4 : 8;
+	}
+
+	friend class DynamicValue;
 };
 
 }
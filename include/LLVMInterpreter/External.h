@@ -0,0 +1,39 @@
+#ifndef DYNPTS_EXTERNAL_H
+#define DYNPTS_EXTERNAL_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace llvm
+{
+	class Function;
+	class raw_ostream;
+}
+
+namespace llvm_interpreter
+{
+
+// The library functions we know how to call. Defined in External.cpp
+enum class ExternalCallType: std::uint8_t;
+
+// ExternalEnvironment is what the guest program sees of the world outside of it: the library functions it can call, and the stream their output goes to. Every interpreter has its own, so that interpreters in the same process share no mutable state
+class ExternalEnvironment
+{
+private:
+	std::unordered_map<std::string, ExternalCallType> externalFuncMap;
+	// Where the output of the guest program goes. It is stdout by default
+	llvm::raw_ostream* out;
+public:
+	ExternalEnvironment();
+
+	// The library function f stands for. It is an error for f to be a function we do not know
+	ExternalCallType getExternalCallType(const llvm::Function* f) const;
+
+	llvm::raw_ostream& getOutputStream() const { return *out; }
+	void setOutputStream(llvm::raw_ostream& os) { out = &os; }
+};
+
+}
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef DYNPTS_HEAP_ALLOCATOR_H
+#define DYNPTS_HEAP_ALLOCATOR_H
+
+#include "Memory.h"
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+namespace llvm_interpreter
+{
+
+// HeapAllocator implements malloc() and friends on top of the heap section. Every block is preceded by a header holding its capacity, so that free() and realloc() know how large the block is
+// Small blocks are rounded up to one of a fixed set of size classes. A freed small block goes to the free list of its class and is handed out again by the next allocation of that class. Large blocks are made of whole pages: a freed large block is merged with the free blocks around it, its pages are given back to the host, and an allocation takes the smallest free range that fits
+// The allocator is not thread-safe: the interpreters of a guest program serialize their calls with GuestProcess::heapLock
+class HeapAllocator
+{
+public:
+	// The alignment of every block returned by allocate(), the same as the one of glibc on 64-bit hosts
+	static const uint64_t MinAlignment = 16;
+	// Blocks larger than this are large blocks
+	static const uint64_t MaxSmallSize = 32768;
+	static const uint64_t PageSize = 4096;
+private:
+	// The header sits right before the block: its capacity, and how far the block is from the start of the underlying chunk (nonzero only for blocks of aligned allocations)
+	struct BlockHeader
+	{
+		uint64_t capacity;
+		uint64_t offset;
+	};
+	static const uint64_t HeaderSize = sizeof(BlockHeader);
+	// Multiples of 16 up to 256 bytes, then powers of two up to MaxSmallSize
+	static const unsigned NumSizeClasses = 16 + 7;
+
+	MemorySection& heap;
+	// When set, the allocator only bumps the end of the heap and never reuses memory, which is how the heap used to behave
+	bool bumpOnly;
+
+	// The free small blocks of every size class, by the address of the block
+	std::array<std::vector<Address>, NumSizeClasses> freeLists;
+	// The free ranges made of large chunks, header included, indexed both by address and by size. Adjacent ranges are always merged
+	std::map<Address, uint64_t> freeRanges;
+	std::multimap<uint64_t, Address> freeRangesBySize;
+
+	uint64_t bytesInUse, peakBytesInUse;
+
+	static unsigned getSizeClass(uint64_t size);
+	static uint64_t getSizeClassCapacity(unsigned sizeClass);
+	// The capacity of a large block of (size) bytes, such that the chunk holding it is made of whole pages
+	static uint64_t getLargeCapacity(uint64_t size)
+	{
+		return (size + HeaderSize + PageSize - 1) / PageSize * PageSize - HeaderSize;
+	}
+
+	BlockHeader readHeader(Address addr) const;
+	void writeHeader(Address addr, uint64_t capacity, uint64_t offset);
+
+	// Take a chunk of (chunkSize) bytes from the end of the heap, and return the address of the block in it
+	Address allocateFromTop(uint64_t chunkSize);
+	Address allocateLarge(uint64_t size);
+	void freeLarge(Address chunk, uint64_t chunkSize);
+
+	void insertFreeRange(Address chunk, uint64_t chunkSize);
+	void eraseFreeRange(std::map<Address, uint64_t>::iterator itr);
+public:
+	HeapAllocator(MemorySection& h);
+
+	void setBumpOnly(bool b) { bumpOnly = b; }
+
+	// Allocate a block of at least (size) bytes, whose address is a multiple of (alignment), a power of two. A request of 0 bytes still returns a unique block
+	Address allocate(uint64_t size, uint64_t alignment = MinAlignment);
+	// Release the block at (addr), which must have been returned by allocate() or reallocate(). Freeing the null address does nothing
+	void free(Address addr);
+	// Resize the block at (addr) to (size) bytes, keeping its contents. The block stays where it is if it can, and moves otherwise. Return its new address
+	Address reallocate(Address addr, uint64_t size);
+
+	// The bytes held by blocks that are allocated and not yet freed, headers excluded, and the most there ever were
+	uint64_t getBytesInUse() const { return bytesInUse; }
+	uint64_t getPeakBytesInUse() const { return peakBytesInUse; }
+};
+
+}
+
+#endif
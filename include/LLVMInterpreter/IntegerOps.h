@@ -0,0 +1,232 @@
+#ifndef DYNPTS_INTEGER_OPS_H
+#define DYNPTS_INTEGER_OPS_H
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/IR/InstrTypes.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <cassert>
+#include <cstdint>
+
+namespace llvm_interpreter
+{
+
+// Integer operations on values of at most 64 bits, using native uint64_t arithmetic. A value is always kept zero-extended, i.e. the bits above the bit width are clear
+// Width is the bit width of the operands. The common widths (1, 8, 16, 32, 64) get their own instantiation so that masking and sign extension fold into constants; Width == 0 means that the width is only known at runtime
+template <unsigned Width>
+class NativeIntOps
+{
+private:
+	static_assert(Width <= 64, "NativeIntOps only handles integers of at most 64 bits");
+
+	unsigned runtimeWidth;
+public:
+	using ValueType = uint64_t;
+
+	explicit NativeIntOps(unsigned w = Width): runtimeWidth(w)
+	{
+		assert((Width == 0 || w == Width) && w != 0 && w <= 64);
+	}
+
+	unsigned getWidth() const { return (Width != 0) ? Width : runtimeWidth; }
+	uint64_t getMask() const { return (getWidth() == 64) ? ~UINT64_C(0) : ((UINT64_C(1) << getWidth()) - 1); }
+
+	uint64_t truncate(uint64_t v) const { return v & getMask(); }
+	int64_t signExtend(uint64_t v) const
+	{
+		auto shift = 64 - getWidth();
+		return static_cast<int64_t>(v << shift) >> shift;
+	}
+
+	// Conversions from and to floating point. Like APIntOps::RoundDoubleToAPInt, fromFloat rounds toward zero and keeps the low bits of the result. A NaN, or a value that does not fit in 64 bits, gives 0: LLVM makes the result poison anyway
+	uint64_t fromFloat(double d) const
+	{
+		if (d >= -9223372036854775808.0 && d < 9223372036854775808.0)
+			return truncate(static_cast<int64_t>(d));
+		else if (d >= 0 && d < 18446744073709551616.0)
+			return truncate(static_cast<uint64_t>(d));
+		return 0;
+	}
+	double toUnsignedFloat(uint64_t v) const { return static_cast<double>(v); }
+	double toSignedFloat(uint64_t v) const { return static_cast<double>(signExtend(v)); }
+
+	uint64_t add(uint64_t a, uint64_t b) const { return truncate(a + b); }
+	uint64_t sub(uint64_t a, uint64_t b) const { return truncate(a - b); }
+	uint64_t mul(uint64_t a, uint64_t b) const { return truncate(a * b); }
+	uint64_t udiv(uint64_t a, uint64_t b) const
+	{
+		assert(b != 0 && "Divide by zero?");
+		return a / b;
+	}
+	uint64_t urem(uint64_t a, uint64_t b) const
+	{
+		assert(b != 0 && "Remainder by zero?");
+		return a % b;
+	}
+	// Dividing the minimum signed value by -1 overflows int64_t. APInt wraps around in that case, and so do we
+	uint64_t sdiv(uint64_t a, uint64_t b) const
+	{
+		auto sb = signExtend(b);
+		assert(sb != 0 && "Divide by zero?");
+		if (sb == -1)
+			return truncate(-a);
+		return truncate(signExtend(a) / sb);
+	}
+	uint64_t srem(uint64_t a, uint64_t b) const
+	{
+		auto sb = signExtend(b);
+		assert(sb != 0 && "Remainder by zero?");
+		if (sb == -1)
+			return 0;
+		return truncate(signExtend(a) % sb);
+	}
+	uint64_t bitAnd(uint64_t a, uint64_t b) const { return a & b; }
+	uint64_t bitOr(uint64_t a, uint64_t b) const { return a | b; }
+	uint64_t bitXor(uint64_t a, uint64_t b) const { return a ^ b; }
+
+	// Shifting by the full bit width is allowed (and yields what APInt yields), shifting by more is rejected
+	uint64_t shl(uint64_t v, uint64_t amt) const
+	{
+		if (amt >= getWidth())
+		{
+			checkShiftAmount(amt);
+			return 0;
+		}
+		return truncate(v << amt);
+	}
+	uint64_t lshr(uint64_t v, uint64_t amt) const
+	{
+		if (amt >= getWidth())
+		{
+			checkShiftAmount(amt);
+			return 0;
+		}
+		return v >> amt;
+	}
+	uint64_t ashr(uint64_t v, uint64_t amt) const
+	{
+		if (amt >= getWidth())
+		{
+			checkShiftAmount(amt);
+			return (signExtend(v) < 0) ? getMask() : 0;
+		}
+		return truncate(signExtend(v) >> amt);
+	}
+	void checkShiftAmount(uint64_t amt) const
+	{
+		if (amt > getWidth())
+			llvm_unreachable("Illegal shift amount");
+	}
+
+	bool compare(unsigned predicate, uint64_t a, uint64_t b) const
+	{
+		switch (predicate)
+		{
+			case llvm::CmpInst::ICMP_EQ:
+				return a == b;
+			case llvm::CmpInst::ICMP_NE:
+				return a != b;
+			case llvm::CmpInst::ICMP_UGT:
+				return a > b;
+			case llvm::CmpInst::ICMP_UGE:
+				return a >= b;
+			case llvm::CmpInst::ICMP_ULT:
+				return a < b;
+			case llvm::CmpInst::ICMP_ULE:
+				return a <= b;
+			case llvm::CmpInst::ICMP_SGT:
+				return signExtend(a) > signExtend(b);
+			case llvm::CmpInst::ICMP_SGE:
+				return signExtend(a) >= signExtend(b);
+			case llvm::CmpInst::ICMP_SLT:
+				return signExtend(a) < signExtend(b);
+			case llvm::CmpInst::ICMP_SLE:
+				return signExtend(a) <= signExtend(b);
+			default:
+				llvm_unreachable("Illegal icmp predicate");
+		}
+	}
+};
+
+// The same operations on APInt, for integers wider than 64 bits
+class WideIntOps
+{
+public:
+	using ValueType = llvm::APInt;
+
+	llvm::APInt add(const llvm::APInt& a, const llvm::APInt& b) const { return a + b; }
+	llvm::APInt sub(const llvm::APInt& a, const llvm::APInt& b) const { return a - b; }
+	llvm::APInt mul(const llvm::APInt& a, const llvm::APInt& b) const { return a * b; }
+	llvm::APInt udiv(const llvm::APInt& a, const llvm::APInt& b) const { return a.udiv(b); }
+	llvm::APInt urem(const llvm::APInt& a, const llvm::APInt& b) const { return a.urem(b); }
+	llvm::APInt sdiv(const llvm::APInt& a, const llvm::APInt& b) const { return a.sdiv(b); }
+	llvm::APInt srem(const llvm::APInt& a, const llvm::APInt& b) const { return a.srem(b); }
+	llvm::APInt bitAnd(const llvm::APInt& a, const llvm::APInt& b) const { return a & b; }
+	llvm::APInt bitOr(const llvm::APInt& a, const llvm::APInt& b) const { return a | b; }
+	llvm::APInt bitXor(const llvm::APInt& a, const llvm::APInt& b) const { return a ^ b; }
+
+	llvm::APInt shl(const llvm::APInt& v, const llvm::APInt& amt) const { return v.shl(checkShiftAmount(v, amt)); }
+	llvm::APInt lshr(const llvm::APInt& v, const llvm::APInt& amt) const { return v.lshr(checkShiftAmount(v, amt)); }
+	llvm::APInt ashr(const llvm::APInt& v, const llvm::APInt& amt) const { return v.ashr(checkShiftAmount(v, amt)); }
+	unsigned checkShiftAmount(const llvm::APInt& v, const llvm::APInt& amt) const
+	{
+		auto shiftAmount = amt.getZExtValue();
+		if (shiftAmount > v.getBitWidth())
+			llvm_unreachable("Illegal shift amount");
+		return shiftAmount;
+	}
+
+	bool compare(unsigned predicate, const llvm::APInt& a, const llvm::APInt& b) const
+	{
+		switch (predicate)
+		{
+			case llvm::CmpInst::ICMP_EQ:
+				return a == b;
+			case llvm::CmpInst::ICMP_NE:
+				return a != b;
+			case llvm::CmpInst::ICMP_UGT:
+				return a.ugt(b);
+			case llvm::CmpInst::ICMP_UGE:
+				return a.uge(b);
+			case llvm::CmpInst::ICMP_ULT:
+				return a.ult(b);
+			case llvm::CmpInst::ICMP_ULE:
+				return a.ule(b);
+			case llvm::CmpInst::ICMP_SGT:
+				return a.sgt(b);
+			case llvm::CmpInst::ICMP_SGE:
+				return a.sge(b);
+			case llvm::CmpInst::ICMP_SLT:
+				return a.slt(b);
+			case llvm::CmpInst::ICMP_SLE:
+				return a.sle(b);
+			default:
+				llvm_unreachable("Illegal icmp predicate");
+		}
+	}
+};
+
+// Invoke f with the NativeIntOps of the given bit width, which must be at most 64
+template <typename Func>
+auto withNativeIntOps(unsigned width, Func&& f)
+{
+	switch (width)
+	{
+		case 1:
+			return f(NativeIntOps<1>());
+		case 8:
+			return f(NativeIntOps<8>());
+		case 16:
+			return f(NativeIntOps<16>());
+		case 32:
+			return f(NativeIntOps<32>());
+		case 64:
+			return f(NativeIntOps<64>());
+		default:
+			return f(NativeIntOps<0>(width));
+	}
+}
+
+}
+
+#endif
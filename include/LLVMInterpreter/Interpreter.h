@@ -1,43 +1,205 @@
 #ifndef DYNPTS_INTERPRETER_H
 #define DYNPTS_INTERPRETER_H
 
+#include "External.h"
+#include "HeapAllocator.h"
 #include "Memory.h"
+#include "NativeTier.h"
+#include "PreparedFunction.h"
 #include "StackFrame.h"
+#include "TypeLayoutCache.h"
 
+#include "llvm/ADT/StringRef.h"
 #include "llvm/IR/DataLayout.h"
 
+#include <array>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+
 namespace llvm
 {
+	class CallInst;
 	class Module;
 	class ConstantExpr;
 	class ImmutableCallSite;
+	class raw_ostream;
 }
 
 namespace llvm_interpreter
 {
 
+// A thread spawned by the guest program. Defined in Threads.cpp
+struct GuestThread;
+
+// The state shared by all threads of a guest program: the global and heap memory, and the threads themselves. Every thread has a stack of its own
+struct GuestProcess
+{
+	MemorySection globalMem;
+	MemorySection heapMem;
+	// Serves malloc() and free() of the guest out of heapMem
+	HeapAllocator heapAllocator;
+	// Serializes the allocations in heapMem
+	std::mutex heapLock;
+	// Serializes the output of the guest program
+	std::mutex outputLock;
+	// threads[i] is the thread with id i + 1, the main thread having id 0. Guarded by threadLock
+	std::vector<std::unique_ptr<GuestThread>> threads;
+	// stacks[i] is the stack of the thread with id i, or nullptr once that thread has been joined. The stacks live in stackPool until the process goes away: another thread may still be accessing a stack while its thread is joined, so the stack of a joined thread is handed to a new thread instead of being freed. Guarded by threadLock
+	std::vector<MemorySection*> stacks;
+	std::deque<MemorySection> stackPool;
+	std::vector<MemorySection*> freeStacks;
+	// The address space reserved for every stack
+	size_t stackReservedSize;
+	std::mutex threadLock;
+	// The addresses given to blockaddress constants, and the mapping back from those addresses to blocks. They are shared so that a block has the same address in all threads. Guarded by blockAddressLock, which also serializes the allocations in globalMem once the guest program runs
+	std::unordered_map<const llvm::BasicBlock*, Address> blockAddresses;
+	std::unordered_map<Address, const llvm::BasicBlock*> blockPtrMap;
+	std::mutex blockAddressLock;
+
+	GuestProcess(size_t globalReservedSize, const MemoryLimits& limits);
+	~GuestProcess();
+
+	// Set up the stack of the thread with id tid, the next one to be created. Called with threadLock held, or before the process has any thread but the main one
+	MemorySection& createStack(unsigned tid, unsigned pointerSize);
+	// Give up the stack of the thread with id tid, which has exited. Called with threadLock held
+	void releaseStack(unsigned tid);
+};
+
 class Interpreter
 {
 private:
+	// The stack of the thread with id t lives at the addresses starting at t << StackThreadShift, so that a pointer into the stack of a thread can be passed to another thread. The addresses of the main thread are the offsets in its stack section
+	static const unsigned StackThreadShift = 40;
+	static const Address StackOffsetMask = (Address(1) << StackThreadShift) - 1;
+
 	llvm::Module* module;
 	llvm::DataLayout dataLayout;
+	// Sizes and field offsets of the types the interpreter lays out at runtime
+	TypeLayoutCache typeLayouts;
+
+	// The memory and the threads of the guest program, shared with the interpreters of the other threads
+	std::shared_ptr<GuestProcess> process;
+	// The id of the thread run by this interpreter
+	unsigned threadId;
 
 	// The global environment
 	std::unordered_map<const llvm::GlobalValue*, Address> globalEnv;
 	// The global memory
-	MemorySection globalMem;
-	// Mapping from function pointer to function
-	std::unordered_map<Address, const llvm::Function*> funPtrMap;
+	MemorySection& globalMem;
+	// Functions are given consecutive addresses, functionAddressStride bytes apart, starting at functionTableBase. functionTable[i] is the function at the i-th address
+	std::vector<const llvm::Function*> functionTable;
+	Address functionTableBase;
+	unsigned functionAddressStride;
+	// The translated code, which may be shared with other interpreters
+	std::shared_ptr<PreparedModule> preparedModule;
+	// The translated code of every function we have called so far, so that preparedModule is only asked (and locked) once per function
+	std::unordered_map<const llvm::Function*, const PreparedFunction*> preparedFunctions;
+
+	// The memoized values of the constants used as operands by the translated code: constantCache[i] holds the value of preparedModule->getConstant(i). The entries are evaluated upon their first use
+	struct CachedConstant
+	{
+		DynamicValue value;
+		bool evaluated;
+	};
+	std::deque<CachedConstant> constantCache;
+
+	// What a call needs to know about a function it calls
+	struct CallTarget
+	{
+		// The address the target was called through. It is 0 for direct calls
+		Address funAddr;
+		const llvm::Function* function;
+		// The translated code of a function with a body, or nullptr for an external function
+		const PreparedFunction* prepared;
+		ExternalCallType externalType;
+	};
+	// The inline cache of a call site remembers the targets it has called most recently. A direct call only ever has one target, and most indirect calls (e.g. virtual calls) only see a handful of them. Once the cache is full, the entries are replaced round-robin
+	struct InlineCache
+	{
+		static const unsigned NumEntries = 4;
+		CallTarget entries[NumEntries];
+		unsigned numEntries, nextVictim;
+	};
+	// inlineCaches[i] is the cache of the call site numbered i by the translator. std::deque keeps the caches in place as it grows
+	std::deque<InlineCache> inlineCaches;
+
+	// The execution profile of every translated function, indexed by PreparedFunction::getId()
+	struct FunctionProfile
+	{
+		uint64_t numCalls, numBackEdges;
+		// The compiled code of the function, once it has been tiered up
+		NativeTier::EntryPoint nativeEntry;
+		bool tierUpAttempted;
+		// Mixed-mode execution wants the function to run natively from its first call
+		bool selectedNative;
+	};
+	std::vector<FunctionProfile> profiles;
+	// A function is handed over to nativeTier once its number of calls plus loop back edges reaches tierUpThreshold. 0 disables tiering
+	unsigned tierUpThreshold;
+	// Whether there is a nativeTier. The calls and loop back edges are only counted, and the callees only looked up for native code, if so
+	bool tieringEnabled;
+	std::unique_ptr<NativeTier> nativeTier;
+	// The functions to run natively in mixed-mode execution, if any
+	std::unique_ptr<FunctionSelector> nativeSelector;
+	// Staging area for the arguments of a call to native code
+	std::vector<uint64_t> nativeArgs;
 
 	// The runtime stack of executing code.  The top of the stack is the current function record.
 	StackFrames stack;
-	// The stack memory
-	MemorySection stackMem;
+	// Staging area for the arguments of a tail call, since they may live in the frame the callee takes over. It is kept around so that its storage gets reused
+	std::vector<DynamicValue> tailCallArgs;
+	// The stack memory, owned by the process
+	MemorySection& stackMem;
 	// The heap memory
-	MemorySection heapMem;
+	MemorySection& heapMem;
+	// The library functions the guest program can call, and where its output goes
+	ExternalEnvironment externals;
+
+	// Number of instructions executed by runFunction(), phi nodes excluded. A superinstruction counts as one
+	uint64_t numExecutedInstructions;
+	// Number of times each superinstruction was executed, indexed by opcode
+	std::array<uint64_t, NumOpcodes> numFusedExecutions;
+
+	// The interpreter of a new thread of the guest program, which starts with the globals of parent
+	Interpreter(const Interpreter& parent, unsigned tid);
 
 	Address allocateStackMem(StackFrame& frame, unsigned size);
+	// The section holding the stack address addr, which is usually the stack of this thread
+	MemorySection& getStackMem(Address addr)
+	{
+		auto owner = addr >> StackThreadShift;
+		return (owner == threadId) ? stackMem : getThreadStackMem(owner);
+	}
+	MemorySection& getThreadStackMem(unsigned tid);
+	// The section ptr points into. offset receives the position of ptr within the section
+	MemorySection& getMemorySection(const PointerValue& ptr, Address& offset)
+	{
+		offset = ptr.getAddress();
+		switch (ptr.getAddressSpace())
+		{
+			case PointerAddressSpace::GLOBAL_SPACE:
+				return globalMem;
+			case PointerAddressSpace::STACK_SPACE:
+				offset &= StackOffsetMask;
+				return getStackMem(ptr.getAddress());
+			case PointerAddressSpace::HEAP_SPACE:
+				return heapMem;
+		}
+		llvm_unreachable("Unknown address space");
+	}
+	// The host address of the guest memory ptr points to
+	void* getRawPointer(const PointerValue& ptr);
+	// The same, for an access of size bytes that has to stay within allocated memory
+	void* getRawPointer(const PointerValue& ptr, size_t size)
+	{
+		auto offset = Address(0);
+		return getMemorySection(ptr, offset).getRawPointerToRange(offset, size);
+	}
 	Address allocateGlobalMem(llvm::Type* type);
+	Address getBlockAddress(const llvm::BasicBlock* bb);
+	const llvm::BasicBlock* getBlockAtAddress(Address addr);
+	const llvm::Function* getFunctionAtAddress(Address addr) const;
 
 	DynamicValue readFromPointer(const PointerValue& ptr, llvm::Type* type);
 	DynamicValue loadValue(MemorySection& mem, Address addr, llvm::Type* type);
@@ -45,25 +207,84 @@ private:
 	std::vector<DynamicValue> createArgvArray(const std::vector<std::string>& mainArgs);
 
 	DynamicValue evaluateConstant(const llvm::Constant*);
+	const DynamicValue& getConstantValue(unsigned idx);
 	DynamicValue evaluateConstantExpr(const llvm::ConstantExpr*);
+	// Write the initializer of a global to global memory. Aggregates are copied straight into the bytes of the global instead of being materialized as a DynamicValue first
+	void initializeGlobalMem(Address addr, const llvm::Constant* cv);
 
 	// Setting up the stack frame and execute f
 	DynamicValue callFunction(const llvm::Function* f, std::vector<DynamicValue>&& argValues);
-	// Assuming that the stack frame is set up, go ahead and execute f
-	DynamicValue runFunction(StackFrame& frame);
+	// Return the translated code of f. The translation is done upon the first request
+	const PreparedFunction& getPreparedFunction(const llvm::Function* f);
+	// Assuming that the stack frame is set up, go ahead and execute f. Calls to other functions do not recurse on the host stack: they push a frame and keep going in the same loop, which returns once entryFrame returns
+	DynamicValue runFunction(StackFrame& entryFrame);
+	// Find the function a call instruction calls, through the inline cache of the call site
+	const CallTarget& getCallTarget(const PreparedInstruction& inst, const StackFrame& frame);
+	const CallTarget& resolveCallTarget(InlineCache& cache, const PreparedInstruction& inst, Address funAddr);
+	// Count a call to f, and return the native code to run instead of interpreting f (if any). This is where hot functions get compiled
+	NativeTier::EntryPoint getNativeEntry(const PreparedFunction& f);
+	// Tell which of the functions the selection runs natively cannot be compiled, and will therefore be interpreted. The globals have to be set up, since compiled code refers to their addresses
+	void reportUncompilableSelection(const llvm::Function* mainFn);
+	// The guest program of this interpreter, as compiled code sees it
+	NativeTier::Environment getNativeEnvironment();
+	// Run a call of compiled code in the interpreter: site is the call instruction of the guest module, funWord the called pointer of an indirect call and args the argument words. Return the word of the result
+	uint64_t callFromNative(const llvm::CallInst* site, uint64_t funWord, const uint64_t* args);
+	// The runtime functions of compiled code (see NativeTier::Environment), whose context is the interpreter
+	static uint64_t nativeCallInterpreter(void* context, const llvm::CallInst* site, uint64_t funWord, const uint64_t* args);
+	static void* nativeTranslatePointer(void* context, uint64_t ptr);
+	static uint64_t nativeAllocateStack(void* context, uint64_t size);
+	static uint64_t nativeSaveStack(void* context);
+	static void nativeRestoreStack(void* context, uint64_t mark);
 	// External call handler
-	DynamicValue callExternalFunction(llvm::ImmutableCallSite cs, const llvm::Function* f, std::vector<DynamicValue>&& argValues);
+	DynamicValue callExternalFunction(llvm::ImmutableCallSite cs, ExternalCallType callType, std::vector<DynamicValue>&& argValues);
+	// pthread_create() and pthread_join(). Each guest thread is run by an interpreter of its own on a host thread
+	DynamicValue createThread(const PointerValue& threadIdPtr, const PointerValue& startRoutine, DynamicValue&& arg);
+	DynamicValue joinThread(unsigned tid, const PointerValue& retValPtr);
+	// Wait for the threads the guest program did not join. The first one that failed is rethrown
+	void joinAllThreads();
+	// The id of a thread nobody has joined yet, or 0 if there is none
+	unsigned findUnjoinedThread();
 	// Pop the last stack frame off of the stack before returning to the caller
 	void popStack();
 
-	DynamicValue evaluateOperand(const StackFrame& frame, const llvm::Value* v);
-	void evaluateInstruction(StackFrame& frame, const llvm::Instruction* inst);
+	const DynamicValue& evaluateOperand(const StackFrame& frame, const Operand& op);
 public:
-	Interpreter(llvm::Module*);
+	Interpreter(llvm::Module*, const MemoryLimits& limits = MemoryLimits());
+	// Run the module with the translated code of prepared, which has to be built from the same module. Every interpreter keeps its own memory and runtime caches, so interpreters that share prepared code can run on different threads
+	Interpreter(llvm::Module*, std::shared_ptr<PreparedModule> prepared, const MemoryLimits& limits = MemoryLimits());
+	// The main interpreter joins the threads still running rather than cancelling them, so it waits for them to finish. Their failures are reported on errs()
 	~Interpreter();
 
 	void evaluateGlobals();
+	// Capture the global memory set up by evaluateGlobals(), for copyGlobalsFrom()
+	std::unique_ptr<MemoryImage> createGlobalsImage() const { return std::make_unique<MemoryImage>(globalMem); }
+	// Take over the globals set up by another interpreter of the same module, instead of calling evaluateGlobals(). image is the global memory of other, from other.createGlobalsImage(). It is mapped copy-on-write, so the interpreters that start from the same image share its pages until they write them, and do not see each other's writes
+	void copyGlobalsFrom(const Interpreter& other, const MemoryImage& image);
+	// A snapshot holds what evaluateGlobals() sets up: the global memory image, the addresses of the globals and functions, and the addresses handed out to blockaddress constants. It is stored under a key that identifies the module (by moduleHash), the build of the interpreter and the options the globals depend on (the pointer size and lazy loading)
+	std::string getSnapshotKey(llvm::StringRef moduleHash, bool lazyLoad) const;
+	// Save the snapshot right after evaluateGlobals(). Return false if the file cannot be written
+	bool saveGlobalsSnapshot(const std::string& path, llvm::StringRef key) const;
+	// Restore a snapshot instead of calling evaluateGlobals(). The memory image is mapped copy-on-write rather than read. Return false, leaving the interpreter untouched, if the file is missing or does not match the key
+	bool loadGlobalsSnapshot(const std::string& path, llvm::StringRef key);
 	int runMain(const llvm::Function* mainFn, const std::vector< std::string>& mainArgs);
+
+	// Superinstructions are formed by default. This has to be set before any function is called
+	void setInstructionFusion(bool fuse) { preparedModule->setInstructionFusion(fuse); }
+	// Compile functions natively once their number of calls plus loop back edges reaches threshold. 0 (the default) keeps everything interpreted
+	void setTierUpThreshold(unsigned threshold);
+	// Run the functions picked by selector natively from their first call on. This has to be set before any function is called
+	void setNativeSelection(std::unique_ptr<FunctionSelector> selector);
+	// Send the output of the guest program to os instead of stdout
+	void setOutputStream(llvm::raw_ostream& os) { externals.setOutputStream(os); }
+	// Never reuse freed heap memory, the way the heap worked before it had an allocator. Meant for comparing memory footprints
+	void setBumpHeap(bool bump) { process->heapAllocator.setBumpOnly(bump); }
+
+	uint64_t getNumExecutedInstructions() const { return numExecutedInstructions; }
+	uint64_t getNumFusedExecutions(Opcode op) const { return numFusedExecutions[static_cast<unsigned>(op)]; }
+	uint64_t getPeakHeapBytes() const { return process->heapAllocator.getPeakBytesInUse(); }
+	unsigned getNumCompiledFunctions() const { return nativeTier ? nativeTier->getNumCompiledFunctions() : 0; }
+	// The instruction dispatch technique this interpreter was built with, "threaded" or "switch"
+	static const char* getDispatchMode();
 };
 
 }
@@ -3,6 +3,9 @@
 
 #include "DynamicValue.h"
 
+#include "llvm/Support/ErrorHandling.h"
+
+#include <atomic>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
@@ -11,13 +14,29 @@
 namespace llvm_interpreter
 {
 
+class MemoryImage;
+
+// The address space the sections of a guest program reserve. Untouched pages cost no memory, but the reservations of all the interpreters and guest threads in a host process have to fit in its address space. The global section is sized from the module instead
+struct MemoryLimits
+{
+	size_t heapBytes;
+	// The stack of every thread gets that much
+	size_t stackBytes;
+
+	MemoryLimits(): heapBytes(size_t(1) << 36), stackBytes(size_t(1) << 30) {}
+};
+
 // In LLVM IR, memory is modeled as an untyped byte array.
 // Therefore we also implement MemorySection as a raw byte array that can automatically grow when the memory limit is reached
+// The array is a range of virtual memory reserved upfront, whose pages are made accessible as the section grows. Hence growing never moves the array: the host pointers handed out by getRawPointerAtAddress() stay valid, and so do accesses by other threads while the section grows. The pages nobody has allocated cost nothing but address space. The implementation lives in Memory.cpp
 class MemorySection
 {
+public:
+	// Default reserved section size = 256GB
+	static const size_t DEFAULT_RESERVED_SIZE = size_t(1) << 38;
 private:
-	// Default (starting) section size = 1MB
-	static const size_t DEFAULT_SIZE = 0x100000;
+	// Pages are made accessible this many bytes at a time = 1MB
+	static const size_t COMMIT_GRANULARITY = 0x100000;
 
 	// The 2 msb of the address are reserved to mark the address space of the pointer:
 	// 00 - Global
@@ -29,71 +48,124 @@ private:
 	static const uint64_t StackAddressSpaceTag = 0x4000000000000000;
 	static const uint64_t HeapAddressSpaceTag = 0x8000000000000000;
 
-	size_t totalSize, usedSize;
+	// [0, usedSize) is allocated, [0, committedSize) is accessible and [0, reservedSize) is reserved
+	// The allocations in a section are serialized by its owner (the thread of a stack, a lock of GuestProcess for the shared sections), but any thread may check its accesses against usedSize while the section grows. The sizes are stored with release semantics once the pages are accessible, and loaded with acquire semantics
+	size_t reservedSize;
+	std::atomic<size_t> committedSize, usedSize;
 	uint8_t* mem;
+	// The number of bytes a pointer takes in memory, as given by the DataLayout of the module
+	unsigned pointerSize;
+
+	// Make [0, size) accessible. Throws if size exceeds the reserved range
+	void commit(size_t size);
 
-	void grow()
+	// Whether all of [addr, addr + size) is allocated
+	bool isRangeLegal(Address addr, size_t size) const
 	{
-		auto newSize = totalSize * 2;
-		auto newMem = new uint8_t[newSize];
-		std::memcpy(newMem, mem, totalSize);
-		delete[] mem;
-		mem = newMem;
+		auto used = usedSize.load(std::memory_order_acquire);
+		return (addr != 0) && (addr <= used) && (size <= used - addr);
 	}
 
-	bool isAddressLegal(Address addr) const
+	static PointerAddressSpace getTaggedAddressSpace(Address taggedAddr)
 	{
-		return (addr < usedSize) && (addr != 0);
+		switch (taggedAddr & AddressSpaceMask)
+		{
+			case GlobalAddressSpaceTag:
+				return PointerAddressSpace::GLOBAL_SPACE;
+			case StackAddressSpaceTag:
+				return PointerAddressSpace::STACK_SPACE;
+			case HeapAddressSpaceTag:
+				return PointerAddressSpace::HEAP_SPACE;
+			default:
+				throw std::runtime_error("readAsPointer() reads illegal pointer tag");
+		}
 	}
 public:
-	MemorySection(): totalSize(DEFAULT_SIZE), usedSize(1), mem(nullptr)
+	// Reserve reservedBytes of address space, rounded up to the commit granularity. If the host refuses, less is reserved
+	MemorySection(size_t reservedBytes = DEFAULT_RESERVED_SIZE);
+	~MemorySection();
+
+	MemorySection(const MemorySection&) = delete;
+	MemorySection& operator=(const MemorySection&) = delete;
+
+	// Pointers are stored with the tag of their address space in the upper bits
+	static Address tagAddress(PointerAddressSpace addrSpace, Address addr)
 	{
-		// We use a little trick here: set usedSize = 1 so that valid address starts at 1. Address 0 is reserved for NULL pointer
-		mem = new uint8_t[DEFAULT_SIZE];
+		switch (addrSpace)
+		{
+			case PointerAddressSpace::GLOBAL_SPACE:
+				return addr | GlobalAddressSpaceTag;
+			case PointerAddressSpace::STACK_SPACE:
+				return addr | StackAddressSpaceTag;
+			case PointerAddressSpace::HEAP_SPACE:
+				return addr | HeapAddressSpaceTag;
+		}
+		llvm_unreachable("Unknown address space");
 	}
-	~MemorySection()
+	// The bits of a stored pointer that hold the tag
+	static Address getTagMask() { return AddressSpaceMask; }
+	// Return the address of a stored pointer, and its address space in addrSpace
+	static Address untagAddress(Address taggedAddr, PointerAddressSpace& addrSpace)
 	{
-		delete[] mem;
+		addrSpace = getTaggedAddressSpace(taggedAddr);
+		return taggedAddr & ~AddressSpaceMask;
 	}
 
+	void setPointerSize(unsigned size) { pointerSize = size; }
+
 	// Allocate (size) bypes of memory and return the allocated addr
-	Address allocate(unsigned size)
+	Address allocate(size_t size)
 	{
-		if (usedSize + size >= totalSize)
-			grow();
-
-		assert(usedSize + size < totalSize);
+		auto retAddr = usedSize.load(std::memory_order_relaxed);
+		if (retAddr + size > committedSize.load(std::memory_order_relaxed))
+			commit(retAddr + size);
 
-		auto retAddr = usedSize;
-		usedSize += size;
+		usedSize.store(retAddr + size, std::memory_order_release);
 		return retAddr;
 	}
 
-	// Deallocate (size) bytes of allocated memory. This function is used to model stack deallocation
-	void deallocate(unsigned size)
+	// Allocate (size) bytes of memory at an address that is a multiple of (alignment), a power of two
+	Address allocateAligned(size_t size, size_t alignment)
 	{
-		usedSize -= size;
+		auto padding = (alignment - usedSize.load(std::memory_order_relaxed) % alignment) % alignment;
+		return allocate(padding + size) + padding;
 	}
 
-	// Deallocate the memory at address (addr). This function is used to model heap deallocation. Currently it does nothing, which might now satisfy the needs of applications with heavy heap traffic. A memory management algorithm has to be implemented in the future.
-	void free(Address addr)
+	// Deallocate (size) bytes of allocated memory. This function is used to model stack deallocation
+	void deallocate(size_t size)
 	{
+		usedSize.store(usedSize.load(std::memory_order_relaxed) - size, std::memory_order_release);
 	}
 
-	// Reads an integer from memory at address (addr).
-	DynamicValue readAsInt(Address addr, unsigned bitWidth) const
+	// Give the physical pages entirely within [addr, addr + size) back to the host. They read as zeroes afterwards. Used by the heap allocator (see HeapAllocator.h) for large free blocks
+	void discard(Address addr, size_t size);
+	// Deallocate everything and give the pages back to the host, which leaves the section as it was constructed. Used to hand the stack of an exited thread to a new one
+	void reset();
+
+	// Reads the bits of an integer from memory at address (addr).
+	uint64_t readIntBits(Address addr, unsigned bitWidth) const
 	{
 		assert(bitWidth <= 64 && "No support for >64-bit int read");
-		if (!isAddressLegal(addr))
+		// An integer occupies as many bytes as it takes to hold its bits (an i1 takes one byte)
+		auto size = (bitWidth + 7) / 8u;
+		if (!isRangeLegal(addr, size))
 			throw std::out_of_range("readAsInt() accesses unallocated memory");
 		uint64_t val = 0;
-		std::memcpy(&val, mem + addr, bitWidth / 8u);
-		return DynamicValue::getIntValue(llvm::APInt(bitWidth, val));
+		std::memcpy(&val, mem + addr, size);
+		if (bitWidth < 64)
+			val &= (UINT64_C(1) << bitWidth) - 1;
+		return val;
+	}
+
+	// Reads an integer from memory at address (addr).
+	DynamicValue readAsInt(Address addr, unsigned bitWidth) const
+	{
+		return DynamicValue::getIntValue(bitWidth, readIntBits(addr, bitWidth));
 	}
 
 	DynamicValue readAsFloat(Address addr, bool isDouble = true) const
 	{
-		if (!isAddressLegal(addr))
+		if (!isRangeLegal(addr, isDouble ? sizeof(double) : sizeof(float)))
 			throw std::out_of_range("readAsFloat() accesses unallocated memory");
 		if (isDouble)
 		{
@@ -111,47 +183,85 @@ public:
 
 	DynamicValue readAsPointer(Address addr) const
 	{
-		if (!isAddressLegal(addr))
+		if (!isRangeLegal(addr, pointerSize))
 			throw std::out_of_range("readAsPointer() accesses unallocated memory");
 		Address retAddr = 0;
-		std::memcpy(&retAddr, mem + addr, PointerValue::getPointerSize());
-		
-		auto addrSpace = PointerAddressSpace::GLOBAL_SPACE;
-		switch (retAddr & AddressSpaceMask)
-		{
-			case GlobalAddressSpaceTag:
-				addrSpace = PointerAddressSpace::GLOBAL_SPACE;
-				break;
-			case StackAddressSpaceTag:
-				addrSpace = PointerAddressSpace::STACK_SPACE;
-				break;
-			case HeapAddressSpaceTag:
-				addrSpace = PointerAddressSpace::HEAP_SPACE;
-				break;
-			default:
-				throw std::runtime_error("readAsPointer() reads illegal pointer tag");
-		}
+		std::memcpy(&retAddr, mem + addr, pointerSize);
 
-		return DynamicValue::getPointerValue(addrSpace, retAddr & ~AddressSpaceMask);
+		return DynamicValue::getPointerValue(getTaggedAddressSpace(retAddr), retAddr & ~AddressSpaceMask);
 	}
 
+	// The typed accessors behind the specialized loads and stores (LOAD_I8 ... STORE_PTR in Opcodes.def). They check once that every accessed byte is allocated, and move the bits without building a DynamicValue
+	template <typename T>
+	T readScalar(Address addr) const
+	{
+		if (!isRangeLegal(addr, sizeof(T)))
+			throw std::out_of_range("readScalar() accesses unallocated memory");
+		T val;
+		std::memcpy(&val, mem + addr, sizeof(T));
+		return val;
+	}
+	template <typename T>
+	void writeScalar(Address addr, T val)
+	{
+		if (!isRangeLegal(addr, sizeof(T)))
+			throw std::out_of_range("writeScalar() accesses unallocated memory");
+		std::memcpy(mem + addr, &val, sizeof(T));
+	}
+	// Return the untagged address of the pointer at (addr), and its address space in addrSpace
+	Address readPointer(Address addr, PointerAddressSpace& addrSpace) const
+	{
+		if (!isRangeLegal(addr, pointerSize))
+			throw std::out_of_range("readPointer() accesses unallocated memory");
+		Address retAddr = 0;
+		std::memcpy(&retAddr, mem + addr, pointerSize);
+		return untagAddress(retAddr, addrSpace);
+	}
+	void writePointer(Address addr, PointerAddressSpace addrSpace, Address ptrAddr)
+	{
+		if (!isRangeLegal(addr, pointerSize))
+			throw std::out_of_range("writePointer() accesses unallocated memory");
+		auto taggedAddr = tagAddress(addrSpace, ptrAddr);
+		std::memcpy(mem + addr, &taggedAddr, pointerSize);
+	}
+
+	// Vectors are stored with their lanes packed, so the lanes are copied as a whole. This only matches the memory layout of LLVM if the elements fill their lanes
+	DynamicValue readAsVector(Address addr, unsigned elemCnt, unsigned elemBitWidth, bool isFloat) const
+	{
+		auto retVal = DynamicValue::getVectorValue(elemCnt, elemBitWidth, isFloat);
+		auto& vecVal = retVal.getAsVectorValue();
+		if (!vecVal.hasFullLanes())
+			llvm_unreachable("Vectors of elements that are not byte-sized cannot be loaded");
+		if (!isRangeLegal(addr, vecVal.getDataSize()))
+			throw std::out_of_range("readAsVector() accesses unallocated memory");
+		std::memcpy(vecVal.getData(), mem + addr, vecVal.getDataSize());
+		return retVal;
+	}
+
+	// Aggregates are checked element by element, as they are written
 	void write(Address addr, const DynamicValue& val)
 	{
-		if (!isAddressLegal(addr))
-			throw std::out_of_range("write() accesses unallocated memory");
+		auto checkRange = [this, addr] (size_t size)
+		{
+			if (!isRangeLegal(addr, size))
+				throw std::out_of_range("write() accesses unallocated memory");
+		};
+
 		switch (val.getType())
 		{
 			case DynamicValueType::INT_VALUE:
 			{
-				auto& intVal = val.getAsIntValue().getInt();
+				auto intVal = val.getAsIntValue();
 				assert(intVal.getBitWidth() <= 64 && ">64-bit integer write not supported");
-				auto rawData = intVal.getRawData();
-				std::memcpy(mem + addr, rawData, intVal.getBitWidth() / 8);
+				auto rawData = intVal.getZExtValue();
+				checkRange((intVal.getBitWidth() + 7) / 8);
+				std::memcpy(mem + addr, &rawData, (intVal.getBitWidth() + 7) / 8);
 				break;
 			}
 			case DynamicValueType::FLOAT_VALUE:
 			{
-				auto& fpVal = val.getAsFloatValue();
+				auto fpVal = val.getAsFloatValue();
+				checkRange(fpVal.isDouble() ? sizeof(double) : sizeof(float));
 				if (fpVal.isDouble())
 				{
 					double f = fpVal.getFloat();
@@ -166,21 +276,10 @@ public:
 			}
 			case DynamicValueType::POINTER_VALUE:
 			{
-				auto& ptrVal = val.getAsPointerValue();
-				auto ptrAddr = ptrVal.getAddress();
-				switch (ptrVal.getAddressSpace())
-				{
-					case PointerAddressSpace::GLOBAL_SPACE:
-						ptrAddr |= GlobalAddressSpaceTag;
-						break;
-					case PointerAddressSpace::STACK_SPACE:
-						ptrAddr |= StackAddressSpaceTag;
-						break;
-					case PointerAddressSpace::HEAP_SPACE:
-						ptrAddr |= HeapAddressSpaceTag;
-						break;
-				}
-				std::memcpy(mem + addr, &ptrAddr, PointerValue::getPointerSize());
+				auto ptrVal = val.getAsPointerValue();
+				auto ptrAddr = tagAddress(ptrVal.getAddressSpace(), ptrVal.getAddress());
+				checkRange(pointerSize);
+				std::memcpy(mem + addr, &ptrAddr, pointerSize);
 				break;
 			}
 			case DynamicValueType::ARRAY_VALUE:
@@ -203,8 +302,18 @@ public:
 				}
 				break;
 			}
+			case DynamicValueType::VECTOR_VALUE:
+			{
+				auto& vecVal = val.getAsVectorValue();
+				if (!vecVal.hasFullLanes())
+					llvm_unreachable("Vectors of elements that are not byte-sized cannot be stored");
+				checkRange(vecVal.getDataSize());
+				std::memcpy(mem + addr, vecVal.getData(), vecVal.getDataSize());
+				break;
+			}
 			case DynamicValueType::UNDEF_VALUE:
 				//throw std::runtime_error("Writing an undef value to memory?");
+				checkRange(1);
 				break;
 		}
 	}
@@ -214,10 +323,48 @@ public:
 	{
 		return mem + addr;	
 	}
+	const void* getRawPointerAtAddress(Address addr) const
+	{
+		return mem + addr;
+	}
+	// The host address of [addr, addr + size), which has to be allocated. Used by the instructions that operate on the bytes in place, such as the atomics
+	void* getRawPointerToRange(Address addr, size_t size)
+	{
+		if (!isRangeLegal(addr, size))
+			throw std::out_of_range("getRawPointerToRange() accesses unallocated memory");
+		return mem + addr;
+	}
+
+	// The allocated bytes are [0, getUsedSize())
+	size_t getUsedSize() const { return usedSize.load(std::memory_order_acquire); }
+
+	// Make the bytes of image the content of the section, as if they had been allocated and written. The pages are mapped copy-on-write, so the sections that map the same image share them until they write to them. The section has to be empty
+	void mapImage(const MemoryImage& image);
 
 	void dumpMemory(Address startAddr = 1u, unsigned size = 0) const;
 };
 
+// An immutable copy of the content of a memory section, held in a file so that sections can map it (see MemorySection::mapImage())
+class MemoryImage
+{
+private:
+	int fd;
+	size_t fileOffset, size;
+public:
+	// Take over the file descriptor fd, whose bytes [fileOffset, fileOffset + size) are the image. fileOffset has to be a multiple of the page size
+	MemoryImage(int fd, size_t fileOffset, size_t size);
+	// Copy the allocated bytes of section to an anonymous file
+	explicit MemoryImage(const MemorySection& section);
+	~MemoryImage();
+
+	MemoryImage(const MemoryImage&) = delete;
+	MemoryImage& operator=(const MemoryImage&) = delete;
+
+	int getFileDescriptor() const { return fd; }
+	size_t getFileOffset() const { return fileOffset; }
+	size_t getSize() const { return size; }
+};
+
 }
 
 #endif
@@ -0,0 +1,119 @@
+#ifndef DYNPTS_NATIVE_TIER_H
+#define DYNPTS_NATIVE_TIER_H
+
+#include "DynamicValue.h"
+
+#include "llvm/ADT/StringRef.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace llvm
+{
+	class CallInst;
+	class Constant;
+	class ExecutionEngine;
+	class Function;
+	class GlobalValue;
+	class Regex;
+	class Type;
+}
+
+namespace llvm_interpreter
+{
+
+class FunctionSelector;
+
+// NativeTier compiles hot functions with MCJIT, so that the interpreter can call them natively
+// Compiled code works on the guest memory in place. Guest pointers keep their interpreter representation (the tagged addresses of Memory.h), and every load, store, atomic and memory intrinsic translates its pointer to a host address first. The global and heap sections and the stack of the running thread are reserved upfront and never move, so their host addresses are compiled in; pointers into the stacks of other threads go through the interpreter. allocas are carved out of the guest stack, and ptrtoint, inttoptr and pointer comparisons see untagged addresses, as they do in the interpreter. Unlike interpreted accesses, compiled ones are not checked against the allocated part of a section
+// Calls to functions that are not compiled, such as external functions and functions the interpreter has to run, go back to the interpreter, as do indirect calls. Hence a function can be compiled as long as its arguments, its return value and the operands of those calls are integers of at most 64 bits, floating point numbers or pointers, and it uses no exceptions, varargs, indirect branches, block addresses or inline assembly. Pointers have to be 64 bits wide
+class NativeTier
+{
+public:
+	// The compiled entry point of a function. The arguments and the return value are passed as 64-bit words: integers are zero-extended, floats and doubles are passed as the bits of a double, and pointers as tagged addresses
+	using EntryPoint = uint64_t (*)(const uint64_t* args);
+
+	// What compiled code needs to know about the guest program it runs in. The interpreter that owns the native tier fills it in, and the runtime functions are called with its context
+	struct Environment
+	{
+		// The host addresses of the global section, the heap section and the stack of the running thread
+		uint8_t* globalBase;
+		uint8_t* heapBase;
+		uint8_t* stackBase;
+		// The stack addresses of a thread start at its id shifted left by stackThreadShift
+		unsigned threadId, stackThreadShift;
+		// The guest addresses of the global variables and functions. The map is filled in by the interpreter before anything is compiled
+		const std::unordered_map<const llvm::GlobalValue*, Address>* globalAddresses;
+		void* context;
+		// Run the call instruction site of the guest module in the interpreter, and return the word of its result. funWord is the called pointer of an indirect call, and args holds the words of the arguments
+		uint64_t (*callInterpreter)(void* context, const llvm::CallInst* site, uint64_t funWord, const uint64_t* args);
+		// The host address of a pointer that compiled code does not translate by itself
+		void* (*translatePointer)(void* context, uint64_t ptr);
+		// Allocate size bytes of guest stack and return their pointer. saveStack() and restoreStack() release the allocations of a function when it returns
+		uint64_t (*allocateStack)(void* context, uint64_t size);
+		uint64_t (*saveStack)(void* context);
+		void (*restoreStack)(void* context, uint64_t mark);
+	};
+private:
+	Environment env;
+	// Created along with the first compiled module
+	std::unique_ptr<llvm::ExecutionEngine> engine;
+	// Used to give the symbols of every compiled module a unique prefix
+	unsigned numModules;
+	unsigned numCompiledFunctions;
+	// Memoized results of isLocallyCompilable()
+	std::unordered_map<const llvm::Function*, bool> locallyCompilable;
+
+	// Whether the body of f meets the requirements above, its callees aside
+	bool isLocallyCompilable(const llvm::Function* f);
+	// Whether compiled code can refer to every global in c by its guest address
+	bool hasGuestAddresses(const llvm::Constant* c) const;
+public:
+	NativeTier(const Environment& e);
+	~NativeTier();
+
+	// Whether f meets the requirements above
+	bool isCompilable(const llvm::Function* f);
+	// Compile f, along with the compilable functions it calls, and return its entry point. Return nullptr if f cannot be compiled. If selector is given, the callees it does not run natively are left to the interpreter
+	EntryPoint compile(const llvm::Function* f, const FunctionSelector* selector = nullptr);
+
+	unsigned getNumCompiledFunctions() const { return numCompiledFunctions; }
+
+	static uint64_t encodeValue(const DynamicValue& val);
+	static DynamicValue decodeValue(uint64_t word, llvm::Type* type);
+};
+
+// In mixed-mode execution, the user selects functions by name or by regular expression. Either only the selected functions are interpreted and the others run natively, or the other way around
+// A function is only run natively if NativeTier can compile it. The others stay interpreted whatever the selection says. Compiled code calls the interpreted functions through the interpreter, and both share the guest memory
+class FunctionSelector
+{
+public:
+	enum class Mode: std::uint8_t
+	{
+		INTERPRET_SELECTED,
+		COMPILE_SELECTED
+	};
+private:
+	Mode mode;
+	// Every pattern has to match a whole function name
+	std::vector<std::unique_ptr<llvm::Regex>> patterns;
+public:
+	FunctionSelector(Mode m);
+	~FunctionSelector();
+
+	// Return false and describe the problem in err if pattern is not a valid regular expression
+	bool addPattern(const std::string& pattern, std::string& err);
+
+	bool isSelected(llvm::StringRef name) const;
+	bool shouldRunNatively(llvm::StringRef name) const
+	{
+		return isSelected(name) == (mode == Mode::COMPILE_SELECTED);
+	}
+};
+
+}
+
+#endif
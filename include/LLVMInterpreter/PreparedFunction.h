@@ -0,0 +1,298 @@
+#ifndef DYNPTS_PREPARED_FUNCTION_H
+#define DYNPTS_PREPARED_FUNCTION_H
+
+#include "ConstantPool.h"
+
+#include "llvm/ADT/APInt.h"
+#include "llvm/IR/DataLayout.h"
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace llvm
+{
+	class BasicBlock;
+	class DataLayout;
+	class Function;
+	class Instruction;
+	class IntToPtrInst;
+	class Module;
+	class Type;
+	class Value;
+}
+
+namespace llvm_interpreter
+{
+
+// The opcodes of the pre-decoded instruction format. They are finer-grained than llvm::Instruction opcodes: whatever can be decided by looking at the types of an instruction is decided at translation time
+enum class Opcode: std::uint8_t
+{
+#define HANDLE_OPCODE(name) name,
+#include "Opcodes.def"
+};
+
+const char* getOpcodeName(Opcode op);
+// Whether op is a superinstruction, i.e. stands for two fused IR instructions
+bool isFusedOpcode(Opcode op);
+
+const unsigned NumOpcodes = 0
+#define HANDLE_OPCODE(name) + 1
+#include "Opcodes.def"
+;
+
+// An operand is either a register (an argument or an instruction result living in a slot of the stack frame) or a constant. The distinction is made once at translation time so that the execution loop does not need to dyn_cast every operand
+enum class OperandKind: std::uint8_t
+{
+	REGISTER,
+	CONSTANT
+};
+
+struct Operand
+{
+	OperandKind kind;
+	// The frame slot of a register operand, or the ConstantPool index of a constant operand
+	unsigned index;
+};
+
+// A variable index of a getelementptr, which is multiplied by the precomputed element size. Constant indices (including all struct indices) are folded into PreparedInstruction::gepOffset at translation time
+struct GEPStep
+{
+	uint64_t scale;
+};
+
+struct SwitchCase
+{
+	llvm::APInt value;
+	unsigned target;
+};
+
+// A case of a switch on an integer of at most 64 bits. Case values are sign-extended, so that clusters of small negative and positive values stay dense
+struct NativeSwitchCase
+{
+	int64_t value;
+	unsigned target;
+};
+
+// A possible destination of an indirectbr
+struct IndirectTarget
+{
+	const llvm::BasicBlock* block;
+	unsigned target;
+};
+
+// A decoded instruction. Everything the execution loop needs is resolved here, so that executing it requires neither casting nor DataLayout queries
+struct PreparedInstruction
+{
+	Opcode opcode;
+	// The icmp/fcmp predicate, or the operation of an ATOMICRMW
+	std::uint8_t predicate;
+	// For the LOAD_ADD ... LOAD_XOR superinstructions: the loaded value is the second operand of the binary operator rather than the first
+	bool loadIsRHS;
+	// For VECTOR_BINOP, VECTOR_CMP and VECTOR_CAST: the scalar opcode applied to every lane. For GEP_LOAD and GEP_STORE: the typed load or store (LOAD_I8 ... STORE_PTR) that accesses the computed address, or LOAD/STORE if there is none for the type
+	Opcode elementOpcode;
+	// The bit width of an integer result, or of the float result (32 or 64)
+	unsigned bitWidth;
+	// The operands are PreparedFunction::operands[firstOperand, firstOperand + numOperands)
+	unsigned firstOperand, numOperands;
+	// Some opcodes need extra data, which lives in an opcode-specific side table of the function: GEP steps for GEP, GEP_LOAD and GEP_STORE, aggregate indices for EXTRACTVALUE/INSERTVALUE, cases for SWITCH and SWITCH_SEARCH, the jump table for SWITCH_TABLE, the destinations for INDIRECTBR, and the mask for SHUFFLEVECTOR
+	unsigned firstAux, numAux;
+	// Branch targets, as indices into PreparedFunction::edges. targets[0] is the default destination of a switch
+	unsigned targets[2];
+	// The frame slot the result is written to
+	unsigned dest;
+	// The index of the inline cache of a CALL or TAIL_CALL. Indices are unique across all functions translated in the same TranslationContext
+	unsigned callSite;
+	union
+	{
+		// Precomputed DataLayout size. For ALLOCA it is the size of the allocated type, for ATOMIC_LOAD, ATOMIC_STORE, CMPXCHG and ATOMICRMW the size of the memory operand
+		uint64_t typeSize;
+		// The sum of the constant indices of a GEP, GEP_LOAD or GEP_STORE, scaled. Addresses wrap around, hence the unsigned type
+		uint64_t gepOffset;
+	};
+	// The original instruction. For a superinstruction, it is the second of the two fused instructions
+	const llvm::Instruction* inst;
+	union
+	{
+		// The loaded type for LOAD, ATOMIC_LOAD, GEP_LOAD, the stored type for ATOMIC_STORE and the LOAD_ADD ... LOAD_XOR superinstructions, the result type of CMPXCHG, or the result type of the vector operations
+		llvm::Type* type;
+		// The called function for a direct CALL (nullptr for indirect calls)
+		const llvm::Function* callee;
+		// The case value of the first jump table entry for SWITCH_TABLE
+		int64_t switchBase;
+	};
+};
+
+// Phi nodes are not translated into instructions. Instead, every CFG edge carries the copies that assign the phis of its target block, in an order that can be performed one copy at a time
+struct PhiCopy
+{
+	unsigned dest;
+	Operand src;
+};
+
+// Branch targets refer to edges rather than blocks. Taking an edge performs its phi copies and then jumps to entry
+struct PreparedEdge
+{
+	unsigned target;
+	// Position of the first instruction of the target block in the code array
+	unsigned entry;
+	// The copies are PreparedFunction::phiCopies[firstCopy, firstCopy + numCopies)
+	unsigned firstCopy, numCopies;
+};
+
+struct PreparedBlock
+{
+	const llvm::BasicBlock* block;
+	// Position of the first non-phi instruction of the block in the code array
+	unsigned entry;
+};
+
+// The state shared by the translation of all the functions an interpreter runs. Functions and call sites are numbered across the module, so that the interpreter can keep its runtime data about them in plain arrays
+struct TranslationContext
+{
+	ConstantPool constantPool;
+	unsigned numFunctions;
+	unsigned numCallSites;
+	// Whether common pairs of instructions are translated into superinstructions
+	bool fuseInstructions;
+
+	TranslationContext(): numFunctions(0), numCallSites(0), fuseInstructions(true) {}
+};
+
+// PreparedFunction is the translated form of an llvm::Function. It is built once, on the first call, and then executed directly by Interpreter::runFunction()
+// Every argument and every instruction that produces a value is assigned a slot number. The arguments come first, so that the i-th argument lives in slot i
+class PreparedFunction
+{
+private:
+	const llvm::Function* function;
+	// The number of the function in its TranslationContext
+	unsigned id;
+
+	// slotValues[i] is the IR value living in slot i. The scratch slot used to break cycles of phi copies has no IR value
+	std::vector<const llvm::Value*> slotValues;
+
+	std::vector<PreparedInstruction> code;
+	std::vector<Operand> operands;
+	std::vector<PreparedBlock> blocks;
+	std::vector<PreparedEdge> edges;
+	std::vector<PhiCopy> phiCopies;
+
+	// Side tables, see PreparedInstruction::firstAux
+	std::vector<GEPStep> gepSteps;
+	std::vector<unsigned> aggregateIndices;
+	std::vector<SwitchCase> switchCases;
+	std::vector<NativeSwitchCase> nativeSwitchCases;
+	std::vector<unsigned> jumpTables;
+	std::vector<IndirectTarget> indirectTargets;
+	// Lane indices into the concatenation of both shufflevector operands. -1 stands for an undef lane
+	std::vector<int> shuffleMasks;
+
+	PreparedFunction(const llvm::Function* f, unsigned i): function(f), id(i) {}
+public:
+	const llvm::Function* getFunction() const { return function; }
+	unsigned getId() const { return id; }
+
+	unsigned getNumSlots() const { return slotValues.size(); }
+	const llvm::Value* getSlotValue(unsigned slot) const { return slotValues[slot]; }
+
+	const PreparedInstruction* getCode() const { return code.data(); }
+	unsigned getCodeSize() const { return code.size(); }
+
+	const Operand& getOperand(const PreparedInstruction& inst, unsigned i) const
+	{
+		assert(i < inst.numOperands);
+		return operands[inst.firstOperand + i];
+	}
+	const PreparedBlock& getBlock(unsigned idx) const
+	{
+		return blocks[idx];
+	}
+	const PreparedEdge& getEdge(unsigned idx) const
+	{
+		return edges[idx];
+	}
+	const PhiCopy& getPhiCopy(const PreparedEdge& edge, unsigned i) const
+	{
+		assert(i < edge.numCopies);
+		return phiCopies[edge.firstCopy + i];
+	}
+	const GEPStep& getGEPStep(const PreparedInstruction& inst, unsigned i) const
+	{
+		assert(i < inst.numAux);
+		return gepSteps[inst.firstAux + i];
+	}
+	const unsigned* getAggregateIndices(const PreparedInstruction& inst) const
+	{
+		return aggregateIndices.data() + inst.firstAux;
+	}
+	const SwitchCase& getSwitchCase(const PreparedInstruction& inst, unsigned i) const
+	{
+		assert(i < inst.numAux);
+		return switchCases[inst.firstAux + i];
+	}
+	// The cases of SWITCH_SEARCH, sorted by value
+	const NativeSwitchCase* getNativeSwitchCases(const PreparedInstruction& inst) const
+	{
+		return nativeSwitchCases.data() + inst.firstAux;
+	}
+	const unsigned* getJumpTable(const PreparedInstruction& inst) const
+	{
+		return jumpTables.data() + inst.firstAux;
+	}
+	// The destinations of INDIRECTBR, sorted by block
+	const IndirectTarget* getIndirectTargets(const PreparedInstruction& inst) const
+	{
+		return indirectTargets.data() + inst.firstAux;
+	}
+
+	const int* getShuffleMask(const PreparedInstruction& inst) const
+	{
+		return shuffleMasks.data() + inst.firstAux;
+	}
+
+	void dumpCode() const;
+
+	// The body of f is materialized first if the module is loaded lazily
+	static std::unique_ptr<PreparedFunction> translate(const llvm::Function* f, const llvm::DataLayout& dataLayout, TranslationContext& context);
+
+	friend class FunctionTranslator;
+};
+
+// PreparedModule owns the translated code of a module. It can be shared by several interpreters, including interpreters running on different threads: functions are translated under a lock, and translated code never changes afterwards
+class PreparedModule
+{
+private:
+	llvm::DataLayout dataLayout;
+	TranslationContext translation;
+	std::unordered_map<const llvm::Function*, std::unique_ptr<PreparedFunction>> preparedFunctions;
+	// Guards the members above. LLVM does not synchronize the creation of constants (e.g. UndefValue::get()) or the materialization of function bodies either, so whoever does that while other interpreters may be running takes this lock too
+	mutable std::mutex mutex;
+public:
+	PreparedModule(const llvm::Module* m);
+
+	// Superinstructions are formed by default. This has to be set before any function is translated
+	void setInstructionFusion(bool fuse) { translation.fuseInstructions = fuse; }
+
+	// Return the translated code of f. The translation is done upon the first request
+	const PreparedFunction& getPreparedFunction(const llvm::Function* f);
+	// The constant numbered idx by the translator
+	const llvm::Constant* getConstant(unsigned idx) const;
+	// Upper bounds of the function and call site numbers handed out so far
+	unsigned getNumFunctions() const;
+	unsigned getNumCallSites() const;
+
+	std::unique_lock<std::mutex> lockContext() const { return std::unique_lock<std::mutex>(mutex); }
+};
+
+// Read the body of f from the bitcode if the module was loaded lazily and f has not been materialized yet. Anything that looks into function bodies has to call this first
+void materializeFunction(const llvm::Function* f);
+
+// The pointer the operand of an inttoptr is derived from, if it is of the form ptrtoint(p) or ptrtoint(p) + x. The result of the inttoptr points into the address space of that pointer
+const llvm::Value* findBasePointer(const llvm::IntToPtrInst* itp);
+
+}
+
+#endif
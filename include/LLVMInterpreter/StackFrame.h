@@ -1,102 +1,205 @@
 #ifndef DYNPTS_STACKFRAME_H
 #define DYNPTS_STACKFRAME_H
 
+#include "DynamicValue.h"
+#include "PreparedFunction.h"
+
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/Function.h"
 
-#include <unordered_map>
+#include <memory>
+#include <vector>
 
 namespace llvm_interpreter
 {
 
+// SlotArena holds the registers and the varargs of all frames. Storage is carved out of large chunks in stack order, so that setting up a frame is a pointer bump. Chunks are kept once allocated, so the call path stops touching the heap after the deepest call has been seen
+// Slots outside of any live frame are always undef: popping a frame clears its slots, which releases the aggregates they hold, and a new frame finds its slots already initialized
+class SlotArena
+{
+private:
+	// Default chunk size = 64K slots (1MB)
+	static const unsigned DEFAULT_CHUNK_SIZE = 0x10000;
+
+	struct Chunk
+	{
+		std::unique_ptr<DynamicValue[]> slots;
+		unsigned size;
+	};
+	std::vector<Chunk> chunks;
+	// The chunk we allocate from, and the number of slots in use in it
+	unsigned curChunk, curUsed;
+public:
+	// The allocation state to return to when a frame is popped
+	struct Mark
+	{
+		unsigned chunk, used;
+	};
+
+	SlotArena(): curChunk(0), curUsed(0) {}
+
+	Mark getMark() const { return Mark{curChunk, curUsed}; }
+
+	DynamicValue* allocate(unsigned size)
+	{
+		if (chunks.empty() || curUsed + size > chunks[curChunk].size)
+		{
+			// A frame never straddles two chunks. Skip to the next chunk that is large enough, creating one if needed
+			auto nextChunk = chunks.empty() ? 0 : curChunk + 1;
+			while (nextChunk < chunks.size() && chunks[nextChunk].size < size)
+				++nextChunk;
+			if (nextChunk == chunks.size())
+			{
+				auto chunkSize = (size > DEFAULT_CHUNK_SIZE) ? size : DEFAULT_CHUNK_SIZE;
+				chunks.push_back(Chunk{std::unique_ptr<DynamicValue[]>(new DynamicValue[chunkSize]), chunkSize});
+			}
+			curChunk = nextChunk;
+			curUsed = 0;
+		}
+
+		auto ret = chunks[curChunk].slots.get() + curUsed;
+		curUsed += size;
+		return ret;
+	}
+
+	// Release everything allocated since mark was taken. slots/size is the storage of the frame being popped
+	void release(Mark mark, DynamicValue* slots, unsigned size)
+	{
+		for (auto i = 0u; i < size; ++i)
+			slots[i] = DynamicValue::getUndefValue();
+		curChunk = mark.chunk;
+		curUsed = mark.used;
+	}
+};
+
 // StackFrame - This struct represents one stack frame currently executing.
 class StackFrame
 {
 private:
-	const llvm::Function* curFunction;// The currently executing function
+	const PreparedFunction* curFunction;// The currently executing function
 
 	unsigned allocSize;
+	// Position of the instruction to resume at when the callee of this frame returns. It is the instruction right after the call
+	unsigned resumePC;
 
-	std::unordered_map<const llvm::Value*, DynamicValue> vRegs;
-	std::vector<DynamicValue> varArgs; // Values passed through an ellipsis
-public:
-	using const_vararg_iterator = decltype(varArgs)::const_iterator;
-	using const_iterator = decltype(vRegs)::const_iterator;
+	// The register file, followed by the values passed through an ellipsis. Slot numbers are assigned by PreparedFunction. The storage belongs to the SlotArena of the stack
+	DynamicValue* vRegs;
+	unsigned numSlots, numVarArgs;
+	// The arena state before this frame was set up
+	SlotArena::Mark arenaMark;
 
-	StackFrame(const llvm::Function* f): curFunction(f), allocSize(0) {}
+	void init(const PreparedFunction& f, SlotArena& arena, unsigned varArgCount)
+	{
+		curFunction = &f;
+		allocSize = 0;
+		resumePC = 0;
+		numSlots = f.getNumSlots();
+		numVarArgs = varArgCount;
+		arenaMark = arena.getMark();
+		vRegs = arena.allocate(numSlots + numVarArgs);
+	}
+	void release(SlotArena& arena)
+	{
+		arena.release(arenaMark, vRegs, numSlots + numVarArgs);
+	}
+public:
+	using const_vararg_iterator = const DynamicValue*;
+	using const_iterator = const DynamicValue*;
 
-	StackFrame(StackFrame&& rhs) = default;
-	StackFrame& operator=(StackFrame&& rhs) = default;
+	StackFrame(): curFunction(nullptr), allocSize(0), resumePC(0), vRegs(nullptr), numSlots(0), numVarArgs(0), arenaMark{0, 0} {}
 
-	const llvm::Function* getFunction() const { return curFunction; }
+	const llvm::Function* getFunction() const { return curFunction->getFunction(); }
+	const PreparedFunction& getPreparedFunction() const { return *curFunction; }
 	unsigned getAllocationSize() const { return allocSize; }
 	void increaseAllocationSize(unsigned sz) { allocSize += sz; }
+	unsigned getResumePC() const { return resumePC; }
+	void setResumePC(unsigned pc) { resumePC = pc; }
 
-	void insertBinding(const llvm::Value* v, const DynamicValue& val)
+	void insertBinding(unsigned slot, const DynamicValue& val)
 	{
-		//assert(!vRegs.count(v) && "Duplicate entries in env!");
-		auto itr = vRegs.find(v);
-		if (itr == vRegs.end())
-			vRegs.insert(std::make_pair(v, val));
-		else
-			itr->second = std::move(val);
+		assert(slot < numSlots);
+		vRegs[slot] = val;
 	}
-
-	DynamicValue& lookup(const llvm::Value* val)
+	void insertBinding(unsigned slot, DynamicValue&& val)
 	{
-		return vRegs.at(val);
+		assert(slot < numSlots);
+		vRegs[slot] = std::move(val);
 	}
-	DynamicValue lookup(const llvm::Value* val) const
+
+	DynamicValue& lookup(unsigned slot)
 	{
-		return vRegs.at(val);
+		assert(slot < numSlots);
+		return vRegs[slot];
 	}
-	bool hasBinding(const llvm::Value* val) const
+	const DynamicValue& lookup(unsigned slot) const
 	{
-		auto itr = vRegs.find(val);
-		return itr != vRegs.end();
+		assert(slot < numSlots);
+		return vRegs[slot];
 	}
 
-	void insertVararg(DynamicValue&& val)
+	void setVararg(unsigned idx, DynamicValue&& val)
 	{
-		varArgs.push_back(std::move(val));
+		assert(idx < numVarArgs);
+		vRegs[numSlots + idx] = std::move(val);
 	}
 
-	const_iterator begin() const { return vRegs.begin(); }
-	const_iterator end() const { return vRegs.end(); }
+	const_iterator begin() const { return vRegs; }
+	const_iterator end() const { return vRegs + numSlots; }
 
-	const_vararg_iterator vararg_begin() const { return varArgs.begin(); }
-	const_vararg_iterator vararg_end() const { return varArgs.end(); }
+	const_vararg_iterator vararg_begin() const { return vRegs + numSlots; }
+	const_vararg_iterator vararg_end() const { return vRegs + numSlots + numVarArgs; }
 	llvm::iterator_range<const_vararg_iterator> varargs() const
 	{
 		return llvm::iterator_range<const_vararg_iterator>(vararg_begin(), vararg_end());
 	}
 
 	void dumpFrame() const;
+
+	friend class StackFrames;
 };
 
 class StackFrames
 {
 private:
+	// Popped frames are kept around and reused by the next call at the same depth, so that their addresses stay stable and pushing a frame does not allocate
 	std::vector<std::unique_ptr<StackFrame>> frames;
+	unsigned numFrames;
+
+	SlotArena slotArena;
 public:
-	StackFrames() = default;
+	StackFrames(): numFrames(0) {}
+
+	StackFrame& createFrame(const PreparedFunction& f, unsigned numVarArgs = 0)
+	{
+		if (numFrames == frames.size())
+			frames.emplace_back(std::make_unique<StackFrame>());
+
+		auto& frame = *frames[numFrames++];
+		frame.init(f, slotArena, numVarArgs);
+		return frame;
+	}
 
-	StackFrame& createFrame(const llvm::Function* f)
+	// Reinitialize the current frame for a tail call to f, which takes over the frame. The stack memory allocated by the frame must have been released already
+	void resetCurrentFrame(const PreparedFunction& f, unsigned numVarArgs)
 	{
-		frames.emplace_back(std::make_unique<StackFrame>(f));
-		return *frames.back();
+		auto& frame = getCurrentFrame();
+		frame.release(slotArena);
+		frame.init(f, slotArena, numVarArgs);
 	}
 
 	StackFrame& getCurrentFrame()
 	{
-		return *frames.back();
+		assert(numFrames != 0);
+		return *frames[numFrames - 1];
 	}
 
+	unsigned getNumFrames() const { return numFrames; }
+
 	void popFrame()
 	{
-		assert(!frames.empty());
-		frames.pop_back();
+		assert(numFrames != 0);
+		frames[--numFrames]->release(slotArena);
 	}
 
 	void dumpContext() const;
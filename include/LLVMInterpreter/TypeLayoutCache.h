@@ -0,0 +1,61 @@
+#ifndef DYNPTS_TYPE_LAYOUT_CACHE_H
+#define DYNPTS_TYPE_LAYOUT_CACHE_H
+
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/DerivedTypes.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace llvm_interpreter
+{
+
+// The DataLayout facts the interpreter needs about a type
+struct TypeLayout
+{
+	uint64_t allocSize;
+	// The offset of every field of a struct type
+	std::vector<uint64_t> fieldOffsets;
+	// The allocation size of the elements of an array type
+	uint64_t elemSize;
+};
+
+// TypeLayoutCache memoizes the layout of the types whose values are loaded or materialized at runtime. DataLayout walks a type again on every getTypeAllocSize() call, whereas here a type costs one hash lookup and its field offsets are read from an array
+class TypeLayoutCache
+{
+private:
+	const llvm::DataLayout& dataLayout;
+	// std::unordered_map never moves its elements, so the references we hand out stay valid
+	std::unordered_map<const llvm::Type*, TypeLayout> layouts;
+public:
+	TypeLayoutCache(const llvm::DataLayout& d): dataLayout(d) {}
+
+	const TypeLayout& getLayout(llvm::Type* type)
+	{
+		auto itr = layouts.find(type);
+		if (itr != layouts.end())
+			return itr->second;
+
+		auto layout = TypeLayout{dataLayout.getTypeAllocSize(type), {}, 0};
+		if (auto stType = llvm::dyn_cast<llvm::StructType>(type))
+		{
+			auto stLayout = dataLayout.getStructLayout(stType);
+			for (auto i = 0u, e = stType->getNumElements(); i < e; ++i)
+				layout.fieldOffsets.push_back(stLayout->getElementOffset(i));
+		}
+		else if (auto arrayType = llvm::dyn_cast<llvm::ArrayType>(type))
+			layout.elemSize = dataLayout.getTypeAllocSize(arrayType->getElementType());
+
+		return layouts.insert(std::make_pair(type, std::move(layout))).first->second;
+	}
+
+	uint64_t getTypeAllocSize(llvm::Type* type)
+	{
+		return getLayout(type).allocSize;
+	}
+};
+
+}
+
+#endif
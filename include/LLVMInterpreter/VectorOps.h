@@ -0,0 +1,34 @@
+#ifndef DYNPTS_VECTOR_OPS_H
+#define DYNPTS_VECTOR_OPS_H
+
+#include "DynamicValue.h"
+#include "PreparedFunction.h"
+
+namespace llvm
+{
+	class Type;
+}
+
+namespace llvm_interpreter
+{
+
+// The element-wise kernels behind the vector opcodes. Every operand and result of a kernel has the same number of lanes
+
+// Create a vector of the given llvm::VectorType whose lanes are all zero
+DynamicValue createVectorValue(llvm::Type* type);
+
+// Apply op, one of the scalar integer or floating point binary opcodes, to every pair of lanes of lhs and rhs. The operands and res have the same element type
+void evaluateVectorBinOp(Opcode op, const VectorValue& lhs, const VectorValue& rhs, VectorValue& res);
+// Apply op, one of the scalar conversion opcodes other than the bitcasts, to every lane of src
+void evaluateVectorCast(Opcode op, const VectorValue& src, VectorValue& res);
+// Pick every lane of res from lhs if the corresponding lane of cond is set, and from rhs otherwise
+void selectVectorLanes(const VectorValue& cond, const VectorValue& lhs, const VectorValue& rhs, VectorValue& res);
+// Reinterpret the bits of val as a value of dstType. At least one of the two types is a vector type, the other one is a vector type or a scalar type of at most 64 bits. Element 0 of a vector takes the lowest bits
+DynamicValue bitcastVectorValue(const DynamicValue& val, llvm::Type* dstType);
+
+// The host SIMD extension the kernels were compiled for
+const char* getVectorKernelISA();
+
+}
+
+#endif
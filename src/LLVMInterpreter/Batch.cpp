@@ -0,0 +1,132 @@
+#include "Batch.h"
+#include "Interpreter.h"
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+using namespace llvm;
+using namespace llvm_interpreter;
+
+// This file contains the batch mode, which runs the same module over many argument vectors in parallel
+
+BatchRunner::BatchRunner(Module* m, const Function* entry, const Interpreter& globals, unsigned threads): module(m), entryFn(entry), globalsTemplate(globals), numThreads(threads), fuseInstructions(true), bumpHeap(false)
+{
+	if (numThreads == 0)
+		numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+std::vector<BatchRunResult> BatchRunner::run(const std::vector<std::vector<std::string>>& argvs) const
+{
+	auto results = std::vector<BatchRunResult>(argvs.size());
+	auto prepared = std::make_shared<PreparedModule>(module);
+	prepared->setInstructionFusion(fuseInstructions);
+	auto globalsImage = globalsTemplate.createGlobalsImage();
+
+	// Every thread takes the next run that nobody has taken yet
+	std::atomic<unsigned> nextRun(0);
+	auto worker = [this, &argvs, &results, &prepared, &globalsImage, &nextRun] ()
+	{
+		for (auto i = nextRun++; i < argvs.size(); i = nextRun++)
+		{
+			auto& result = results[i];
+			result.args = argvs[i];
+			result.exitCode = -1;
+			result.numExecutedInstructions = 0;
+
+			auto startTime = std::chrono::steady_clock::now();
+			{
+				raw_string_ostream output(result.output);
+				Interpreter interpreter(module, prepared, limits);
+				interpreter.setOutputStream(output);
+				interpreter.setBumpHeap(bumpHeap);
+				try
+				{
+					interpreter.copyGlobalsFrom(globalsTemplate, *globalsImage);
+					result.exitCode = interpreter.runMain(entryFn, argvs[i]);
+				}
+				catch (const std::exception& e)
+				{
+					result.error = e.what();
+				}
+				result.numExecutedInstructions = interpreter.getNumExecutedInstructions();
+			}
+			auto endTime = std::chrono::steady_clock::now();
+			result.seconds = std::chrono::duration<double>(endTime - startTime).count();
+		}
+	};
+
+	auto threads = std::vector<std::thread>();
+	auto numWorkers = std::min<std::size_t>(numThreads, argvs.size());
+	for (auto i = 1u; i < numWorkers; ++i)
+		threads.emplace_back(worker);
+	// The calling thread works too
+	worker();
+	for (auto& thread: threads)
+		thread.join();
+
+	return results;
+}
+
+static void printJSONString(raw_ostream& os, const std::string& str)
+{
+	os << '"';
+	for (auto c: str)
+	{
+		switch (c)
+		{
+			case '"':
+				os << "\\\"";
+				break;
+			case '\\':
+				os << "\\\\";
+				break;
+			case '\n':
+				os << "\\n";
+				break;
+			case '\r':
+				os << "\\r";
+				break;
+			case '\t':
+				os << "\\t";
+				break;
+			default:
+				if (static_cast<unsigned char>(c) < 0x20)
+					os << format("\\u%04x", static_cast<unsigned>(c));
+				else
+					os << c;
+		}
+	}
+	os << '"';
+}
+
+void BatchRunner::printResults(raw_ostream& os, const std::vector<BatchRunResult>& results)
+{
+	for (auto i = 0u; i < results.size(); ++i)
+	{
+		auto& result = results[i];
+		os << "{\"run\": " << i << ", \"args\": [";
+		for (auto j = 0u; j < result.args.size(); ++j)
+		{
+			if (j != 0)
+				os << ", ";
+			printJSONString(os, result.args[j]);
+		}
+		os << "], \"exit\": " << result.exitCode;
+		os << ", \"instructions\": " << result.numExecutedInstructions;
+		os << ", \"seconds\": " << format("%.6f", result.seconds);
+		os << ", \"output\": ";
+		printJSONString(os, result.output);
+		if (!result.error.empty())
+		{
+			os << ", \"error\": ";
+			printJSONString(os, result.error);
+		}
+		os << "}\n";
+	}
+}
@@ -3,13 +3,12 @@
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/ErrorHandling.h"
 
+#include <cstring>
 #include <iterator>
 
 using namespace llvm;
 using namespace llvm_interpreter;
 
-size_t PointerValue::PointerSize = 8u;
-
 ArrayValue::ArrayValue(unsigned eCount, unsigned eSize): array(eCount, DynamicValue::getUndefValue()), elemSize(eSize) {}
 
 void ArrayValue::setElementAtIndex(unsigned idx, DynamicValue&& val)
@@ -29,6 +28,14 @@ void StructValue::addField(unsigned offset, DynamicValue&& val)
 	structMap.insert(std::make_pair(offset, std::move(val)));
 }
 
+void StructValue::setFieldAtNum(unsigned num, DynamicValue&& val)
+{
+	if (structMap.size() <= num)
+		llvm_unreachable("Out-of-bound struct access");
+
+	std::next(structMap.begin(), num)->second = std::move(val);
+}
+
 DynamicValue StructValue::getFieldAtNum(unsigned num) const
 {
 	if (structMap.size() <= num)
@@ -45,195 +52,189 @@ unsigned StructValue::getOffsetAtNum(unsigned num) const
 	return std::next(structMap.begin(), num)->first;
 }
 
-DynamicValue::DynamicValue(): type(DynamicValueType::UNDEF_VALUE) {}
-DynamicValue::DynamicValue(IntValue&& intVal): type(DynamicValueType::INT_VALUE)
-{
-	new (&data.intVal) IntValue(std::move(intVal));
-}
-DynamicValue::DynamicValue(FloatValue&& floatVal): type(DynamicValueType::FLOAT_VALUE)
-{
-	new (&data.floatVal) FloatValue(std::move(floatVal));
-}
-DynamicValue::DynamicValue(PointerValue&& ptrVal): type(DynamicValueType::POINTER_VALUE)
-{
-	new (&data.ptrVal) PointerValue(std::move(ptrVal));
-}
-DynamicValue::DynamicValue(ArrayValue&& arrayVal): type(DynamicValueType::ARRAY_VALUE)
+VectorValue::VectorValue(unsigned eCount, unsigned bitWidth, bool isFloat): storage((eCount * getLaneSize(bitWidth) + 7) / 8, 0), numElems(eCount), elemBitWidth(bitWidth), floatFlag(isFloat)
 {
-	new (&data.arrayVal) ArrayValue(std::move(arrayVal));
+	assert(bitWidth <= 64 && "Vector elements wider than 64 bits are not supported");
+	assert(!isFloat || bitWidth == 32 || bitWidth == 64);
 }
-DynamicValue::DynamicValue(StructValue&& structVal): type(DynamicValueType::STRUCT_VALUE)
+
+uint64_t VectorValue::getRawLane(unsigned idx) const
 {
-	new (&data.structVal) StructValue(std::move(structVal));
+	assert(idx < numElems);
+	switch (getLaneSize())
+	{
+		case 1:
+			return getLanes<uint8_t>()[idx];
+		case 2:
+			return getLanes<uint16_t>()[idx];
+		case 4:
+			return getLanes<uint32_t>()[idx];
+		default:
+			return getLanes<uint64_t>()[idx];
+	}
 }
-DynamicValue::~DynamicValue() { clear(); }
 
-void DynamicValue::clear()
+void VectorValue::setRawLane(unsigned idx, uint64_t bits)
 {
-	switch (type)
+	assert(idx < numElems);
+	switch (getLaneSize())
 	{
-		case DynamicValueType::INT_VALUE:
-			data.intVal.~IntValue();
-			break;
-		case DynamicValueType::FLOAT_VALUE:
-			data.floatVal.~FloatValue();
-			break;
-		case DynamicValueType::POINTER_VALUE:
-			data.ptrVal.~PointerValue();
+		case 1:
+			getLanes<uint8_t>()[idx] = bits;
 			break;
-		case DynamicValueType::ARRAY_VALUE:
-			data.arrayVal.~ArrayValue();
+		case 2:
+			getLanes<uint16_t>()[idx] = bits;
 			break;
-		case DynamicValueType::STRUCT_VALUE:
-			data.structVal.~StructValue();
+		case 4:
+			getLanes<uint32_t>()[idx] = bits;
 			break;
-		case DynamicValueType::UNDEF_VALUE:
+		default:
+			getLanes<uint64_t>()[idx] = bits;
 			break;
 	}
 }
 
-void DynamicValue::copyFrom(const DynamicValue& other)
+DynamicValue VectorValue::getElementAtIndex(unsigned idx) const
+{
+	if (!floatFlag)
+		return DynamicValue::getIntValue(elemBitWidth, getRawLane(idx));
+	else if (elemBitWidth == 64)
+		return DynamicValue::getFloatValue(getLanes<double>()[idx], true);
+	else
+		return DynamicValue::getFloatValue(getLanes<float>()[idx], false);
+}
+
+void VectorValue::setElementAtIndex(unsigned idx, const DynamicValue& val)
+{
+	if (val.isUndefValue())
+		setRawLane(idx, 0);
+	else if (!floatFlag)
+	{
+		assert(val.getAsIntValue().getBitWidth() == elemBitWidth);
+		setRawLane(idx, val.getAsIntValue().getZExtValue());
+	}
+	else if (elemBitWidth == 64)
+		getLanes<double>()[idx] = val.getAsFloatValue().getFloat();
+	else
+		getLanes<float>()[idx] = val.getAsFloatValue().getFloat();
+}
+
+void DynamicValue::destroyHeapValue()
 {
-	type = other.type;
+	assert(onHeap && data.heapVal->refCount == 0);
 	switch (type)
 	{
 		case DynamicValueType::INT_VALUE:
-			new (&data.intVal) IntValue(other.data.intVal);
-			break;
-		case DynamicValueType::FLOAT_VALUE:
-			new (&data.floatVal) FloatValue(other.data.floatVal);
-			break;
-		case DynamicValueType::POINTER_VALUE:
-			new (&data.ptrVal) PointerValue(other.data.ptrVal);
+			delete &getHeapBox<llvm::APInt>();
 			break;
 		case DynamicValueType::ARRAY_VALUE:
-			new (&data.arrayVal) ArrayValue(other.data.arrayVal);
+			delete &getHeapBox<ArrayValue>();
 			break;
 		case DynamicValueType::STRUCT_VALUE:
-			new (&data.structVal) StructValue(other.data.structVal);
+			delete &getHeapBox<StructValue>();
 			break;
-		case DynamicValueType::UNDEF_VALUE:
+		case DynamicValueType::VECTOR_VALUE:
+			delete &getHeapBox<VectorValue>();
 			break;
+		default:
+			llvm_unreachable("Only wide integers, aggregates and vectors live on the heap");
 	}
+	onHeap = false;
 }
 
-void DynamicValue::moveFrom(DynamicValue&& other)
+void DynamicValue::makeUnique()
 {
-	type = other.type;
+	assert(onHeap);
+	if (data.heapVal->refCount == 1)
+		return;
+
+	--data.heapVal->refCount;
 	switch (type)
 	{
-		case DynamicValueType::INT_VALUE:
-			new (&data.intVal) IntValue(std::move(other.data.intVal));
-			break;
-		case DynamicValueType::FLOAT_VALUE:
-			new (&data.floatVal) FloatValue(std::move(other.data.floatVal));
-			break;
-		case DynamicValueType::POINTER_VALUE:
-			new (&data.ptrVal) PointerValue(std::move(other.data.ptrVal));
-			break;
 		case DynamicValueType::ARRAY_VALUE:
-			new (&data.arrayVal) ArrayValue(std::move(other.data.arrayVal));
+			data.heapVal = new HeapBox<ArrayValue>(ArrayValue(getHeapBox<ArrayValue>().value));
 			break;
 		case DynamicValueType::STRUCT_VALUE:
-			new (&data.structVal) StructValue(std::move(other.data.structVal));
+			data.heapVal = new HeapBox<StructValue>(StructValue(getHeapBox<StructValue>().value));
 			break;
-		case DynamicValueType::UNDEF_VALUE:
+		case DynamicValueType::VECTOR_VALUE:
+			data.heapVal = new HeapBox<VectorValue>(VectorValue(getHeapBox<VectorValue>().value));
 			break;
+		default:
+			llvm_unreachable("Only aggregates and vectors can be modified in place");
 	}
 }
 
-DynamicValue::DynamicValue(const DynamicValue& other)
-{
-	copyFrom(other);
-}
-DynamicValue& DynamicValue::operator=(const DynamicValue& other)
-{
-	if (type != other.type)
-		clear();
-	copyFrom(other);
-	return *this;
-}
-
-DynamicValue::DynamicValue(DynamicValue&& other)
-{
-	moveFrom(std::move(other));
-}
-DynamicValue& DynamicValue::operator=(DynamicValue&& other)
-{
-	if (type != other.type)
-		clear();
-	moveFrom(std::move(other));
-	return *this;
-}
-
-const IntValue& DynamicValue::getAsIntValue() const
-{
-	assert(type == DynamicValueType::INT_VALUE);
-	return data.intVal;
-}
-
-const FloatValue& DynamicValue::getAsFloatValue() const
-{
-	assert(type == DynamicValueType::FLOAT_VALUE);
-	return data.floatVal;
-}
-
-const PointerValue& DynamicValue::getAsPointerValue() const
-{
-	assert(type == DynamicValueType::POINTER_VALUE);
-	return data.ptrVal;
-}
-
 ArrayValue& DynamicValue::getAsArrayValue()
 {
 	assert(type == DynamicValueType::ARRAY_VALUE);
-	return data.arrayVal;
+	makeUnique();
+	return getHeapBox<ArrayValue>().value;
 }
 
 const ArrayValue& DynamicValue::getAsArrayValue() const
 {
 	assert(type == DynamicValueType::ARRAY_VALUE);
-	return data.arrayVal;
+	return getHeapBox<ArrayValue>().value;
 }
 
 StructValue& DynamicValue::getAsStructValue()
 {
 	assert(type == DynamicValueType::STRUCT_VALUE);
-	return data.structVal;
+	makeUnique();
+	return getHeapBox<StructValue>().value;
 }
 
 const StructValue& DynamicValue::getAsStructValue() const
 {
 	assert(type == DynamicValueType::STRUCT_VALUE);
-	return data.structVal;
+	return getHeapBox<StructValue>().value;
 }
 
-DynamicValue DynamicValue::getUndefValue()
+VectorValue& DynamicValue::getAsVectorValue()
 {
-	return DynamicValue();
+	assert(type == DynamicValueType::VECTOR_VALUE);
+	makeUnique();
+	return getHeapBox<VectorValue>().value;
 }
 
-DynamicValue DynamicValue::getIntValue(const llvm::APInt& i)
+const VectorValue& DynamicValue::getAsVectorValue() const
 {
-	return DynamicValue(IntValue(i));
+	assert(type == DynamicValueType::VECTOR_VALUE);
+	return getHeapBox<VectorValue>().value;
 }
 
-DynamicValue DynamicValue::getFloatValue(double f, bool i)
+DynamicValue DynamicValue::getIntValue(const llvm::APInt& i)
 {
-	return DynamicValue(FloatValue(f, i));
-}
+	if (i.getBitWidth() <= 64)
+		return getIntValue(i.getBitWidth(), i.getZExtValue());
 
-DynamicValue DynamicValue::getPointerValue(PointerAddressSpace s, Address a)
-{
-	return DynamicValue(PointerValue(s, a));
+	auto ret = DynamicValue(DynamicValueType::INT_VALUE, i.getBitWidth(), PointerAddressSpace::GLOBAL_SPACE);
+	ret.data.heapVal = new HeapBox<llvm::APInt>(llvm::APInt(i));
+	ret.onHeap = true;
+	return ret;
 }
 
 DynamicValue DynamicValue::getArrayValue(unsigned elemCnt, unsigned elemSize)
 {
-	return DynamicValue(ArrayValue(elemCnt, elemSize));
+	auto ret = DynamicValue(DynamicValueType::ARRAY_VALUE, 0, PointerAddressSpace::GLOBAL_SPACE);
+	ret.data.heapVal = new HeapBox<ArrayValue>(ArrayValue(elemCnt, elemSize));
+	ret.onHeap = true;
+	return ret;
 }
 
 DynamicValue DynamicValue::getStructValue(unsigned sz)
 {
-	return DynamicValue(StructValue(sz));
+	auto ret = DynamicValue(DynamicValueType::STRUCT_VALUE, 0, PointerAddressSpace::GLOBAL_SPACE);
+	ret.data.heapVal = new HeapBox<StructValue>(StructValue(sz));
+	ret.onHeap = true;
+	return ret;
+}
+
+DynamicValue DynamicValue::getVectorValue(unsigned elemCnt, unsigned elemBitWidth, bool isFloat)
+{
+	auto ret = DynamicValue(DynamicValueType::VECTOR_VALUE, 0, PointerAddressSpace::GLOBAL_SPACE);
+	ret.data.heapVal = new HeapBox<VectorValue>(VectorValue(elemCnt, elemBitWidth, isFloat));
+	ret.onHeap = true;
+	return ret;
 }
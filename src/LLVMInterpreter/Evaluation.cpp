@@ -1,39 +1,20 @@
+#include "AtomicOps.h"
+#include "IntegerOps.h"
 #include "Interpreter.h"
+#include "VectorOps.h"
 
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/GlobalAlias.h"
 #include "llvm/IR/Operator.h"
-#include "llvm/IR/PatternMatch.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 
 using namespace llvm;
 using namespace llvm_interpreter;
 
-static Value* findBasePointer(const Value* val)
-{
-	if (auto itp = cast<IntToPtrInst>(val))
-	{
-		Value* srcValue = nullptr;
-		auto op = itp->getOperand(0);
-		if (PatternMatch::match(op, PatternMatch::m_PtrToInt(PatternMatch::m_Value(srcValue))))
-		{
-			return srcValue->stripPointerCasts();
-		}
-		else if (PatternMatch::match(op,
-				PatternMatch::m_Add(
-					PatternMatch::m_PtrToInt(
-					PatternMatch::m_Value(srcValue)),
-				PatternMatch::m_Value())))
-		{
-			return srcValue->stripPointerCasts();
-		}
-	}
-	
-	llvm_unreachable("Unhandled case for findBasePointer()");
-}
-
 DynamicValue Interpreter::loadValue(MemorySection& mem, Address addr, Type* loadType)
 {
 	if (auto intType = dyn_cast<IntegerType>(loadType))
@@ -44,14 +25,14 @@ DynamicValue Interpreter::loadValue(MemorySection& mem, Address addr, Type* load
 		return mem.readAsFloat(addr, loadType->isDoubleTy());
 	else if (auto stType = dyn_cast<StructType>(loadType))
 	{
-		auto stLayout = dataLayout.getStructLayout(stType);
+		auto& stLayout = typeLayouts.getLayout(stType);
 
-		auto retVal = DynamicValue::getStructValue(dataLayout.getTypeAllocSize(stType));
+		auto retVal = DynamicValue::getStructValue(stLayout.allocSize);
 		auto& structVal = retVal.getAsStructValue();
 		for (auto i = 0u, e = stType->getNumElements(); i < e; ++i)
 		{
 			auto elemType = stType->getElementType(i);
-			auto offset = stLayout->getElementOffset(i);
+			auto offset = stLayout.fieldOffsets[i];
 			structVal.addField(offset, loadValue(mem, addr + offset, elemType));
 		}
 		return retVal;
@@ -59,18 +40,22 @@ DynamicValue Interpreter::loadValue(MemorySection& mem, Address addr, Type* load
 	else if (auto arrayType = dyn_cast<ArrayType>(loadType))
 	{
 		auto elemType = arrayType->getElementType();
-		auto elemSize = dataLayout.getTypeAllocSize(elemType);
+		auto elemSize = typeLayouts.getLayout(arrayType).elemSize;
 		auto arraySize = arrayType->getNumElements();
 
 		auto retVal = DynamicValue::getArrayValue(arraySize, elemSize);
 		auto& arrayVal = retVal.getAsArrayValue();
 		for (unsigned i = 0; i < arraySize; ++i)
-		{
-			if (elemType->isAggregateType())
-				arrayVal.setElementAtIndex(i, loadValue(mem, addr + i * elemSize, elemType));
-		}
+			arrayVal.setElementAtIndex(i, loadValue(mem, addr + i * elemSize, elemType));
 		return retVal;
 	}
+	else if (auto vecType = dyn_cast<VectorType>(loadType))
+	{
+		auto elemType = vecType->getElementType();
+		if (!elemType->isIntegerTy() && !elemType->isFloatTy() && !elemType->isDoubleTy())
+			llvm_unreachable("Vector element type not supported");
+		return mem.readAsVector(addr, vecType->getNumElements(), elemType->getScalarSizeInBits(), elemType->isFloatingPointTy());
+	}
 	else
 		llvm_unreachable("Load type not supported");
 };
@@ -82,7 +67,7 @@ DynamicValue Interpreter::readFromPointer(const PointerValue& ptr, Type* loadTyp
 		case PointerAddressSpace::GLOBAL_SPACE:
 			return loadValue(globalMem, ptr.getAddress(), loadType);
 		case PointerAddressSpace::STACK_SPACE:
-			return loadValue(stackMem, ptr.getAddress(), loadType);
+			return loadValue(getStackMem(ptr.getAddress()), ptr.getAddress() & StackOffsetMask, loadType);
 		case PointerAddressSpace::HEAP_SPACE:
 			return loadValue(heapMem, ptr.getAddress(), loadType);
 	}
@@ -95,12 +80,201 @@ void Interpreter::writeToPointer(const PointerValue& ptr, const DynamicValue& va
 		case PointerAddressSpace::GLOBAL_SPACE:
 			return globalMem.write(ptr.getAddress(), val);
 		case PointerAddressSpace::STACK_SPACE:
-			return stackMem.write(ptr.getAddress(), val);
+			return getStackMem(ptr.getAddress()).write(ptr.getAddress() & StackOffsetMask, val);
 		case PointerAddressSpace::HEAP_SPACE:
 			return heapMem.write(ptr.getAddress(), val);
 	}
 }
 
+void* Interpreter::getRawPointer(const PointerValue& ptr)
+{
+	switch (ptr.getAddressSpace())
+	{
+		case PointerAddressSpace::GLOBAL_SPACE:
+			return globalMem.getRawPointerAtAddress(ptr.getAddress());
+		case PointerAddressSpace::STACK_SPACE:
+			return getStackMem(ptr.getAddress()).getRawPointerAtAddress(ptr.getAddress() & StackOffsetMask);
+		case PointerAddressSpace::HEAP_SPACE:
+			return heapMem.getRawPointerAtAddress(ptr.getAddress());
+	}
+	llvm_unreachable("Unknown address space");
+}
+
+// Compare two integers (or two pointers) according to an icmp predicate
+static bool evaluateICmp(unsigned predicate, const DynamicValue& val0, const DynamicValue& val1)
+{
+	// ICmp can compare both integers and pointers
+	if (val0.isIntValue() && val1.isIntValue())
+	{
+		auto intVal0 = val0.getAsIntValue();
+		auto intVal1 = val1.getAsIntValue();
+		if (intVal0.getBitWidth() <= 64)
+		{
+			return withNativeIntOps(intVal0.getBitWidth(),
+				[predicate, &intVal0, &intVal1] (auto ops)
+				{
+					return ops.compare(predicate, intVal0.getZExtValue(), intVal1.getZExtValue());
+				}
+			);
+		}
+		else
+			return WideIntOps().compare(predicate, intVal0.getInt(), intVal1.getInt());
+	}
+	else if (val0.isPointerValue() && val1.isPointerValue())
+		return NativeIntOps<64>().compare(predicate, val0.getAsPointerValue().getAddress(), val1.getAsPointerValue().getAddress());
+	else
+		llvm_unreachable("Illegal icmp compare types");
+}
+
+// Compare two floating point numbers according to an fcmp predicate
+static bool evaluateFCmp(unsigned predicate, double f0, double f1)
+{
+	auto isF0Nan = std::isnan(f0);
+	auto isF1Nan = std::isnan(f1);
+	auto bothNotNan = !isF0Nan && !isF1Nan;
+	auto eitherIsNan = isF0Nan || isF1Nan;
+
+	switch (predicate)
+	{
+		case CmpInst::FCMP_FALSE:
+			return false;
+		case CmpInst::FCMP_OEQ:
+			return bothNotNan && f0 == f1;
+		case CmpInst::FCMP_OGT:
+			return bothNotNan && f0 > f1;
+		case CmpInst::FCMP_OGE:
+			return bothNotNan && f0 >= f1;
+		case CmpInst::FCMP_OLT:
+			return bothNotNan && f0 < f1;
+		case CmpInst::FCMP_OLE:
+			return bothNotNan && f0 <= f1;
+		case CmpInst::FCMP_ONE:
+			return bothNotNan && f0 != f1;
+		case CmpInst::FCMP_ORD:
+			return bothNotNan;
+		case CmpInst::FCMP_UEQ:
+			return eitherIsNan || f0 == f1;
+		case CmpInst::FCMP_UGT:
+			return eitherIsNan || f0 > f1;
+		case CmpInst::FCMP_UGE:
+			return eitherIsNan || f0 >= f1;
+		case CmpInst::FCMP_ULT:
+			return eitherIsNan || f0 < f1;
+		case CmpInst::FCMP_ULE:
+			return eitherIsNan || f0 <= f1;
+		case CmpInst::FCMP_UNE:
+			return eitherIsNan || f0 != f1;
+		case CmpInst::FCMP_UNO:
+			return eitherIsNan;
+		case CmpInst::FCMP_TRUE:
+			return true;
+		default:
+			llvm_unreachable("Illegal fcmp predicate");
+	}
+}
+
+// Return the element at the given index path of an aggregate value
+static DynamicValue extractAggregateElement(const DynamicValue& aggVal, const unsigned* idxs, unsigned numIdx)
+{
+	auto retVal = aggVal;
+	for (auto i = 0u; i < numIdx; ++i)
+	{
+		if (retVal.isStructValue())
+		{
+			auto fieldVal = retVal.getAsStructValue().getFieldAtNum(idxs[i]);
+			retVal = std::move(fieldVal);
+		}
+		else if (retVal.isArrayValue())
+		{
+			auto elemVal = retVal.getAsArrayValue().getElementAtIndex(idxs[i]);
+			retVal = std::move(elemVal);
+		}
+		else
+			llvm_unreachable("extractvalue into a non-aggregate type!");
+	}
+	return retVal;
+}
+
+// Replace the element at the given index path of an aggregate value
+static void insertAggregateElement(DynamicValue& aggVal, const unsigned* idxs, unsigned numIdx, DynamicValue&& val)
+{
+	if (numIdx == 0)
+	{
+		aggVal = std::move(val);
+		return;
+	}
+
+	if (aggVal.isStructValue())
+	{
+		auto& structVal = aggVal.getAsStructValue();
+		auto fieldVal = structVal.getFieldAtNum(idxs[0]);
+		insertAggregateElement(fieldVal, idxs + 1, numIdx - 1, std::move(val));
+		structVal.setFieldAtNum(idxs[0], std::move(fieldVal));
+	}
+	else if (aggVal.isArrayValue())
+	{
+		auto& arrayVal = aggVal.getAsArrayValue();
+		auto elemVal = arrayVal.getElementAtIndex(idxs[0]);
+		insertAggregateElement(elemVal, idxs + 1, numIdx - 1, std::move(val));
+		arrayVal.setElementAtIndex(idxs[0], std::move(elemVal));
+	}
+	else
+		llvm_unreachable("insertvalue into a non-aggregate type!");
+}
+
+// The bits a scalar is stored as, for the atomic instructions. Pointers keep the tag of their address space
+static uint64_t getAtomicBits(const DynamicValue& val)
+{
+	if (val.isPointerValue())
+		return MemorySection::tagAddress(val.getAsPointerValue().getAddressSpace(), val.getAsPointerValue().getAddress());
+	else if (val.isFloatValue())
+	{
+		auto fpVal = val.getAsFloatValue();
+		auto bits = uint64_t(0);
+		if (fpVal.isDouble())
+		{
+			auto d = fpVal.getFloat();
+			std::memcpy(&bits, &d, sizeof(d));
+		}
+		else
+		{
+			auto f = static_cast<float>(fpVal.getFloat());
+			auto fBits = uint32_t(0);
+			std::memcpy(&fBits, &f, sizeof(f));
+			bits = fBits;
+		}
+		return bits;
+	}
+	else
+		return val.getAsIntValue().getZExtValue();
+}
+
+// The scalar of type ty stored as bits, the other way round
+static DynamicValue getAtomicValue(uint64_t bits, const Type* ty)
+{
+	if (ty->isPointerTy())
+	{
+		auto addrSpace = PointerAddressSpace::GLOBAL_SPACE;
+		auto addr = MemorySection::untagAddress(bits, addrSpace);
+		return DynamicValue::getPointerValue(addrSpace, addr);
+	}
+	else if (ty->isDoubleTy())
+	{
+		auto d = 0.0;
+		std::memcpy(&d, &bits, sizeof(d));
+		return DynamicValue::getFloatValue(d, true);
+	}
+	else if (ty->isFloatTy())
+	{
+		auto fBits = static_cast<uint32_t>(bits);
+		auto f = 0.0f;
+		std::memcpy(&f, &fBits, sizeof(f));
+		return DynamicValue::getFloatValue(f, false);
+	}
+	else
+		return DynamicValue::getIntValue(ty->getIntegerBitWidth(), bits);
+}
+
 DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 {
 	switch (cv->getValueID())
@@ -111,15 +285,15 @@ DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 			if (type->isStructTy())
 			{
 				auto stType = cast<StructType>(type);
-				auto stLayout = dataLayout.getStructLayout(stType);
+				auto& stLayout = typeLayouts.getLayout(stType);
 
-				auto retVal = DynamicValue::getStructValue(dataLayout.getTypeAllocSize(stType));
+				auto retVal = DynamicValue::getStructValue(stLayout.allocSize);
 				auto& structVal = retVal.getAsStructValue();
 				for (auto i = 0u, e = stType->getNumElements(); i < e; ++i)
 				{
 					auto elemType = stType->getElementType(i);
-					auto offset = stLayout->getElementOffset(i);
-					if (!elemType->isAggregateType())
+					auto offset = stLayout.fieldOffsets[i];
+					if (!elemType->isAggregateType() && !elemType->isVectorTy())
 						structVal.addField(offset, DynamicValue::getUndefValue());
 					else
 						structVal.addField(offset, evaluateConstant(UndefValue::get(elemType)));
@@ -132,17 +306,20 @@ DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 				auto elemType = arrayType->getElementType();
 				auto arraySize = arrayType->getNumElements();
 
-				auto retVal = DynamicValue::getArrayValue(arraySize, dataLayout.getTypeAllocSize(elemType));
+				auto retVal = DynamicValue::getArrayValue(arraySize, typeLayouts.getTypeAllocSize(elemType));
 				auto& arrayVal = retVal.getAsArrayValue();
 				for (unsigned i = 0; i < arraySize; ++i)
 				{
-					if (elemType->isAggregateType())
+					if (elemType->isAggregateType() || elemType->isVectorTy())
 						arrayVal.setElementAtIndex(i, evaluateConstant(UndefValue::get(elemType)));
 				}
 				return std::move(retVal);
 			}
 			else if (type->isVectorTy())
-				llvm_unreachable("Vector type not supported");
+			{
+				// The lanes of a vector cannot be undef individually, so they are zero
+				return createVectorValue(type);
+			}
 			else
 				return DynamicValue::getUndefValue();
 		}
@@ -164,13 +341,13 @@ DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 			if (type->isStructTy())
 			{
 				auto stType = cast<StructType>(type);
-				auto stLayout = dataLayout.getStructLayout(stType);
+				auto& stLayout = typeLayouts.getLayout(stType);
 
-				auto retVal = DynamicValue::getStructValue(dataLayout.getTypeAllocSize(stType));
+				auto retVal = DynamicValue::getStructValue(stLayout.allocSize);
 				auto& structVal = retVal.getAsStructValue();
 				for (auto i = 0u, e = stType->getNumElements(); i < e; ++i)
 				{
-					auto offset = stLayout->getElementOffset(i);
+					auto offset = stLayout.fieldOffsets[i];
 					structVal.addField(offset, evaluateConstant(caz->getStructElement(i)));
 				}
 				return std::move(retVal);
@@ -181,7 +358,7 @@ DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 				auto elemType = arrayType->getElementType();
 				auto arraySize = arrayType->getNumElements();
 
-				auto retVal = DynamicValue::getArrayValue(arraySize, dataLayout.getTypeAllocSize(elemType));
+				auto retVal = DynamicValue::getArrayValue(arraySize, typeLayouts.getTypeAllocSize(elemType));
 				auto& arrayVal = retVal.getAsArrayValue();
 				for (unsigned i = 0; i < arraySize; ++i)
 				{
@@ -189,20 +366,42 @@ DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 				}
 				return std::move(retVal);
 			}
+			else if (type->isVectorTy())
+				return createVectorValue(type);
 			else
-				llvm_unreachable("ConstantAggregateZero not an array or a struct?");
+				llvm_unreachable("ConstantAggregateZero not an array, a struct or a vector?");
 		}
 		case Value::ConstantDataArrayVal:
 		{
 			auto cda = cast<ConstantDataArray>(cv);
 			auto arraySize = cda->getNumElements();
 
-			auto retVal = DynamicValue::getArrayValue(arraySize, dataLayout.getTypeAllocSize(cda->getType()->getElementType()));
+			auto retVal = DynamicValue::getArrayValue(arraySize, typeLayouts.getTypeAllocSize(cda->getType()->getElementType()));
 			auto& arrayVal = retVal.getAsArrayValue();
 			for (unsigned i = 0; i < arraySize; ++i)
 				arrayVal.setElementAtIndex(i, evaluateConstant(cda->getElementAsConstant(i)));
 			return retVal;
 		}
+		case Value::ConstantDataVectorVal:
+		{
+			auto cdv = cast<ConstantDataVector>(cv);
+
+			auto retVal = createVectorValue(cdv->getType());
+			auto& vecVal = retVal.getAsVectorValue();
+			for (auto i = 0u, e = cdv->getNumElements(); i < e; ++i)
+				vecVal.setElementAtIndex(i, evaluateConstant(cdv->getElementAsConstant(i)));
+			return retVal;
+		}
+		case Value::ConstantVectorVal:
+		{
+			auto cVector = cast<ConstantVector>(cv);
+
+			auto retVal = createVectorValue(cVector->getType());
+			auto& vecVal = retVal.getAsVectorValue();
+			for (auto i = 0u, e = cVector->getNumOperands(); i < e; ++i)
+				vecVal.setElementAtIndex(i, evaluateConstant(cVector->getOperand(i)));
+			return retVal;
+		}
 		case Value::ConstantIntVal:
 		{
 			auto cInt = cast<ConstantInt>(cv);
@@ -218,7 +417,7 @@ DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 			auto cArray = cast<ConstantArray>(cv);
 			auto arraySize = cArray->getType()->getNumElements();
 
-			auto retVal = DynamicValue::getArrayValue(arraySize, dataLayout.getTypeAllocSize(cArray->getType()->getElementType()));
+			auto retVal = DynamicValue::getArrayValue(arraySize, typeLayouts.getTypeAllocSize(cArray->getType()->getElementType()));
 			auto& arrayVal = retVal.getAsArrayValue();
 			for (unsigned i = 0; i < arraySize; ++i)
 				arrayVal.setElementAtIndex(i, evaluateConstant(cArray->getOperand(i)));
@@ -228,13 +427,13 @@ DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 		{
 			auto cStruct = cast<ConstantStruct>(cv);
 			auto stSize = cStruct->getType()->getNumElements();
-			auto stLayout = dataLayout.getStructLayout(cStruct->getType());
+			auto& stLayout = typeLayouts.getLayout(cStruct->getType());
 
-			auto retVal = DynamicValue::getStructValue(dataLayout.getTypeAllocSize(cStruct->getType()));
+			auto retVal = DynamicValue::getStructValue(stLayout.allocSize);
 			auto& structVal = retVal.getAsStructValue();
 			for (unsigned i = 0; i < stSize; ++i)
 			{
-				auto offset = stLayout->getElementOffset(i);
+				auto offset = stLayout.fieldOffsets[i];
 				structVal.addField(offset, evaluateConstant(cStruct->getOperand(i)));
 			}
 			return retVal;
@@ -252,18 +451,62 @@ DynamicValue Interpreter::evaluateConstant(const llvm::Constant* cv)
 			auto funAddr = globalEnv.at(fun);
 			return DynamicValue::getPointerValue(PointerAddressSpace::GLOBAL_SPACE, funAddr);
 		}
+		case Value::BlockAddressVal:
+		{
+			auto blockAddr = cast<BlockAddress>(cv);
+			return DynamicValue::getPointerValue(PointerAddressSpace::GLOBAL_SPACE, getBlockAddress(blockAddr->getBasicBlock()));
+		}
 	}
 
 	llvm_unreachable("unsupported constant for evaluateConstant()");
 }
 
+void Interpreter::initializeGlobalMem(Address addr, const llvm::Constant* cv)
+{
+	switch (cv->getValueID())
+	{
+		case Value::UndefValueVal:
+			break;
+		case Value::ConstantAggregateZeroVal:
+			std::memset(globalMem.getRawPointerAtAddress(addr), 0, typeLayouts.getTypeAllocSize(cv->getType()));
+			break;
+		case Value::ConstantDataArrayVal:
+		case Value::ConstantDataVectorVal:
+		{
+			// The elements are integers of 8 to 64 bits or floating point numbers, which the raw data holds back to back in host byte order. Both arrays of them and our vectors lay them out the same way in memory
+			auto rawData = cast<ConstantDataSequential>(cv)->getRawDataValues();
+			std::memcpy(globalMem.getRawPointerAtAddress(addr), rawData.data(), rawData.size());
+			break;
+		}
+		case Value::ConstantArrayVal:
+		{
+			auto cArray = cast<ConstantArray>(cv);
+			auto elemSize = typeLayouts.getLayout(cArray->getType()).elemSize;
+			for (auto i = 0u, e = cArray->getNumOperands(); i < e; ++i)
+				initializeGlobalMem(addr + i * elemSize, cArray->getOperand(i));
+			break;
+		}
+		case Value::ConstantStructVal:
+		{
+			auto cStruct = cast<ConstantStruct>(cv);
+			auto& stLayout = typeLayouts.getLayout(cStruct->getType());
+			for (auto i = 0u, e = cStruct->getNumOperands(); i < e; ++i)
+				initializeGlobalMem(addr + stLayout.fieldOffsets[i], cStruct->getOperand(i));
+			break;
+		}
+		default:
+			globalMem.write(addr, evaluateConstant(cv));
+			break;
+	}
+}
+
 DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 {
 	// Local helper function to avoid code duplication
 	auto evaluateConstantIntUnOp = [this, cexpr] (auto unOp) -> DynamicValue
 	{
 		auto srcVal = evaluateConstant(cexpr->getOperand(0));
-		auto& srcIntVal = srcVal.getAsIntValue();
+		auto srcIntVal = srcVal.getAsIntValue();
 		// Heap memory reuse
 		return DynamicValue::getIntValue(unOp(srcIntVal.getInt()));
 	};
@@ -273,8 +516,8 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 		auto srcVal0 = evaluateConstant(cexpr->getOperand(0));
 		auto srcVal1 = evaluateConstant(cexpr->getOperand(1));
 
-		auto& srcIntVal0 = srcVal0.getAsIntValue();
-		auto& srcIntVal1 = srcVal1.getAsIntValue();
+		auto srcIntVal0 = srcVal0.getAsIntValue();
+		auto srcIntVal1 = srcVal1.getAsIntValue();
 		// Heap memory reuse
 		return DynamicValue::getIntValue(binOp(srcIntVal0.getInt(), srcIntVal1.getInt()));
 	};
@@ -284,8 +527,8 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 		auto srcVal0 = evaluateConstant(cexpr->getOperand(0));
 		auto srcVal1 = evaluateConstant(cexpr->getOperand(1));
 
-		auto& srcFloatVal0 = srcVal0.getAsFloatValue();
-		auto& srcFloatVal1 = srcVal1.getAsFloatValue();
+		auto srcFloatVal0 = srcVal0.getAsFloatValue();
+		auto srcFloatVal1 = srcVal1.getAsFloatValue();
 		assert(srcFloatVal0.isDouble() == srcFloatVal1.isDouble());
 		return DynamicValue::getFloatValue(binOp(srcFloatVal0.getFloat(), srcFloatVal1.getFloat()), srcFloatVal0.isDouble());
 	};
@@ -330,7 +573,7 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 				llvm_unreachable("Invalid FPTrunc instruction");
 
 			auto srcVal = evaluateConstant(cexpr->getOperand(0));
-			auto& srcFloatVal = srcVal.getAsFloatValue();
+			auto srcFloatVal = srcVal.getAsFloatValue();
 			assert(srcFloatVal.isDouble());
 			return DynamicValue::getFloatValue(static_cast<float>(srcFloatVal.getFloat()), false);
 		}
@@ -342,7 +585,7 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 				llvm_unreachable("Invalid FPExt instruction");
 
 			auto srcVal = evaluateConstant(cexpr->getOperand(0));
-			auto& srcFloatVal = srcVal.getAsFloatValue();
+			auto srcFloatVal = srcVal.getAsFloatValue();
 			assert(!srcFloatVal.isDouble());
 			// FPExt is a noop in this implementation
 			return DynamicValue::getFloatValue(srcFloatVal.getFloat(), true);
@@ -544,54 +787,9 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 		}
 		case Instruction::ICmp:
 		{
-			auto cmp = [cexpr] (const APInt& i0, const APInt& i1)
-			{
-				switch (cexpr->getPredicate())
-				{
-					case CmpInst::ICMP_EQ:
-						return APInt(1, i0 == i1);
-					case CmpInst::ICMP_NE:
-						return APInt(1, i0 != i1);
-					case CmpInst::ICMP_UGT:
-						return APInt(1, i0.ugt(i1));
-					case CmpInst::ICMP_UGE:
-						return APInt(1, i0.uge(i1));
-					case CmpInst::ICMP_ULT:
-						return APInt(1, i0.ult(i1));
-					case CmpInst::ICMP_ULE:
-						return APInt(1, i0.ule(i1));
-					case CmpInst::ICMP_SGT:
-						return APInt(1, i0.sgt(i1));
-					case CmpInst::ICMP_SGE:
-						return APInt(1, i0.sge(i1));
-					case CmpInst::ICMP_SLT:
-						return APInt(1, i0.slt(i1));
-					case CmpInst::ICMP_SLE:
-						return APInt(1, i0.sle(i1));
-					default:
-						llvm_unreachable("Illegal icmp predicate");
-				}
-			};
-
-			// ICmp can compare both integers and pointers, so we cannot just use evaluateIntBinOp
 			auto val0 = evaluateConstant(cexpr->getOperand(0));
 			auto val1 = evaluateConstant(cexpr->getOperand(1));
-			if (val0.isIntValue() && val1.isIntValue())
-			{
-				auto& intVal0 = val0.getAsIntValue();
-				auto res = cmp(intVal0.getInt(), val1.getAsIntValue().getInt());
-				return DynamicValue::getIntValue(res);
-			}
-			else if (val0.isPointerValue() && val1.isPointerValue())
-			{
-				auto ptrSize = dataLayout.getPointerSizeInBits();
-				auto addr0 = val0.getAsPointerValue().getAddress();
-				auto addr1 = val1.getAsPointerValue().getAddress();
-				auto res = cmp(APInt(ptrSize, addr0), APInt(ptrSize, addr1));
-				return DynamicValue::getIntValue(res);
-			}
-			else
-				llvm_unreachable("Illegal icmp compare types");
+			return DynamicValue::getIntValue(APInt(1, evaluateICmp(cexpr->getPredicate(), val0, val1)));
 		}
 		case Instruction::FAdd:
 		{
@@ -634,7 +832,7 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 			return evaluateConstantFloatBinOp(
 				[] (double f0, double f1)
 				{
-					return std::remainder(f0, f1);
+					return std::fmod(f0, f1);
 				}
 			);
 		}
@@ -645,54 +843,12 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 
 			auto f0 = srcVal0.getAsFloatValue().getFloat();
 			auto f1 = srcVal1.getAsFloatValue().getFloat();
-			auto isF0Nan = std::isnan(f0);
-			auto isF1Nan = std::isnan(f1);
-			auto bothNotNan = !isF0Nan && !isF1Nan;
-			auto eitherIsNan = isF0Nan || isF1Nan;
-
-			switch (cexpr->getPredicate())
-			{
-				case CmpInst::FCMP_FALSE:
-					return DynamicValue::getIntValue(APInt(1, false));
-				case CmpInst::FCMP_OEQ:
-					return DynamicValue::getIntValue(APInt(1, bothNotNan && f0 == f1));
-				case CmpInst::FCMP_OGT:
-					return DynamicValue::getIntValue(APInt(1, bothNotNan && f0 > f1));
-				case CmpInst::FCMP_OGE:
-					return DynamicValue::getIntValue(APInt(1, bothNotNan && f0 >= f1));
-				case CmpInst::FCMP_OLT:
-					return DynamicValue::getIntValue(APInt(1, bothNotNan && f0 < f1));
-				case CmpInst::FCMP_OLE:
-					return DynamicValue::getIntValue(APInt(1, bothNotNan && f0 <= f1));
-				case CmpInst::FCMP_ONE:
-					return DynamicValue::getIntValue(APInt(1, bothNotNan && f0 != f1));
-				case CmpInst::FCMP_ORD:
-					return DynamicValue::getIntValue(APInt(1, bothNotNan));
-				case CmpInst::FCMP_UEQ:
-					return DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 == f1));
-				case CmpInst::FCMP_UGT:
-					return DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 > f1));
-				case CmpInst::FCMP_UGE:
-					return DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 >= f1));
-				case CmpInst::FCMP_ULT:
-					return DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 < f1));
-				case CmpInst::FCMP_ULE:
-					return DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 <= f1));
-				case CmpInst::FCMP_UNE:
-					return DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 != f1));
-				case CmpInst::FCMP_UNO:
-					return DynamicValue::getIntValue(APInt(1, eitherIsNan));
-				case CmpInst::FCMP_TRUE:
-					return DynamicValue::getIntValue(APInt(1, false));
-				default:
-					llvm_unreachable("Illegal fcmp predicate");
-			}
+			return DynamicValue::getIntValue(APInt(1, evaluateFCmp(cexpr->getPredicate(), f0, f1)));
 		}
 		case Instruction::Select:
 		{
 			auto condVal = evaluateConstant(cexpr->getOperand(0));
-			auto condInt = condVal.getAsIntValue().getInt().getBoolValue();
-			if (condInt)
+			if (condVal.getAsIntValue().getZExtValue() != 0)
 				return evaluateConstant(cexpr->getOperand(1));
 			else
 				return evaluateConstant(cexpr->getOperand(2));
@@ -703,55 +859,21 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 			auto offsetInt = APInt(dataLayout.getPointerSizeInBits(), 0);
 			cast<GEPOperator>(cexpr)->accumulateConstantOffset(dataLayout, offsetInt);
 
-			auto& basePtrVal = baseVal.getAsPointerValue();
+			auto basePtrVal = baseVal.getAsPointerValue();
 			return DynamicValue::getPointerValue(basePtrVal.getAddressSpace(), basePtrVal.getAddress() + offsetInt.getZExtValue());
 		}
 		case Instruction::ExtractValue:
 		{
 			auto baseVal = evaluateConstant(cexpr->getOperand(0));
-			for (auto i = 1u, e = cexpr->getNumOperands(); i < e; ++i)
-			{
-				auto idxVal = evaluateConstant(cexpr->getOperand(i));
-				auto seqNum = idxVal.getAsIntValue().getInt().getZExtValue();
-				if (baseVal.isStructValue())
-				{
-					auto fieldVal = baseVal.getAsStructValue().getFieldAtNum(seqNum);
-					baseVal = std::move(fieldVal);
-				}
-				else if (baseVal.isArrayValue())
-				{
-					auto elemVal = baseVal.getAsArrayValue().getElementAtIndex(seqNum);
-					baseVal = std::move(elemVal);
-				}
-				else
-					llvm_unreachable("extractvalue into a non-aggregate value!");
-			}
-			return baseVal;
+			auto indices = cexpr->getIndices();
+			return extractAggregateElement(baseVal, indices.data(), indices.size());
 		}
 		case Instruction::InsertValue:
 		{
 			auto baseVal = evaluateConstant(cexpr->getOperand(0));
-			auto& tmpBaseVal = baseVal;
-			for (auto i = 2u, e = cexpr->getNumOperands(); i < e; ++i)
-			{
-				auto idxVal = evaluateConstant(cexpr->getOperand(i));
-				auto seqNum = idxVal.getAsIntValue().getInt().getZExtValue();
-				if (baseVal.isStructValue())
-				{
-					auto fieldVal = baseVal.getAsStructValue().getFieldAtNum(seqNum);
-					baseVal = std::move(fieldVal);
-				}
-				else if (baseVal.isArrayValue())
-				{
-					auto elemVal = baseVal.getAsArrayValue().getElementAtIndex(seqNum);
-					baseVal = std::move(elemVal);
-				}
-				else
-					llvm_unreachable("insertvalue into a non-aggregate value!");
-			}
-			baseVal = evaluateConstant(cexpr->getOperand(1));
-
-			return tmpBaseVal;
+			auto indices = cexpr->getIndices();
+			insertAggregateElement(baseVal, indices.data(), indices.size(), evaluateConstant(cexpr->getOperand(1)));
+			return baseVal;
 		}
 
 		case Instruction::InsertElement:
@@ -763,690 +885,1383 @@ DynamicValue Interpreter::evaluateConstantExpr(const llvm::ConstantExpr* cexpr)
 	}
 }
 
-DynamicValue Interpreter::evaluateOperand(const StackFrame& frame, const llvm::Value* v)
+const DynamicValue& Interpreter::getConstantValue(unsigned idx)
+{
+	// The cache grows as the translator hands out new indices. std::deque never moves its elements on push_back, so the references we handed out earlier stay valid
+	while (constantCache.size() <= idx)
+		constantCache.push_back(CachedConstant{DynamicValue::getUndefValue(), false});
+
+	auto& entry = constantCache[idx];
+	if (!entry.evaluated)
+	{
+		auto constant = preparedModule->getConstant(idx);
+		// Evaluating a constant may create other constants in the LLVMContext
+		auto lock = preparedModule->lockContext();
+		entry.value = evaluateConstant(constant);
+		entry.evaluated = true;
+	}
+	return entry.value;
+}
+
+const char* Interpreter::getDispatchMode()
 {
-	if (auto cv = dyn_cast<Constant>(v))
-		return evaluateConstant(cv);
+#ifdef LLVM_INTERPRETER_THREADED_DISPATCH
+	return "threaded";
+#else
+	return "switch";
+#endif
+}
+
+const DynamicValue& Interpreter::evaluateOperand(const StackFrame& frame, const Operand& op)
+{
+	if (op.kind == OperandKind::REGISTER)
+		return frame.lookup(op.index);
 	else
-		return frame.lookup(v);
+		return getConstantValue(op.index);
+}
+
+const Interpreter::CallTarget& Interpreter::getCallTarget(const PreparedInstruction& inst, const StackFrame& frame)
+{
+	// A direct call always calls inst.callee, so its target is cached under address 0
+	auto funAddr = Address(0);
+	if (inst.callee == nullptr)
+		funAddr = evaluateOperand(frame, frame.getPreparedFunction().getOperand(inst, 0)).getAsPointerValue().getAddress();
+
+	auto& cache = inlineCaches[inst.callSite];
+	for (auto i = 0u; i < cache.numEntries; ++i)
+		if (cache.entries[i].funAddr == funAddr)
+			return cache.entries[i];
+
+	return resolveCallTarget(cache, inst, funAddr);
 }
 
-void Interpreter::evaluateInstruction(StackFrame& frame, const llvm::Instruction* inst)
+const Interpreter::CallTarget& Interpreter::resolveCallTarget(InlineCache& cache, const PreparedInstruction& inst, Address funAddr)
 {
-	//errs() << "Eval " << *inst << "\n";
-	auto evaluateIntBinOp = [this, &frame, inst] (auto binOp)
+	auto f = (inst.callee != nullptr) ? inst.callee : getFunctionAtAddress(funAddr);
+
+	auto target = CallTarget{funAddr, f, nullptr, ExternalCallType()};
+	if (f->isDeclaration())
+		target.externalType = externals.getExternalCallType(f);
+	else
+		target.prepared = &getPreparedFunction(f);
+
+	auto entryIdx = cache.numEntries;
+	if (cache.numEntries < InlineCache::NumEntries)
+		++cache.numEntries;
+	else
 	{
-		auto val0 = evaluateOperand(frame, inst->getOperand(0));
-		auto val1 = evaluateOperand(frame, inst->getOperand(1));
-		auto& intVal0 = val0.getAsIntValue();
-		auto& intVal1 = val1.getAsIntValue();
+		entryIdx = cache.nextVictim;
+		cache.nextVictim = (cache.nextVictim + 1) % InlineCache::NumEntries;
+	}
+	cache.entries[entryIdx] = target;
+	return cache.entries[entryIdx];
+}
 
-		frame.insertBinding(inst, DynamicValue::getIntValue(binOp(intVal0.getInt(), intVal1.getInt())));
-	};
+NativeTier::EntryPoint Interpreter::getNativeEntry(const PreparedFunction& f)
+{
+	auto& profile = profiles[f.getId()];
+	++profile.numCalls;
 
-	auto evaluateFloatBinOp = [this, &frame, inst] (auto binOp)
+	// A function that could not be compiled is not tried again
+	if (profile.nativeEntry != nullptr || profile.tierUpAttempted)
+		return profile.nativeEntry;
+
+	// The selection, if any, takes precedence over the call counts: a function it keeps interpreted is never compiled, however hot
+	auto isHot = (tierUpThreshold != 0 && !nativeSelector && profile.numCalls + profile.numBackEdges >= tierUpThreshold);
+	if (profile.selectedNative || isHot)
 	{
-		auto val0 = evaluateOperand(frame, inst->getOperand(0));
-		auto val1 = evaluateOperand(frame, inst->getOperand(1));
-		auto& fpVal0 = val0.getAsFloatValue();
-		auto& fpVal1 = val1.getAsFloatValue();
-		assert(fpVal0.isDouble() == fpVal1.isDouble());
+		profile.tierUpAttempted = true;
+		// Compiling creates IR in the LLVMContext, which the threads of the guest program may be using too. The functions that cannot be compiled have been reported by runMain()
+		auto lock = preparedModule->lockContext();
+		profile.nativeEntry = nativeTier->compile(f.getFunction(), nativeSelector.get());
+	}
+	return profile.nativeEntry;
+}
 
-		frame.insertBinding(inst, DynamicValue::getFloatValue(binOp(fpVal0.getFloat(), fpVal1.getFloat()), fpVal0.isDouble()));
-	};
+NativeTier::Environment Interpreter::getNativeEnvironment()
+{
+	auto env = NativeTier::Environment();
+	// The sections never move, so their host addresses can be compiled in
+	env.globalBase = static_cast<uint8_t*>(globalMem.getRawPointerAtAddress(0));
+	env.heapBase = static_cast<uint8_t*>(heapMem.getRawPointerAtAddress(0));
+	env.stackBase = static_cast<uint8_t*>(stackMem.getRawPointerAtAddress(0));
+	env.threadId = threadId;
+	env.stackThreadShift = StackThreadShift;
+	env.globalAddresses = &globalEnv;
+	env.context = this;
+	env.callInterpreter = nativeCallInterpreter;
+	env.translatePointer = nativeTranslatePointer;
+	env.allocateStack = nativeAllocateStack;
+	env.saveStack = nativeSaveStack;
+	env.restoreStack = nativeRestoreStack;
+	return env;
+}
 
-	auto evaluateIntUnOp = [this, &frame, inst] (auto unOp)
+uint64_t Interpreter::callFromNative(const CallInst* site, uint64_t funWord, const uint64_t* args)
+{
+	const Function* f = site->getCalledFunction();
+	if (f == nullptr)
 	{
-		auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-		auto& srcIntVal = srcVal.getAsIntValue();
+		auto addrSpace = PointerAddressSpace::GLOBAL_SPACE;
+		auto funAddr = MemorySection::untagAddress(funWord, addrSpace);
+		if (addrSpace != PointerAddressSpace::GLOBAL_SPACE)
+			throw std::out_of_range("Calling through a pointer that does not point to a function");
+		f = getFunctionAtAddress(funAddr);
+	}
+
+	// A callee that is compiled as well takes the words as they are
+	if (!f->isDeclaration())
+		if (auto nativeEntry = getNativeEntry(getPreparedFunction(f)))
+			return nativeEntry(args);
+
+	auto argVals = std::vector<DynamicValue>();
+	argVals.reserve(site->getNumArgOperands());
+	for (auto i = 0u, e = site->getNumArgOperands(); i < e; ++i)
+		argVals.push_back(NativeTier::decodeValue(args[i], site->getArgOperand(i)->getType()));
+
+	auto retVal = f->isDeclaration() ? callExternalFunction(ImmutableCallSite(site), externals.getExternalCallType(f), std::move(argVals)) : callFunction(f, std::move(argVals));
+	return site->getType()->isVoidTy() ? 0 : NativeTier::encodeValue(retVal);
+}
+
+uint64_t Interpreter::nativeCallInterpreter(void* context, const CallInst* site, uint64_t funWord, const uint64_t* args)
+{
+	return static_cast<Interpreter*>(context)->callFromNative(site, funWord, args);
+}
+
+void* Interpreter::nativeTranslatePointer(void* context, uint64_t ptr)
+{
+	auto addrSpace = PointerAddressSpace::GLOBAL_SPACE;
+	auto addr = MemorySection::untagAddress(ptr, addrSpace);
+	return static_cast<Interpreter*>(context)->getRawPointer(DynamicValue::getPointerValue(addrSpace, addr).getAsPointerValue());
+}
+
+uint64_t Interpreter::nativeAllocateStack(void* context, uint64_t size)
+{
+	auto interpreter = static_cast<Interpreter*>(context);
+	auto addr = (Address(interpreter->threadId) << StackThreadShift) | interpreter->stackMem.allocate(size);
+	return MemorySection::tagAddress(PointerAddressSpace::STACK_SPACE, addr);
+}
+
+uint64_t Interpreter::nativeSaveStack(void* context)
+{
+	return static_cast<Interpreter*>(context)->stackMem.getUsedSize();
+}
+
+void Interpreter::nativeRestoreStack(void* context, uint64_t mark)
+{
+	auto& stackMem = static_cast<Interpreter*>(context)->stackMem;
+	stackMem.deallocate(stackMem.getUsedSize() - mark);
+}
 
-		frame.insertBinding(inst, DynamicValue::getIntValue(unOp(srcIntVal.getInt())));
+DynamicValue Interpreter::runFunction(StackFrame& entryFrame)
+{
+	// The frame being executed, its code, and the position of the next instruction in the code array
+	auto frame = &entryFrame;
+	auto fn = &frame->getPreparedFunction();
+	auto code = fn->getCode();
+	auto pc = fn->getBlock(0).entry;
+
+	// Once the stack drops below this depth, entryFrame has returned
+	auto entryDepth = stack.getNumFrames();
+
+	auto getOperandValue = [this, &frame, &fn] (const PreparedInstruction& inst, unsigned i) -> const DynamicValue&
+	{
+		return evaluateOperand(*frame, fn->getOperand(inst, i));
 	};
 
-	switch (inst->getOpcode())
+	// Take a CFG edge: perform the phi copies of the edge, then continue at the entry of the target block. The copies are ordered by the translator so that they can be performed one by one
+	// An edge that goes backwards in the code array closes a loop. Those are counted for the tiering decision, if there is one. Note that a running loop is not transferred to native code: the function is compiled for its next call
+	auto branchTo = [this, &frame, &fn, &pc] (unsigned edgeIdx)
 	{
-		// Standard binary operators...
-		case Instruction::Add:
+		auto& edge = fn->getEdge(edgeIdx);
+		if (tieringEnabled && edge.entry < pc)
+			++profiles[fn->getId()].numBackEdges;
+
+		for (auto i = 0u; i < edge.numCopies; ++i)
 		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0 + i1;
-				}
-			);
-			break;
+			auto& copy = fn->getPhiCopy(edge, i);
+			frame->insertBinding(copy.dest, evaluateOperand(*frame, copy.src));
 		}
-		case Instruction::Sub:
+		pc = edge.entry;
+	};
+
+	// Switch the execution to the beginning of a newly set up frame
+	auto enterFrame = [&frame, &fn, &code, &pc] (StackFrame& newFrame)
+	{
+		frame = &newFrame;
+		fn = &newFrame.getPreparedFunction();
+		code = fn->getCode();
+		pc = fn->getBlock(0).entry;
+	};
+
+	// The number of arguments of a call that are passed through the ellipsis
+	auto getNumVarArgs = [] (const PreparedInstruction& inst, const Function* callTgt)
+	{
+		auto numArgs = inst.numOperands - 1;
+		return (numArgs > callTgt->arg_size()) ? numArgs - callTgt->arg_size() : 0;
+	};
+
+	// The i-th argument lives in slot i of the callee frame. Arguments beyond the formal parameters are passed through the ellipsis
+	auto bindArguments = [&getOperandValue] (const PreparedInstruction& inst, StackFrame& calleeFrame)
+	{
+		auto numParams = calleeFrame.getFunction()->arg_size();
+		for (auto i = 1u; i < inst.numOperands; ++i)
 		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0 - i1;
-				}
-			);
-			break;
+			if (i - 1 < numParams)
+				calleeFrame.insertBinding(i - 1, getOperandValue(inst, i));
+			else
+				calleeFrame.setVararg(i - 1 - numParams, DynamicValue(getOperandValue(inst, i)));
 		}
-		case Instruction::Mul:
+	};
+
+	// External functions are still called on the host stack
+	auto callExternal = [this, &frame, &getOperandValue] (const PreparedInstruction& inst, const CallTarget& target)
+	{
+		auto argVals = std::vector<DynamicValue>();
+		argVals.reserve(inst.numOperands - 1);
+		for (auto i = 1u; i < inst.numOperands; ++i)
+			argVals.push_back(getOperandValue(inst, i));
+
+		auto retVal = callExternalFunction(ImmutableCallSite(inst.inst), target.externalType, std::move(argVals));
+		if (!target.function->getReturnType()->isVoidTy())
+			frame->insertBinding(inst.dest, std::move(retVal));
+	};
+
+	// Compiled code works on the guest memory in place, so only the arguments and the return value are converted
+	auto callNative = [this, &frame, &getOperandValue] (const PreparedInstruction& inst, const CallTarget& target, NativeTier::EntryPoint nativeEntry)
+	{
+		nativeArgs.clear();
+		for (auto i = 1u; i < inst.numOperands; ++i)
+			nativeArgs.push_back(NativeTier::encodeValue(getOperandValue(inst, i)));
+
+		auto retWord = nativeEntry(nativeArgs.data());
+		auto retType = target.function->getReturnType();
+		if (!retType->isVoidTy())
+			frame->insertBinding(inst.dest, NativeTier::decodeValue(retWord, retType));
+	};
+
+	// Integers of at most 64 bits are computed natively by the NativeIntOps of their width. Wider ones go through APInt
+	auto evaluateIntBinOp = [&frame, &getOperandValue] (const PreparedInstruction& inst, auto binOp)
+	{
+		auto intVal0 = getOperandValue(inst, 0).getAsIntValue();
+		auto intVal1 = getOperandValue(inst, 1).getAsIntValue();
+
+		if (inst.bitWidth <= 64)
 		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
+			auto i0 = intVal0.getZExtValue();
+			auto i1 = intVal1.getZExtValue();
+			auto res = withNativeIntOps(inst.bitWidth,
+				[&binOp, i0, i1] (auto ops)
 				{
-					return i0 * i1;
+					return binOp(ops, i0, i1);
 				}
 			);
-			break;
+			frame->insertBinding(inst.dest, DynamicValue::getIntValue(inst.bitWidth, res));
 		}
-		case Instruction::UDiv:
+		else
+			frame->insertBinding(inst.dest, DynamicValue::getIntValue(binOp(WideIntOps(), intVal0.getInt(), intVal1.getInt())));
+	};
+
+	auto evaluateFloatBinOp = [&frame, &getOperandValue] (const PreparedInstruction& inst, auto binOp)
+	{
+		auto& val0 = getOperandValue(inst, 0);
+		auto& val1 = getOperandValue(inst, 1);
+		auto fpVal0 = val0.getAsFloatValue();
+		auto fpVal1 = val1.getAsFloatValue();
+		assert(fpVal0.isDouble() == fpVal1.isDouble());
+
+		frame->insertBinding(inst.dest, DynamicValue::getFloatValue(binOp(fpVal0.getFloat(), fpVal1.getFloat()), fpVal0.isDouble()));
+	};
+
+	// Add the constant offset and the scaled variable indices of inst to the pointer in operand baseIdx. The variable indices are the operands that follow it
+	auto evaluateGEP = [&fn, &getOperandValue] (const PreparedInstruction& inst, unsigned baseIdx)
+	{
+		auto basePtrVal = getOperandValue(inst, baseIdx).getAsPointerValue();
+		auto baseAddr = basePtrVal.getAddress() + inst.gepOffset;
+
+		for (auto i = 0u; i < inst.numAux; ++i)
 		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0.udiv(i1);
-				}
-			);
-			break;
+			auto seqNum = getOperandValue(inst, baseIdx + 1 + i).getAsIntValue().getSExtValue();
+			baseAddr += seqNum * fn->getGEPStep(inst, i).scale;
 		}
-		case Instruction::SDiv:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0.sdiv(i1);
-				}
-			);
-			break;
-		}
-		case Instruction::URem:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0.urem(i1);
-				}
-			);
-			break;
-		}
-		case Instruction::SRem:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0.srem(i1);
-				}
-			);
-			break;
-		}
-		case Instruction::FAdd:
-		{
-			evaluateFloatBinOp(
-				[] (double f0, double f1)
-				{
-					return f0 + f1;
-				}
-			);
-			break;
-		}
-		case Instruction::FSub:
-		{
-			evaluateFloatBinOp(
-				[] (double f0, double f1)
-				{
-					return f0 - f1;
-				}
-			);
-			break;
-		}
-		case Instruction::FMul:
-		{
-			evaluateFloatBinOp(
-				[] (double f0, double f1)
-				{
-					return f0 * f1;
-				}
-			);
-			break;
-		}
-		case Instruction::FDiv:
-		{
-			evaluateFloatBinOp(
-				[] (double f0, double f1)
-				{
-					return f0 / f1;
-				}
-			);
-			break;
-		}
-		case Instruction::FRem:
-		{
-			evaluateFloatBinOp(
-				[] (double f0, double f1)
-				{
-					return std::remainder(f0, f1);
-				}
-			);
-			break;
-		}
-		// Logical operators...
-		case Instruction::And:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0 & i1;
-				}
-			);
-			break;
-		}
-		case Instruction::Or:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0 | i1;
-				}
-			);
-			break;
-		}
-		case Instruction::Xor:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& i0, const APInt& i1)
-				{
-					return i0 ^ i1;
-				}
-			);
-			break;
-		}
-		case Instruction::Shl:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& value, const APInt& shift)
-				{
-					auto shiftAmount = shift.getZExtValue();
-					auto valueWidth = value.getBitWidth();
-					if (shiftAmount > valueWidth)
-						llvm_unreachable("Illegal shift amount");
-					return value.shl(shiftAmount);
-				}
-			);
 
-			break;
-		}
-		case Instruction::LShr:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& value, const APInt& shift)
-				{
-					auto shiftAmount = shift.getZExtValue();
-					auto valueWidth = value.getBitWidth();
-					if (shiftAmount > valueWidth)
-						llvm_unreachable("Illegal shift amount");
-					return value.lshr(shiftAmount);
-				}
-			);
+		return DynamicValue::getPointerValue(basePtrVal.getAddressSpace(), baseAddr);
+	};
 
-			break;
-		}
-		case Instruction::AShr:
-		{
-			evaluateIntBinOp(
-				[] (const APInt& value, const APInt& shift)
-				{
-					auto shiftAmount = shift.getZExtValue();
-					auto valueWidth = value.getBitWidth();
-					if (shiftAmount > valueWidth)
-						llvm_unreachable("Illegal shift amount");
-					return value.ashr(shiftAmount);
-				}
-			);
+	auto countFusedExecution = [this] (const PreparedInstruction& inst)
+	{
+		++numFusedExecutions[static_cast<unsigned>(inst.opcode)];
+	};
 
-			break;
-		}
-		case Instruction::ICmp:
-		{
-			auto cmp = [inst] (const APInt& i0, const APInt& i1)
+	// The LOAD_ADD ... LOAD_XOR superinstructions: operand 0 is the load address, operand 1 is the other operand of the binary operator. The translator only fuses integers of at most 64 bits
+	auto evaluateLoadIntBinOp = [this, &frame, &getOperandValue, &countFusedExecution] (const PreparedInstruction& inst, auto binOp)
+	{
+		countFusedExecution(inst);
+
+		auto offset = Address(0);
+		auto loadPtr = getOperandValue(inst, 0).getAsPointerValue();
+		auto i0 = getMemorySection(loadPtr, offset).readIntBits(offset, inst.bitWidth);
+		auto i1 = getOperandValue(inst, 1).getAsIntValue().getZExtValue();
+		if (inst.loadIsRHS)
+			std::swap(i0, i1);
+
+		auto res = withNativeIntOps(inst.bitWidth,
+			[&binOp, i0, i1] (auto ops)
 			{
-				switch (cast<CmpInst>(inst)->getPredicate())
-				{
-					case CmpInst::ICMP_EQ:
-						return APInt(1, i0 == i1);
-					case CmpInst::ICMP_NE:
-						return APInt(1, i0 != i1);
-					case CmpInst::ICMP_UGT:
-						return APInt(1, i0.ugt(i1));
-					case CmpInst::ICMP_UGE:
-						return APInt(1, i0.uge(i1));
-					case CmpInst::ICMP_ULT:
-						return APInt(1, i0.ult(i1));
-					case CmpInst::ICMP_ULE:
-						return APInt(1, i0.ule(i1));
-					case CmpInst::ICMP_SGT:
-						return APInt(1, i0.sgt(i1));
-					case CmpInst::ICMP_SGE:
-						return APInt(1, i0.sge(i1));
-					case CmpInst::ICMP_SLT:
-						return APInt(1, i0.slt(i1));
-					case CmpInst::ICMP_SLE:
-						return APInt(1, i0.sle(i1));
-					default:
-						llvm_unreachable("Illegal icmp predicate");
-				}
-			};
+				return binOp(ops, i0, i1);
+			}
+		);
+		frame->insertBinding(inst.dest, DynamicValue::getIntValue(inst.bitWidth, res));
+	};
 
-			// ICmp can compare both integers and pointers, so we cannot just use evaluateIntBinOp
-			auto val0 = evaluateOperand(frame, inst->getOperand(0));
-			auto val1 = evaluateOperand(frame, inst->getOperand(1));
-			if (val0.isIntValue() && val1.isIntValue())
+	// The typed loads and stores. op is one of LOAD_I8 ... STORE_PTR: it is a constant in their own handlers, so that the switch folds away, and the typed opcode picked by the translator in GEP_LOAD and GEP_STORE. The bounds check of the MemorySection accessor is the only one, and the value goes straight between memory and the register slot
+	auto loadTypedValue = [this, &frame] (Opcode op, const PointerValue& ptr, unsigned dest)
+	{
+		auto offset = Address(0);
+		auto& mem = getMemorySection(ptr, offset);
+		auto& slot = frame->lookup(dest);
+		switch (op)
+		{
+			case Opcode::LOAD_I8:
+				slot.setIntValue(8, mem.readScalar<uint8_t>(offset));
+				break;
+			case Opcode::LOAD_I16:
+				slot.setIntValue(16, mem.readScalar<uint16_t>(offset));
+				break;
+			case Opcode::LOAD_I32:
+				slot.setIntValue(32, mem.readScalar<uint32_t>(offset));
+				break;
+			case Opcode::LOAD_I64:
+				slot.setIntValue(64, mem.readScalar<uint64_t>(offset));
+				break;
+			case Opcode::LOAD_F32:
+				slot.setFloatValue(mem.readScalar<float>(offset), false);
+				break;
+			case Opcode::LOAD_F64:
+				slot.setFloatValue(mem.readScalar<double>(offset), true);
+				break;
+			case Opcode::LOAD_PTR:
 			{
-				auto& intVal0 = val0.getAsIntValue();
-				auto res = cmp(intVal0.getInt(), val1.getAsIntValue().getInt());
-				frame.insertBinding(inst, DynamicValue::getIntValue(res));
+				auto addrSpace = PointerAddressSpace::GLOBAL_SPACE;
+				auto addr = mem.readPointer(offset, addrSpace);
+				slot.setPointerValue(addrSpace, addr);
+				break;
 			}
-			else if (val0.isPointerValue() && val1.isPointerValue())
+			default:
+				llvm_unreachable("Not a typed load");
+		}
+	};
+	auto storeTypedValue = [this] (Opcode op, const PointerValue& ptr, const DynamicValue& val)
+	{
+		// Storing undef leaves the memory as it is, as in MemorySection::write()
+		if (val.isUndefValue())
+			return;
+
+		auto offset = Address(0);
+		auto& mem = getMemorySection(ptr, offset);
+		switch (op)
+		{
+			case Opcode::STORE_I8:
+				mem.writeScalar<uint8_t>(offset, val.getAsIntValue().getZExtValue());
+				break;
+			case Opcode::STORE_I16:
+				mem.writeScalar<uint16_t>(offset, val.getAsIntValue().getZExtValue());
+				break;
+			case Opcode::STORE_I32:
+				mem.writeScalar<uint32_t>(offset, val.getAsIntValue().getZExtValue());
+				break;
+			case Opcode::STORE_I64:
+				mem.writeScalar<uint64_t>(offset, val.getAsIntValue().getZExtValue());
+				break;
+			case Opcode::STORE_F32:
+				mem.writeScalar<float>(offset, val.getAsFloatValue().getFloat());
+				break;
+			case Opcode::STORE_F64:
+				mem.writeScalar<double>(offset, val.getAsFloatValue().getFloat());
+				break;
+			case Opcode::STORE_PTR:
 			{
-				auto ptrSize = dataLayout.getPointerSizeInBits();
-				auto addr0 = val0.getAsPointerValue().getAddress();
-				auto addr1 = val1.getAsPointerValue().getAddress();
-				auto res = cmp(APInt(ptrSize, addr0), APInt(ptrSize, addr1));
-				frame.insertBinding(inst, DynamicValue::getIntValue(res));
+				auto ptrVal = val.getAsPointerValue();
+				mem.writePointer(offset, ptrVal.getAddressSpace(), ptrVal.getAddress());
+				break;
 			}
-			else
-				llvm_unreachable("Illegal icmp compare types");
-
-			break;
+			default:
+				llvm_unreachable("Not a typed store");
 		}
-		case Instruction::FCmp:
-		{
-			auto srcVal0 = evaluateOperand(frame, inst->getOperand(0));
-			auto srcVal1 = evaluateOperand(frame, inst->getOperand(1));
+	};
 
-			auto f0 = srcVal0.getAsFloatValue().getFloat();
-			auto f1 = srcVal1.getAsFloatValue().getFloat();
-			auto isF0Nan = std::isnan(f0);
-			auto isF1Nan = std::isnan(f1);
-			auto bothNotNan = !isF0Nan && !isF1Nan;
-			auto eitherIsNan = isF0Nan || isF1Nan;
-
-			switch (cast<CmpInst>(inst)->getPredicate())
-			{
-				case CmpInst::FCMP_FALSE:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, false)));
-				case CmpInst::FCMP_OEQ:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, bothNotNan && f0 == f1)));
-				case CmpInst::FCMP_OGT:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, bothNotNan && f0 > f1)));
-				case CmpInst::FCMP_OGE:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, bothNotNan && f0 >= f1)));
-				case CmpInst::FCMP_OLT:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, bothNotNan && f0 < f1)));
-				case CmpInst::FCMP_OLE:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, bothNotNan && f0 <= f1)));
-				case CmpInst::FCMP_ONE:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, bothNotNan && f0 != f1)));
-				case CmpInst::FCMP_ORD:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, bothNotNan)));
-				case CmpInst::FCMP_UEQ:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 == f1)));
-				case CmpInst::FCMP_UGT:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 > f1)));
-				case CmpInst::FCMP_UGE:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 >= f1)));
-				case CmpInst::FCMP_ULT:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 < f1)));
-				case CmpInst::FCMP_ULE:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 <= f1)));
-				case CmpInst::FCMP_UNE:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, eitherIsNan || f0 != f1)));
-				case CmpInst::FCMP_UNO:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, eitherIsNan)));
-				case CmpInst::FCMP_TRUE:
-					frame.insertBinding(inst, DynamicValue::getIntValue(APInt(1, false)));
-				default:
-					llvm_unreachable("Illegal fcmp predicate");
-			}
+	// The instruction being executed. The number of instructions dispatched by this invocation is accumulated in numDispatched, and added to numExecutedInstructions upon return
+	const PreparedInstruction* inst;
+	uint64_t numDispatched = 0;
 
-			break;
-		}
+#ifdef LLVM_INTERPRETER_THREADED_DISPATCH
+	// Threaded dispatch: every handler ends with its own indirect jump through a table of label addresses ("labels as values", a GNU extension supported by GCC and Clang). A switch statement funnels all opcodes through one shared indirect jump, which the branch predictor can hardly get right. Here each handler has its own jump and therefore its own prediction history
+	static void* const dispatchTable[] =
+	{
+#define HANDLE_OPCODE(name) &&LABEL_##name,
+#include "Opcodes.def"
+	};
+#define DISPATCH_CASE(name) LABEL_##name:
+#define DISPATCH_NEXT() do { inst = &code[pc++]; ++numDispatched; goto *dispatchTable[static_cast<unsigned>(inst->opcode)]; } while (false)
 
-		// Convert instructions...
-		case Instruction::Trunc:
+	DISPATCH_NEXT();
+	// These braces stand in for the loop and the switch of the portable version, so that both versions share the handlers below
+	{
 		{
-			auto truncWidth = cast<IntegerType>(inst->getType())->getBitWidth();
-			evaluateIntUnOp(
-				[truncWidth] (const APInt& i0)
-				{
-					return i0.trunc(truncWidth);
-				}
-			);
-			break;
-		}
-		case Instruction::ZExt:
+#else
+	// Portable dispatch through a switch statement
+#define DISPATCH_CASE(name) case Opcode::name:
+#define DISPATCH_NEXT() break
+
+	while (true)
+	{
+		inst = &code[pc++];
+		++numDispatched;
+		//errs() << "Eval " << *inst->inst << "\n";
+
+		switch (inst->opcode)
 		{
-			auto extWidth = cast<IntegerType>(inst->getType())->getBitWidth();
-			evaluateIntUnOp(
-				[extWidth] (const APInt& i0)
+#endif
+			// Terminators...
+			DISPATCH_CASE(BR)
+			{
+				branchTo(inst->targets[0]);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(COND_BR)
+			{
+				auto& condVal = getOperandValue(*inst, 0);
+				if (condVal.getAsIntValue().getZExtValue() != 0)
+					branchTo(inst->targets[0]);
+				else
+					branchTo(inst->targets[1]);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SWITCH)
+			{
+				auto& condVal = getOperandValue(*inst, 0);
+				auto condInt = condVal.getAsIntValue().getInt();
+
+				auto target = inst->targets[0];
+				for (auto i = 0u; i < inst->numAux; ++i)
 				{
-					return i0.zext(extWidth);
+					auto& switchCase = fn->getSwitchCase(*inst, i);
+					if (condInt == switchCase.value)
+					{
+						target = switchCase.target;
+						break;
+					}
 				}
-			);
-			break;
-		}
-		case Instruction::SExt:
-		{
-			auto extWidth = cast<IntegerType>(inst->getType())->getBitWidth();
-			evaluateIntUnOp(
-				[extWidth] (const APInt& i0)
+
+				branchTo(target);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SWITCH_TABLE)
+			{
+				auto condInt = getOperandValue(*inst, 0).getAsIntValue().getSExtValue();
+
+				// Conditions below the first entry wrap around to large indices, so one comparison covers both ends of the table
+				auto idx = static_cast<uint64_t>(condInt) - static_cast<uint64_t>(inst->switchBase);
+				if (idx < inst->numAux)
+					branchTo(fn->getJumpTable(*inst)[idx]);
+				else
+					branchTo(inst->targets[0]);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SWITCH_SEARCH)
+			{
+				auto condInt = getOperandValue(*inst, 0).getAsIntValue().getSExtValue();
+
+				auto casesBegin = fn->getNativeSwitchCases(*inst);
+				auto casesEnd = casesBegin + inst->numAux;
+				auto itr = std::lower_bound(casesBegin, casesEnd, condInt,
+					[] (const NativeSwitchCase& switchCase, int64_t value)
+					{
+						return switchCase.value < value;
+					}
+				);
+				if (itr != casesEnd && itr->value == condInt)
+					branchTo(itr->target);
+				else
+					branchTo(inst->targets[0]);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(INDIRECTBR)
+			{
+				auto addr = getOperandValue(*inst, 0).getAsPointerValue().getAddress();
+				auto block = getBlockAtAddress(addr);
+
+				auto targetsBegin = fn->getIndirectTargets(*inst);
+				auto targetsEnd = targetsBegin + inst->numAux;
+				auto itr = std::lower_bound(targetsBegin, targetsEnd, block,
+					[] (const IndirectTarget& target, const BasicBlock* bb)
+					{
+						return target.block < bb;
+					}
+				);
+				if (itr == targetsEnd || itr->block != block)
+					throw std::out_of_range("indirectbr jumps to a block that is not one of its destinations");
+
+				branchTo(itr->target);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(RET)
+			{
+				auto retVal = DynamicValue::getUndefValue();
+				if (inst->numOperands != 0)
+					retVal = getOperandValue(*inst, 0);
+
+				// Pop the stack frame
+				popStack();
+				if (stack.getNumFrames() < entryDepth)
 				{
-					return i0. sext(extWidth);
+					numExecutedInstructions += numDispatched;
+					return retVal;
 				}
-			);
-			break;
-		}
-		case Instruction::FPTrunc:
-		{
-			auto srcType = inst->getOperand(0)->getType();
-			auto dstType = inst->getType();
-			if (!(srcType->isDoubleTy() && dstType->isFloatTy()))
-				llvm_unreachable("Invalid FPTrunc instruction");
 
-			auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-			auto& srcFloatVal = srcVal.getAsFloatValue();
-			assert(srcFloatVal.isDouble());
-			frame.insertBinding(inst, DynamicValue::getFloatValue(static_cast<float>(srcFloatVal.getFloat()), false));
-			break;
-		}
-		case Instruction::FPExt:
-		{
-			auto srcType = inst->getOperand(0)->getType();
-			auto dstType = inst->getType();
-			if (!(dstType->isDoubleTy() && srcType->isFloatTy()))
-				llvm_unreachable("Invalid FPExt instruction");
-			// Extention is a non-op for us
-			auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-			auto& srcFloatVal = srcVal.getAsFloatValue();
-			assert(!srcFloatVal.isDouble());
-			frame.insertBinding(inst, DynamicValue::getFloatValue(srcFloatVal.getFloat(), true));
-			break;
-		}
-		// Since APInt can represent both UI and SI, we process them in the same way
-		case Instruction::FPToUI:
-		case Instruction::FPToSI:
-		{
-			auto intWidth = cast<IntegerType>(inst->getType())->getBitWidth();
+				// Resume the caller right after its call instruction, which receives the return value
+				frame = &stack.getCurrentFrame();
+				fn = &frame->getPreparedFunction();
+				code = fn->getCode();
+				pc = frame->getResumePC();
 
-			auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-			auto resVal = DynamicValue::getIntValue(APIntOps::RoundDoubleToAPInt(srcVal.getAsFloatValue().getFloat(), intWidth));
-			frame.insertBinding(inst, resVal);
-			break;
-		}
-		// Ditto
-		case Instruction::UIToFP:
-		case Instruction::SIToFP:
-		{
-			auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-			auto resVal = DynamicValue::getFloatValue(APIntOps::RoundAPIntToDouble(srcVal.getAsIntValue().getInt()), inst->getType()->isDoubleTy());
-			frame.insertBinding(inst, resVal);
-			break;
-		}
-		case Instruction::IntToPtr:
-		{
-			auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-			auto ptrSize = dataLayout.getPointerSizeInBits();
+				auto& callInst = code[pc - 1];
+				if (!callInst.inst->getType()->isVoidTy())
+					frame->insertBinding(callInst.dest, std::move(retVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(UNREACHABLE)
+				llvm_unreachable("Reached an unreachable instruction!");
+
+			// Standard binary operators...
+			DISPATCH_CASE(ADD)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.add(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SUB)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.sub(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(MUL)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.mul(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(UDIV)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.udiv(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SDIV)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.sdiv(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(UREM)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.urem(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SREM)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.srem(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FADD)
+			{
+				evaluateFloatBinOp(*inst,
+					[] (double f0, double f1)
+					{
+						return f0 + f1;
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FSUB)
+			{
+				evaluateFloatBinOp(*inst,
+					[] (double f0, double f1)
+					{
+						return f0 - f1;
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FMUL)
+			{
+				evaluateFloatBinOp(*inst,
+					[] (double f0, double f1)
+					{
+						return f0 * f1;
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FDIV)
+			{
+				evaluateFloatBinOp(*inst,
+					[] (double f0, double f1)
+					{
+						return f0 / f1;
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FREM)
+			{
+				evaluateFloatBinOp(*inst,
+					[] (double f0, double f1)
+					{
+						return std::fmod(f0, f1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
 
-			// Look for matching ptrtoint to decide what the address space should be
-			auto addrSpace = PointerAddressSpace::GLOBAL_SPACE;
-			auto matchingPtr = findBasePointer(inst);
-			if (matchingPtr != nullptr && frame.hasBinding(matchingPtr))
+			// Logical operators...
+			DISPATCH_CASE(AND)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.bitAnd(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(OR)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.bitOr(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(XOR)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.bitXor(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SHL)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.shl(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LSHR)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.lshr(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(ASHR)
+			{
+				evaluateIntBinOp(*inst,
+					[] (auto ops, const auto& i0, const auto& i1)
+					{
+						return ops.ashr(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(ICMP)
 			{
-				auto& ptrVal = frame.lookup(matchingPtr).getAsPointerValue();
-				addrSpace = ptrVal.getAddressSpace();
+				auto& val0 = getOperandValue(*inst, 0);
+				auto& val1 = getOperandValue(*inst, 1);
+				frame->insertBinding(inst->dest, DynamicValue::getIntValue(1, evaluateICmp(inst->predicate, val0, val1)));
+				DISPATCH_NEXT();
 			}
+			DISPATCH_CASE(FCMP)
+			{
+				auto& srcVal0 = getOperandValue(*inst, 0);
+				auto& srcVal1 = getOperandValue(*inst, 1);
 
-			auto resVal = DynamicValue::getPointerValue(addrSpace, srcVal.getAsIntValue().getInt().zextOrTrunc(ptrSize).getZExtValue());
-			frame.insertBinding(inst, resVal);
-			break;
-		}
-		case Instruction::PtrToInt:
-		{
-			auto intWidth = cast<IntegerType>(inst->getType())->getBitWidth();
-			auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-			auto resVal = DynamicValue::getIntValue(APInt(intWidth, srcVal.getAsPointerValue().getAddress()));
-			frame.insertBinding(inst, resVal);
-			break;
-		}
-		case Instruction::BitCast:
-		{
-			auto srcType = inst->getOperand(0)->getType();
-			auto dstType = inst->getType();
+				auto f0 = srcVal0.getAsFloatValue().getFloat();
+				auto f1 = srcVal1.getAsFloatValue().getFloat();
+				frame->insertBinding(inst->dest, DynamicValue::getIntValue(1, evaluateFCmp(inst->predicate, f0, f1)));
+				DISPATCH_NEXT();
+			}
 
-			if (dstType->isPointerTy())
+			// Convert instructions...
+			DISPATCH_CASE(TRUNC)
 			{
-				if (!srcType->isPointerTy())
-					llvm_unreachable("Invalid Bitcast");
-				auto resVal = evaluateOperand(frame, inst->getOperand(0));
-				frame.insertBinding(inst, std::move(resVal));
+				auto srcIntVal = getOperandValue(*inst, 0).getAsIntValue();
+				if (srcIntVal.getBitWidth() <= 64)
+				{
+					auto res = withNativeIntOps(inst->bitWidth,
+						[&srcIntVal] (auto ops)
+						{
+							return ops.truncate(srcIntVal.getZExtValue());
+						}
+					);
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(inst->bitWidth, res));
+				}
+				else
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(srcIntVal.getInt().trunc(inst->bitWidth)));
+				DISPATCH_NEXT();
 			}
-			else if (dstType->isIntegerTy())
+			DISPATCH_CASE(ZEXT)
 			{
-				if (srcType->isFloatTy() || srcType->isDoubleTy())
+				// Native integers are kept zero-extended, so there is nothing to compute
+				auto srcIntVal = getOperandValue(*inst, 0).getAsIntValue();
+				if (inst->bitWidth <= 64)
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(inst->bitWidth, srcIntVal.getZExtValue()));
+				else
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(srcIntVal.getInt().zext(inst->bitWidth)));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SEXT)
+			{
+				auto srcIntVal = getOperandValue(*inst, 0).getAsIntValue();
+				if (inst->bitWidth <= 64)
 				{
-					auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-					auto resVal = DynamicValue::getIntValue(APInt::doubleToBits(srcVal.getAsFloatValue().getFloat()));
-					frame.insertBinding(inst, std::move(resVal));
+					auto res = withNativeIntOps(inst->bitWidth,
+						[&srcIntVal] (auto ops)
+						{
+							return ops.truncate(srcIntVal.getSExtValue());
+						}
+					);
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(inst->bitWidth, res));
 				}
-				else if (srcType->isIntegerTy())
+				else
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(srcIntVal.getInt().sext(inst->bitWidth)));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FPTRUNC)
+			{
+				auto& srcVal = getOperandValue(*inst, 0);
+				auto srcFloatVal = srcVal.getAsFloatValue();
+				assert(srcFloatVal.isDouble());
+				frame->insertBinding(inst->dest, DynamicValue::getFloatValue(static_cast<float>(srcFloatVal.getFloat()), false));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FPEXT)
+			{
+				// Extention is a non-op for us
+				auto& srcVal = getOperandValue(*inst, 0);
+				auto srcFloatVal = srcVal.getAsFloatValue();
+				assert(!srcFloatVal.isDouble());
+				frame->insertBinding(inst->dest, DynamicValue::getFloatValue(srcFloatVal.getFloat(), true));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FPTOI)
+			{
+				auto fpVal = getOperandValue(*inst, 0).getAsFloatValue().getFloat();
+				if (inst->bitWidth <= 64)
 				{
-					auto resVal = evaluateOperand(frame, inst->getOperand(0));
-					frame.insertBinding(inst, std::move(resVal));
+					auto res = withNativeIntOps(inst->bitWidth,
+						[fpVal] (auto ops)
+						{
+							return ops.fromFloat(fpVal);
+						}
+					);
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(inst->bitWidth, res));
 				}
 				else
-					llvm_unreachable("Invalid BitCast");
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(APIntOps::RoundDoubleToAPInt(fpVal, inst->bitWidth)));
+				DISPATCH_NEXT();
 			}
-			else if (dstType->isFloatTy() || dstType->isDoubleTy())
+			// For the int-to-float conversions, bitWidth is the width of the float result. The width of the source is the one of the operand
+			DISPATCH_CASE(UITOFP)
 			{
-				if (srcType->isIntegerTy())
+				auto srcIntVal = getOperandValue(*inst, 0).getAsIntValue();
+				auto res = 0.0;
+				if (srcIntVal.getBitWidth() <= 64)
 				{
-					auto srcVal = evaluateOperand(frame, inst->getOperand(0));
-					auto resVal = DynamicValue::getFloatValue(srcVal.getAsIntValue().getInt().bitsToDouble(), dstType->isDoubleTy());
-					frame.insertBinding(inst, resVal);
+					res = withNativeIntOps(srcIntVal.getBitWidth(),
+						[&srcIntVal] (auto ops)
+						{
+							return ops.toUnsignedFloat(srcIntVal.getZExtValue());
+						}
+					);
 				}
 				else
+					res = APIntOps::RoundAPIntToDouble(srcIntVal.getInt());
+				frame->insertBinding(inst->dest, DynamicValue::getFloatValue(res, inst->bitWidth == 64));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SITOFP)
+			{
+				auto srcIntVal = getOperandValue(*inst, 0).getAsIntValue();
+				auto res = 0.0;
+				if (srcIntVal.getBitWidth() <= 64)
 				{
-					auto resVal = evaluateOperand(frame, inst->getOperand(0));
-					frame.insertBinding(inst, DynamicValue::getFloatValue(resVal.getAsFloatValue().getFloat(), dstType->isDoubleTy()));
+					res = withNativeIntOps(srcIntVal.getBitWidth(),
+						[&srcIntVal] (auto ops)
+						{
+							return ops.toSignedFloat(srcIntVal.getZExtValue());
+						}
+					);
 				}
+				else
+					res = APIntOps::RoundSignedAPIntToDouble(srcIntVal.getInt());
+				frame->insertBinding(inst->dest, DynamicValue::getFloatValue(res, inst->bitWidth == 64));
+				DISPATCH_NEXT();
 			}
-			else
-				llvm_unreachable("Invalid Bitcast");
-
-			break;
-		}
+			DISPATCH_CASE(INTTOPTR)
+			{
+				auto& srcVal = getOperandValue(*inst, 0);
 
-		// Memory instructions...
-		case Instruction::Alloca:
-		{
-			auto allocInst = cast<AllocaInst>(inst);
+				// If the translator found a matching ptrtoint, use it to decide what the address space should be
+				auto addrSpace = PointerAddressSpace::GLOBAL_SPACE;
+				if (inst->numOperands > 1)
+				{
+					auto& basePtrVal = getOperandValue(*inst, 1);
+					if (basePtrVal.isPointerValue())
+						addrSpace = basePtrVal.getAsPointerValue().getAddressSpace();
+				}
 
-			auto allocElems = 1u;
-			if (allocInst->isArrayAllocation())
+				// Integers are kept zero-extended, so truncating to the pointer width also covers the zero extension of narrower ones
+				auto srcIntVal = srcVal.getAsIntValue();
+				auto addr = Address(0);
+				if (srcIntVal.getBitWidth() <= 64)
+				{
+					addr = withNativeIntOps(inst->bitWidth,
+						[&srcIntVal] (auto ops)
+						{
+							return ops.truncate(srcIntVal.getZExtValue());
+						}
+					);
+				}
+				else
+					addr = srcIntVal.getInt().zextOrTrunc(inst->bitWidth).getZExtValue();
+				frame->insertBinding(inst->dest, DynamicValue::getPointerValue(addrSpace, addr));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(PTRTOINT)
 			{
-				auto sizeVal = evaluateOperand(frame, allocInst->getArraySize());
-				allocElems = sizeVal.getAsIntValue().getInt().getZExtValue();
+				auto addr = getOperandValue(*inst, 0).getAsPointerValue().getAddress();
+				if (inst->bitWidth <= 64)
+				{
+					auto res = withNativeIntOps(inst->bitWidth,
+						[addr] (auto ops)
+						{
+							return ops.truncate(addr);
+						}
+					);
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(inst->bitWidth, res));
+				}
+				else
+					frame->insertBinding(inst->dest, DynamicValue::getIntValue(APInt(inst->bitWidth, addr)));
+				DISPATCH_NEXT();
 			}
-
-			auto allocSize = dataLayout.getTypeAllocSize(allocInst->getType()->getElementType());
-			auto retAddr = allocateStackMem(frame, allocSize);
-			for (auto i = 1; i < allocElems; ++i)
-				allocateStackMem(frame, allocSize);
-
-			frame.insertBinding(inst, DynamicValue::getPointerValue(PointerAddressSpace::STACK_SPACE, retAddr));
-
-			break;
-		}
-		case Instruction::Load:
-		{
-			auto loadInst = cast<LoadInst>(inst);
-			auto loadType = loadInst->getType();
-
-			auto loadSrc = evaluateOperand(frame, loadInst->getPointerOperand());
-			auto& loadPtr = loadSrc.getAsPointerValue();
-
-			auto resVal = readFromPointer(loadPtr, loadType);
-
-			frame.insertBinding(inst, resVal);
-
-			break;
-		}
-		case Instruction::Store:
-		{
-			auto storeInst = cast<StoreInst>(inst);
-
-			auto storeSrc = evaluateOperand(frame, storeInst->getPointerOperand());
-			auto storeVal = evaluateOperand(frame, storeInst->getValueOperand());
-			auto& storePtr = storeSrc.getAsPointerValue();
-
-			writeToPointer(storePtr, storeVal);
-
-			break;
-		}
-		case Instruction::GetElementPtr:
-		{
-			auto gepInst = cast<GetElementPtrInst>(inst);
-
-			auto baseVal = evaluateOperand(frame, gepInst->getPointerOperand());
-			auto& basePtrVal = baseVal.getAsPointerValue();
-			auto baseAddr = basePtrVal.getAddress();
-
-			for (auto itr = gep_type_begin(gepInst), ite = gep_type_end(gepInst); itr != ite; ++itr)
+			DISPATCH_CASE(BITCAST)
 			{
-				auto idxVal = evaluateOperand(frame, itr.getOperand());
-				auto seqNum = idxVal.getAsIntValue().getInt().getSExtValue();
-
-				if (auto structType = dyn_cast<StructType>(*itr))
+				frame->insertBinding(inst->dest, getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(BITCAST_FP_TO_INT)
+			{
+				auto& srcVal = getOperandValue(*inst, 0);
+				auto fpVal = srcVal.getAsFloatValue().getFloat();
+				auto resInt = uint64_t(0);
+				if (inst->bitWidth == 32)
 				{
-					baseAddr += dataLayout.getStructLayout(structType)->getElementOffset(seqNum);
+					auto f = static_cast<float>(fpVal);
+					auto bits = uint32_t(0);
+					std::memcpy(&bits, &f, sizeof(bits));
+					resInt = bits;
 				}
 				else
+					std::memcpy(&resInt, &fpVal, sizeof(resInt));
+				frame->insertBinding(inst->dest, DynamicValue::getIntValue(inst->bitWidth, resInt));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(BITCAST_INT_TO_FP)
+			{
+				auto& srcVal = getOperandValue(*inst, 0);
+				auto srcInt = srcVal.getAsIntValue().getZExtValue();
+				auto resFloat = 0.0;
+				if (inst->bitWidth == 32)
 				{
-					auto seqType = cast<SequentialType>(*itr);
-					baseAddr += seqNum * dataLayout.getTypeAllocSize(seqType->getElementType());
+					auto bits = static_cast<uint32_t>(srcInt);
+					auto f = 0.0f;
+					std::memcpy(&f, &bits, sizeof(f));
+					resFloat = f;
 				}
+				else
+					std::memcpy(&resFloat, &srcInt, sizeof(resFloat));
+				frame->insertBinding(inst->dest, DynamicValue::getFloatValue(resFloat, inst->bitWidth == 64));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(BITCAST_FP)
+			{
+				auto& srcVal = getOperandValue(*inst, 0);
+				frame->insertBinding(inst->dest, DynamicValue::getFloatValue(srcVal.getAsFloatValue().getFloat(), inst->bitWidth == 64));
+				DISPATCH_NEXT();
 			}
 
-			frame.insertBinding(inst, DynamicValue::getPointerValue(basePtrVal.getAddressSpace(), baseAddr));
+			// Memory instructions...
+			DISPATCH_CASE(ALLOCA)
+			{
+				auto allocElems = 1u;
+				if (inst->numOperands != 0)
+				{
+					auto& sizeVal = getOperandValue(*inst, 0);
+					allocElems = sizeVal.getAsIntValue().getZExtValue();
+				}
 
-			break;
-		}
+				auto retAddr = allocateStackMem(*frame, inst->typeSize * allocElems);
+				frame->insertBinding(inst->dest, DynamicValue::getPointerValue(PointerAddressSpace::STACK_SPACE, retAddr));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD)
+			{
+				auto& loadSrc = getOperandValue(*inst, 0);
+				auto loadPtr = loadSrc.getAsPointerValue();
 
-		// Other instructions...
-		case Instruction::ExtractValue:
-		{
-			auto evInst = cast<ExtractValueInst>(inst);
+				frame->insertBinding(inst->dest, readFromPointer(loadPtr, inst->type));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(STORE)
+			{
+				auto& storeVal = getOperandValue(*inst, 0);
+				auto& storeSrc = getOperandValue(*inst, 1);
+				auto storePtr = storeSrc.getAsPointerValue();
 
-			auto baseVal = evaluateOperand(frame, evInst->getAggregateOperand());
+				writeToPointer(storePtr, storeVal);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_I8)
+			{
+				loadTypedValue(Opcode::LOAD_I8, getOperandValue(*inst, 0).getAsPointerValue(), inst->dest);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_I16)
+			{
+				loadTypedValue(Opcode::LOAD_I16, getOperandValue(*inst, 0).getAsPointerValue(), inst->dest);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_I32)
+			{
+				loadTypedValue(Opcode::LOAD_I32, getOperandValue(*inst, 0).getAsPointerValue(), inst->dest);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_I64)
+			{
+				loadTypedValue(Opcode::LOAD_I64, getOperandValue(*inst, 0).getAsPointerValue(), inst->dest);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_F32)
+			{
+				loadTypedValue(Opcode::LOAD_F32, getOperandValue(*inst, 0).getAsPointerValue(), inst->dest);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_F64)
+			{
+				loadTypedValue(Opcode::LOAD_F64, getOperandValue(*inst, 0).getAsPointerValue(), inst->dest);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_PTR)
+			{
+				loadTypedValue(Opcode::LOAD_PTR, getOperandValue(*inst, 0).getAsPointerValue(), inst->dest);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(STORE_I8)
+			{
+				storeTypedValue(Opcode::STORE_I8, getOperandValue(*inst, 1).getAsPointerValue(), getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(STORE_I16)
+			{
+				storeTypedValue(Opcode::STORE_I16, getOperandValue(*inst, 1).getAsPointerValue(), getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(STORE_I32)
+			{
+				storeTypedValue(Opcode::STORE_I32, getOperandValue(*inst, 1).getAsPointerValue(), getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(STORE_I64)
+			{
+				storeTypedValue(Opcode::STORE_I64, getOperandValue(*inst, 1).getAsPointerValue(), getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(STORE_F32)
+			{
+				storeTypedValue(Opcode::STORE_F32, getOperandValue(*inst, 1).getAsPointerValue(), getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(STORE_F64)
+			{
+				storeTypedValue(Opcode::STORE_F64, getOperandValue(*inst, 1).getAsPointerValue(), getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(STORE_PTR)
+			{
+				storeTypedValue(Opcode::STORE_PTR, getOperandValue(*inst, 1).getAsPointerValue(), getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(ATOMIC_LOAD)
+			{
+				auto ptr = getOperandValue(*inst, 0).getAsPointerValue();
+				auto bits = atomicLoad(getRawPointer(ptr, inst->typeSize), inst->typeSize);
+				frame->insertBinding(inst->dest, getAtomicValue(bits, inst->type));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(ATOMIC_STORE)
+			{
+				auto& storeVal = getOperandValue(*inst, 0);
+				auto ptr = getOperandValue(*inst, 1).getAsPointerValue();
+				// Storing undef leaves the memory as it is, as in MemorySection::write()
+				if (!storeVal.isUndefValue())
+					atomicStore(getRawPointer(ptr, inst->typeSize), inst->typeSize, getAtomicBits(storeVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(CMPXCHG)
+			{
+				auto ptr = getOperandValue(*inst, 0).getAsPointerValue();
+				auto& expectedVal = getOperandValue(*inst, 1);
+				auto& desiredVal = getOperandValue(*inst, 2);
+
+				// Pointers are compared and exchanged as the bits they are stored as, that is with the tag of their address space
+				auto success = false;
+				auto oldBits = atomicCompareExchange(getRawPointer(ptr, inst->typeSize), inst->typeSize, getAtomicBits(expectedVal), getAtomicBits(desiredVal), success);
+				auto oldVal = getAtomicValue(oldBits, cast<StructType>(inst->type)->getElementType(0));
+
+				// The result is a { ty, i1 } pair
+				auto& stLayout = typeLayouts.getLayout(inst->type);
+				auto retVal = DynamicValue::getStructValue(stLayout.allocSize);
+				auto& structVal = retVal.getAsStructValue();
+				structVal.addField(stLayout.fieldOffsets[0], std::move(oldVal));
+				structVal.addField(stLayout.fieldOffsets[1], DynamicValue::getIntValue(1, success));
+				frame->insertBinding(inst->dest, std::move(retVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(ATOMICRMW)
+			{
+				auto ptr = getOperandValue(*inst, 0).getAsPointerValue();
+				auto operand = getOperandValue(*inst, 1).getAsIntValue().getZExtValue();
+				auto oldVal = atomicReadModifyWrite(getRawPointer(ptr, inst->typeSize), inst->typeSize, static_cast<AtomicRMWInst::BinOp>(inst->predicate), operand);
+				frame->insertBinding(inst->dest, DynamicValue::getIntValue(inst->bitWidth, oldVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(FENCE)
+			{
+				__atomic_thread_fence(__ATOMIC_SEQ_CST);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(GEP)
+			{
+				frame->insertBinding(inst->dest, evaluateGEP(*inst, 0));
+				DISPATCH_NEXT();
+			}
 
-			for (auto itr = evInst->idx_begin(), ite = evInst->idx_end(); itr != ite; ++itr)
+			// Other instructions...
+			DISPATCH_CASE(EXTRACTVALUE)
 			{
-				auto idx = *itr;
-				if (baseVal.isStructValue())
-				{
-					auto fieldVal = baseVal.getAsStructValue().getFieldAtNum(idx);
-					baseVal = std::move(fieldVal);
-				}
-				else if (baseVal.isArrayValue())
+				auto& baseVal = getOperandValue(*inst, 0);
+				frame->insertBinding(inst->dest, extractAggregateElement(baseVal, fn->getAggregateIndices(*inst), inst->numAux));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(INSERTVALUE)
+			{
+				auto baseVal = getOperandValue(*inst, 0);
+				insertAggregateElement(baseVal, fn->getAggregateIndices(*inst), inst->numAux, DynamicValue(getOperandValue(*inst, 1)));
+				frame->insertBinding(inst->dest, std::move(baseVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SELECT)
+			{
+				auto& condVal = getOperandValue(*inst, 0);
+				if (condVal.getAsIntValue().getZExtValue() != 0)
+					frame->insertBinding(inst->dest, getOperandValue(*inst, 1));
+				else
+					frame->insertBinding(inst->dest, getOperandValue(*inst, 2));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(CALL)
+			{
+				auto& target = getCallTarget(*inst, *frame);
+				if (target.prepared == nullptr)
+					callExternal(*inst, target);
+				else if (auto nativeEntry = (tieringEnabled ? getNativeEntry(*target.prepared) : nullptr))
+					callNative(*inst, target, nativeEntry);
+				else
 				{
-					auto elemVal = baseVal.getAsArrayValue().getElementAtIndex(idx);
-					baseVal = std::move(elemVal);
+					auto& calleeFrame = stack.createFrame(*target.prepared, getNumVarArgs(*inst, target.function));
+					bindArguments(*inst, calleeFrame);
+					frame->setResumePC(pc);
+					enterFrame(calleeFrame);
 				}
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(TAIL_CALL)
+			{
+				// A callee that runs natively returns its result to us, and the ret that follows passes it on
+				auto& target = getCallTarget(*inst, *frame);
+				if (target.prepared == nullptr)
+					callExternal(*inst, target);
+				else if (auto nativeEntry = (tieringEnabled ? getNativeEntry(*target.prepared) : nullptr))
+					callNative(*inst, target, nativeEntry);
 				else
-					llvm_unreachable("extractvalue into a non-aggregate type!");
+				{
+					tailCallArgs.clear();
+					for (auto i = 1u; i < inst->numOperands; ++i)
+						tailCallArgs.push_back(getOperandValue(*inst, i));
+
+					// Our caller keeps the resume position it stored in its own frame, so the callee returns straight to it
+					stackMem.deallocate(frame->getAllocationSize());
+					stack.resetCurrentFrame(*target.prepared, getNumVarArgs(*inst, target.function));
+
+					auto numParams = target.function->arg_size();
+					for (auto i = 0u; i < tailCallArgs.size(); ++i)
+					{
+						if (i < numParams)
+							frame->insertBinding(i, std::move(tailCallArgs[i]));
+						else
+							frame->setVararg(i - numParams, std::move(tailCallArgs[i]));
+					}
+					enterFrame(*frame);
+				}
+				DISPATCH_NEXT();
 			}
-			
-			frame.insertBinding(inst, baseVal);
-			break;
-		}
-		case Instruction::InsertValue:
-		{
-			auto ivInst = cast<InsertValueInst>(inst);
 
-			auto baseVal = evaluateOperand(frame, ivInst->getAggregateOperand());
-			auto& tmpBaseVal = baseVal;
-			for (auto itr = ivInst->idx_begin(), ite = ivInst->idx_end(); itr != ite; ++itr)
+			// Vector instructions...
+			DISPATCH_CASE(VECTOR_BINOP)
+			{
+				auto& vecVal0 = getOperandValue(*inst, 0).getAsVectorValue();
+				auto& vecVal1 = getOperandValue(*inst, 1).getAsVectorValue();
+				auto retVal = createVectorValue(inst->type);
+				evaluateVectorBinOp(inst->elementOpcode, vecVal0, vecVal1, retVal.getAsVectorValue());
+				frame->insertBinding(inst->dest, std::move(retVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(VECTOR_CMP)
 			{
-				auto idx = *itr;
-				if (baseVal.isStructValue())
+				auto& vecVal0 = getOperandValue(*inst, 0).getAsVectorValue();
+				auto& vecVal1 = getOperandValue(*inst, 1).getAsVectorValue();
+				auto retVal = createVectorValue(inst->type);
+				auto& resVec = retVal.getAsVectorValue();
+				if (inst->elementOpcode == Opcode::ICMP)
 				{
-					auto fieldVal = baseVal.getAsStructValue().getFieldAtNum(idx);
-					baseVal = std::move(fieldVal);
+					auto ops = NativeIntOps<0>(vecVal0.getElementBitWidth());
+					for (auto i = 0u, e = resVec.getNumElements(); i < e; ++i)
+						resVec.setRawLane(i, ops.compare(inst->predicate, vecVal0.getRawLane(i), vecVal1.getRawLane(i)));
 				}
-				else if (baseVal.isArrayValue())
+				else
 				{
-					auto elemVal = baseVal.getAsArrayValue().getElementAtIndex(idx);
-					baseVal = std::move(elemVal);
+					for (auto i = 0u, e = resVec.getNumElements(); i < e; ++i)
+					{
+						auto f0 = vecVal0.getElementAtIndex(i).getAsFloatValue().getFloat();
+						auto f1 = vecVal1.getElementAtIndex(i).getAsFloatValue().getFloat();
+						resVec.setRawLane(i, evaluateFCmp(inst->predicate, f0, f1));
+					}
 				}
+				frame->insertBinding(inst->dest, std::move(retVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(VECTOR_CAST)
+			{
+				auto& srcVec = getOperandValue(*inst, 0).getAsVectorValue();
+				auto retVal = createVectorValue(inst->type);
+				evaluateVectorCast(inst->elementOpcode, srcVec, retVal.getAsVectorValue());
+				frame->insertBinding(inst->dest, std::move(retVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(VECTOR_BITCAST)
+			{
+				frame->insertBinding(inst->dest, bitcastVectorValue(getOperandValue(*inst, 0), inst->type));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(VECTOR_SELECT)
+			{
+				auto& condVec = getOperandValue(*inst, 0).getAsVectorValue();
+				auto& vecVal0 = getOperandValue(*inst, 1).getAsVectorValue();
+				auto& vecVal1 = getOperandValue(*inst, 2).getAsVectorValue();
+				auto retVal = createVectorValue(inst->type);
+				selectVectorLanes(condVec, vecVal0, vecVal1, retVal.getAsVectorValue());
+				frame->insertBinding(inst->dest, std::move(retVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(EXTRACTELEMENT)
+			{
+				// An out-of-range index yields undef
+				auto& vecVal = getOperandValue(*inst, 0).getAsVectorValue();
+				auto idx = getOperandValue(*inst, 1).getAsIntValue().getZExtValue();
+				if (idx < vecVal.getNumElements())
+					frame->insertBinding(inst->dest, vecVal.getElementAtIndex(idx));
 				else
-					llvm_unreachable("insertvalue into a non-aggregate type!");
+					frame->insertBinding(inst->dest, DynamicValue::getUndefValue());
+				DISPATCH_NEXT();
 			}
-			baseVal = evaluateOperand(frame, ivInst->getInsertedValueOperand());
-			
-			frame.insertBinding(inst, tmpBaseVal);
-			break;
-		}
-		case Instruction::Select:
-		{
-			auto selInst = cast<SelectInst>(inst);
-
-			auto condVal = evaluateOperand(frame, selInst->getCondition());
-			auto condInt = condVal.getAsIntValue().getInt().getBoolValue();
-			if (condInt)
-				frame.insertBinding(inst, evaluateOperand(frame, selInst->getTrueValue()));
-			else
-				frame.insertBinding(inst, evaluateOperand(frame, selInst->getFalseValue()));
-
-			break;
-		}
-		case Instruction::Call:
-		{
-			ImmutableCallSite cs(inst);
-			assert(cs);
-
-			auto callTgt = cs.getCalledFunction();
-			if (callTgt == nullptr)
+			DISPATCH_CASE(INSERTELEMENT)
 			{
-				auto funPtr = evaluateOperand(frame, cs.getCalledValue());
-				auto funAddr = funPtr.getAsPointerValue().getAddress();
-				callTgt = cast<Function>(funPtrMap.at(funAddr));
+				auto vecVal = getOperandValue(*inst, 0);
+				auto idx = getOperandValue(*inst, 2).getAsIntValue().getZExtValue();
+				if (idx < vecVal.getAsVectorValue().getNumElements())
+					vecVal.getAsVectorValue().setElementAtIndex(idx, getOperandValue(*inst, 1));
+				frame->insertBinding(inst->dest, std::move(vecVal));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(SHUFFLEVECTOR)
+			{
+				auto& vecVal0 = getOperandValue(*inst, 0).getAsVectorValue();
+				auto& vecVal1 = getOperandValue(*inst, 1).getAsVectorValue();
+				auto retVal = createVectorValue(inst->type);
+				auto& resVec = retVal.getAsVectorValue();
+
+				// Mask entries index into the concatenation of both operands. Undef lanes are left zero
+				auto mask = fn->getShuffleMask(*inst);
+				auto numElems0 = vecVal0.getNumElements();
+				for (auto i = 0u; i < inst->numAux; ++i)
+				{
+					if (mask[i] < 0)
+						continue;
+					auto idx = static_cast<unsigned>(mask[i]);
+					resVec.setRawLane(i, (idx < numElems0) ? vecVal0.getRawLane(idx) : vecVal1.getRawLane(idx - numElems0));
+				}
+				frame->insertBinding(inst->dest, std::move(retVal));
+				DISPATCH_NEXT();
 			}
 
-			auto argVals = std::vector<DynamicValue>();
-			for (auto itr = cs.arg_begin(), ite = cs.arg_end(); itr != ite; ++itr)
-				argVals.push_back(evaluateOperand(frame, *itr));
-
-			auto retVal = (callTgt->isDeclaration()) ? callExternalFunction(cs, callTgt, std::move(argVals)) : callFunction(callTgt, std::move(argVals));
-			if (!callTgt->getReturnType()->isVoidTy())
-				frame.insertBinding(inst, std::move(retVal));
-
-			break;
+			// Superinstructions...
+			DISPATCH_CASE(ICMP_BR)
+			{
+				countFusedExecution(*inst);
+				auto& val0 = getOperandValue(*inst, 0);
+				auto& val1 = getOperandValue(*inst, 1);
+				if (evaluateICmp(inst->predicate, val0, val1))
+					branchTo(inst->targets[0]);
+				else
+					branchTo(inst->targets[1]);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(GEP_LOAD)
+			{
+				countFusedExecution(*inst);
+				auto loadPtr = evaluateGEP(*inst, 0);
+				if (inst->elementOpcode != Opcode::LOAD)
+					loadTypedValue(inst->elementOpcode, loadPtr.getAsPointerValue(), inst->dest);
+				else
+					frame->insertBinding(inst->dest, readFromPointer(loadPtr.getAsPointerValue(), inst->type));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(GEP_STORE)
+			{
+				countFusedExecution(*inst);
+				auto storePtr = evaluateGEP(*inst, 1);
+				if (inst->elementOpcode != Opcode::STORE)
+					storeTypedValue(inst->elementOpcode, storePtr.getAsPointerValue(), getOperandValue(*inst, 0));
+				else
+					writeToPointer(storePtr.getAsPointerValue(), getOperandValue(*inst, 0));
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_ADD)
+			{
+				evaluateLoadIntBinOp(*inst,
+					[] (auto ops, uint64_t i0, uint64_t i1)
+					{
+						return ops.add(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_SUB)
+			{
+				evaluateLoadIntBinOp(*inst,
+					[] (auto ops, uint64_t i0, uint64_t i1)
+					{
+						return ops.sub(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_MUL)
+			{
+				evaluateLoadIntBinOp(*inst,
+					[] (auto ops, uint64_t i0, uint64_t i1)
+					{
+						return ops.mul(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_AND)
+			{
+				evaluateLoadIntBinOp(*inst,
+					[] (auto ops, uint64_t i0, uint64_t i1)
+					{
+						return ops.bitAnd(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_OR)
+			{
+				evaluateLoadIntBinOp(*inst,
+					[] (auto ops, uint64_t i0, uint64_t i1)
+					{
+						return ops.bitOr(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
+			DISPATCH_CASE(LOAD_XOR)
+			{
+				evaluateLoadIntBinOp(*inst,
+					[] (auto ops, uint64_t i0, uint64_t i1)
+					{
+						return ops.bitXor(i0, i1);
+					}
+				);
+				DISPATCH_NEXT();
+			}
 		}
-
-		// Instructions that should not be here
-		case Instruction::PHI:
-			llvm_unreachable("Illegal instruction type!");
-
-		// Unimplemented instructions
-		case Instruction::VAArg:
-		case Instruction::Invoke:
-		case Instruction::LandingPad:
-			llvm_unreachable("Unimplemented instruction type!");
-
-		// Unsupported instructions
-		case Instruction::AddrSpaceCast:
-		case Instruction::AtomicCmpXchg:
-		case Instruction::AtomicRMW:
-		case Instruction::Fence:
-		case Instruction::ExtractElement:
-		case Instruction::InsertElement:
-		case Instruction::ShuffleVector:
-			llvm_unreachable("Unsupported instruction type!");
 	}
+
+#undef DISPATCH_CASE
+#undef DISPATCH_NEXT
 }
@@ -1,10 +1,14 @@
+#include "External.h"
 #include "Interpreter.h"
 
 #include "llvm/IR/CallSite.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <algorithm>
 #include <boost/format.hpp>
+#include <cerrno>
+#include <thread>
 #include <unordered_map>
 
 using namespace llvm;
@@ -12,19 +16,35 @@ using namespace llvm_interpreter;
 
 // This file contains all codes necessary for dealing with external function calls
 
-enum class ExternalCallType
+namespace llvm_interpreter
+{
+
+enum class ExternalCallType: std::uint8_t
 {
 	NOOP,
 	PRINTF,
 	MEMCPY,
 	MEMSET,
 	MALLOC,
+	CALLOC,
+	REALLOC,
+	ALIGNED_ALLOC,
+	POSIX_MEMALIGN,
 	FREE,
+	PTHREAD_CREATE,
+	PTHREAD_JOIN,
+	PTHREAD_SELF,
+	PTHREAD_MUTEX_INIT,
+	PTHREAD_MUTEX_LOCK,
+	PTHREAD_MUTEX_TRYLOCK,
+	PTHREAD_MUTEX_UNLOCK,
 };
 
-DynamicValue Interpreter::callExternalFunction(ImmutableCallSite cs, const llvm::Function* f, std::vector<DynamicValue>&& argValues)
+}
+
+ExternalEnvironment::ExternalEnvironment(): out(&outs())
 {
-	static std::unordered_map<std::string, ExternalCallType> externalFuncMap =
+	externalFuncMap =
 	{
 		{ "printf", ExternalCallType::PRINTF },
 		{ "memcpy", ExternalCallType::MEMCPY },
@@ -35,30 +55,44 @@ DynamicValue Interpreter::callExternalFunction(ImmutableCallSite cs, const llvm:
 		{ "llvm.memset.p0i8.i32", ExternalCallType::MEMSET },
 		{ "llvm.memset.p0i8.i64", ExternalCallType::MEMSET },
 		{ "malloc", ExternalCallType::MALLOC },
+		{ "calloc", ExternalCallType::CALLOC },
+		{ "realloc", ExternalCallType::REALLOC },
+		{ "aligned_alloc", ExternalCallType::ALIGNED_ALLOC },
+		{ "memalign", ExternalCallType::ALIGNED_ALLOC },
+		{ "posix_memalign", ExternalCallType::POSIX_MEMALIGN },
 		{ "free", ExternalCallType::FREE },
+		{ "pthread_create", ExternalCallType::PTHREAD_CREATE },
+		{ "pthread_join", ExternalCallType::PTHREAD_JOIN },
+		{ "pthread_self", ExternalCallType::PTHREAD_SELF },
+		{ "pthread_mutex_init", ExternalCallType::PTHREAD_MUTEX_INIT },
+		{ "pthread_mutex_destroy", ExternalCallType::NOOP },
+		{ "pthread_mutex_lock", ExternalCallType::PTHREAD_MUTEX_LOCK },
+		{ "pthread_mutex_trylock", ExternalCallType::PTHREAD_MUTEX_TRYLOCK },
+		{ "pthread_mutex_unlock", ExternalCallType::PTHREAD_MUTEX_UNLOCK },
 	};
+}
 
-	auto getRawPointer = [this] (const PointerValue& ptr)
-	{
-		switch (ptr.getAddressSpace())
-		{
-			case PointerAddressSpace::GLOBAL_SPACE:
-				return globalMem.getRawPointerAtAddress(ptr.getAddress());
-			case PointerAddressSpace::STACK_SPACE:
-				return stackMem.getRawPointerAtAddress(ptr.getAddress());
-			case PointerAddressSpace::HEAP_SPACE:
-				return heapMem.getRawPointerAtAddress(ptr.getAddress());
-		}
-	};
-
+// The lookup by name is done once per call site and target, after which the inline cache of the call site remembers the result
+ExternalCallType ExternalEnvironment::getExternalCallType(const llvm::Function* f) const
+{
 	auto itr = externalFuncMap.find(f->getName());
 	if (itr == externalFuncMap.end())
 	{
 		errs() << "Unknown external function: " << f->getName() << "\n";
 		llvm_unreachable("");
 	}
+	return itr->second;
+}
+
+DynamicValue Interpreter::callExternalFunction(ImmutableCallSite cs, ExternalCallType callType, std::vector<DynamicValue>&& argValues)
+{
+	// A guest mutex is a lock word at the start of its pthread_mutex_t, which is 0 when the mutex is unlocked. PTHREAD_MUTEX_INITIALIZER is all zeroes, so statically initialized mutexes work too. Only plain mutexes are supported: they are neither recursive nor error-checking
+	auto getMutexWord = [this] (const DynamicValue& mutexPtr)
+	{
+		return static_cast<uint32_t*>(getRawPointer(mutexPtr.getAsPointerValue()));
+	};
 
-	switch (itr->second)
+	switch (callType)
 	{
 		case ExternalCallType::NOOP:
 			return DynamicValue::getUndefValue();
@@ -84,7 +118,10 @@ DynamicValue Interpreter::callExternalFunction(ImmutableCallSite cs, const llvm:
 					llvm_unreachable("Passing an array or struct to printf?");
 			}
 
-			outs() << fmt.str();
+			{
+				std::lock_guard<std::mutex> lock(process->outputLock);
+				externals.getOutputStream() << fmt.str();
+			}
 
 			return DynamicValue::getIntValue(APInt(32, fmt.size()));
 		}
@@ -92,8 +129,8 @@ DynamicValue Interpreter::callExternalFunction(ImmutableCallSite cs, const llvm:
 		{
 			assert(argValues.size() >= 3);
 
-			auto& destPtr = argValues.at(0).getAsPointerValue();
-			auto& srcPtr = argValues.at(1).getAsPointerValue();
+			auto destPtr = argValues.at(0).getAsPointerValue();
+			auto srcPtr = argValues.at(1).getAsPointerValue();
 			auto size = argValues.at(2).getAsIntValue().getInt().getZExtValue();
 
 			std::memcpy(getRawPointer(destPtr), getRawPointer(srcPtr), size);
@@ -104,7 +141,7 @@ DynamicValue Interpreter::callExternalFunction(ImmutableCallSite cs, const llvm:
 		{
 			assert(argValues.size() >= 3);
 
-			auto& destPtr = argValues.at(0).getAsPointerValue();
+			auto destPtr = argValues.at(0).getAsPointerValue();
 			auto fillInt = argValues.at(1).getAsIntValue().getInt().getZExtValue();
 			auto size = argValues.at(2).getAsIntValue().getInt().getZExtValue();
 			
@@ -118,21 +155,138 @@ DynamicValue Interpreter::callExternalFunction(ImmutableCallSite cs, const llvm:
 
 			auto mallocSize = argValues.at(0).getAsIntValue().getInt().getZExtValue();
 
-			auto retAddr = heapMem.allocate(mallocSize);
+			std::lock_guard<std::mutex> lock(process->heapLock);
+			auto retAddr = process->heapAllocator.allocate(mallocSize);
+
+			return DynamicValue::getPointerValue(PointerAddressSpace::HEAP_SPACE, retAddr);
+		}
+		case ExternalCallType::CALLOC:
+		{
+			assert(argValues.size() >= 2);
+
+			auto numElems = argValues.at(0).getAsIntValue().getInt().getZExtValue();
+			auto elemSize = argValues.at(1).getAsIntValue().getInt().getZExtValue();
+			if (elemSize != 0 && numElems > UINT64_MAX / elemSize)
+				return DynamicValue::getPointerValue(PointerAddressSpace::GLOBAL_SPACE, 0);
+
+			std::lock_guard<std::mutex> lock(process->heapLock);
+			auto retAddr = process->heapAllocator.allocate(numElems * elemSize);
+			// Blocks that were freed before keep their old contents
+			std::memset(heapMem.getRawPointerAtAddress(retAddr), 0, numElems * elemSize);
+
+			return DynamicValue::getPointerValue(PointerAddressSpace::HEAP_SPACE, retAddr);
+		}
+		case ExternalCallType::REALLOC:
+		{
+			assert(argValues.size() >= 2);
+
+			auto ptrVal = argValues.at(0).getAsPointerValue();
+			auto newSize = argValues.at(1).getAsIntValue().getInt().getZExtValue();
+			if (ptrVal.getAddress() != 0 && ptrVal.getAddressSpace() != PointerAddressSpace::HEAP_SPACE)
+				llvm_unreachable("Trying to realloc a non-heap pointer?");
+
+			std::lock_guard<std::mutex> lock(process->heapLock);
+			// Like glibc, shrinking a block to nothing frees it
+			if (ptrVal.getAddress() != 0 && newSize == 0)
+			{
+				process->heapAllocator.free(ptrVal.getAddress());
+				return DynamicValue::getPointerValue(PointerAddressSpace::GLOBAL_SPACE, 0);
+			}
+			auto retAddr = process->heapAllocator.reallocate(ptrVal.getAddress(), newSize);
 
 			return DynamicValue::getPointerValue(PointerAddressSpace::HEAP_SPACE, retAddr);
 		}
+		case ExternalCallType::ALIGNED_ALLOC:
+		{
+			assert(argValues.size() >= 2);
+
+			auto alignment = argValues.at(0).getAsIntValue().getInt().getZExtValue();
+			auto size = argValues.at(1).getAsIntValue().getInt().getZExtValue();
+			if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+				return DynamicValue::getPointerValue(PointerAddressSpace::GLOBAL_SPACE, 0);
+
+			std::lock_guard<std::mutex> lock(process->heapLock);
+			auto retAddr = process->heapAllocator.allocate(size, alignment);
+
+			return DynamicValue::getPointerValue(PointerAddressSpace::HEAP_SPACE, retAddr);
+		}
+		case ExternalCallType::POSIX_MEMALIGN:
+		{
+			assert(argValues.size() >= 3);
+
+			auto resPtr = argValues.at(0).getAsPointerValue();
+			auto alignment = argValues.at(1).getAsIntValue().getInt().getZExtValue();
+			auto size = argValues.at(2).getAsIntValue().getInt().getZExtValue();
+			if (alignment < dataLayout.getPointerSize() || (alignment & (alignment - 1)) != 0)
+				return DynamicValue::getIntValue(32, EINVAL);
+
+			auto retAddr = Address(0);
+			{
+				std::lock_guard<std::mutex> lock(process->heapLock);
+				retAddr = process->heapAllocator.allocate(size, alignment);
+			}
+			writeToPointer(resPtr, DynamicValue::getPointerValue(PointerAddressSpace::HEAP_SPACE, retAddr));
+
+			return DynamicValue::getIntValue(32, 0);
+		}
 		case ExternalCallType::FREE:
 		{
 			assert(argValues.size() >= 1);
 
-			auto& ptrVal = argValues.at(0).getAsPointerValue();
+			auto ptrVal = argValues.at(0).getAsPointerValue();
+			if (ptrVal.getAddress() == 0)
+				return DynamicValue::getUndefValue();
 			if (ptrVal.getAddressSpace() != PointerAddressSpace::HEAP_SPACE)
 				llvm_unreachable("Trying to free a non-heap pointer?");
 
-			heapMem.free(ptrVal.getAddress());
+			std::lock_guard<std::mutex> lock(process->heapLock);
+			process->heapAllocator.free(ptrVal.getAddress());
 			return DynamicValue::getUndefValue();
 		}
+		case ExternalCallType::PTHREAD_CREATE:
+		{
+			assert(argValues.size() >= 4);
+			return createThread(argValues.at(0).getAsPointerValue(), argValues.at(2).getAsPointerValue(), std::move(argValues.at(3)));
+		}
+		case ExternalCallType::PTHREAD_JOIN:
+		{
+			assert(argValues.size() >= 2);
+			auto tid = argValues.at(0).getAsIntValue().getZExtValue();
+			return joinThread(tid, argValues.at(1).getAsPointerValue());
+		}
+		case ExternalCallType::PTHREAD_SELF:
+			return DynamicValue::getIntValue(cs.getType()->getIntegerBitWidth(), threadId);
+		case ExternalCallType::PTHREAD_MUTEX_INIT:
+		{
+			assert(argValues.size() >= 1);
+			__atomic_store_n(getMutexWord(argValues.at(0)), 0u, __ATOMIC_SEQ_CST);
+			return DynamicValue::getIntValue(32, 0);
+		}
+		case ExternalCallType::PTHREAD_MUTEX_LOCK:
+		{
+			assert(argValues.size() >= 1);
+			auto word = getMutexWord(argValues.at(0));
+			auto unlocked = 0u;
+			while (!__atomic_compare_exchange_n(word, &unlocked, 1u, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			{
+				unlocked = 0u;
+				std::this_thread::yield();
+			}
+			return DynamicValue::getIntValue(32, 0);
+		}
+		case ExternalCallType::PTHREAD_MUTEX_TRYLOCK:
+		{
+			assert(argValues.size() >= 1);
+			auto unlocked = 0u;
+			auto locked = __atomic_compare_exchange_n(getMutexWord(argValues.at(0)), &unlocked, 1u, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+			return DynamicValue::getIntValue(32, locked ? 0 : EBUSY);
+		}
+		case ExternalCallType::PTHREAD_MUTEX_UNLOCK:
+		{
+			assert(argValues.size() >= 1);
+			__atomic_store_n(getMutexWord(argValues.at(0)), 0u, __ATOMIC_RELEASE);
+			return DynamicValue::getIntValue(32, 0);
+		}
 	}
 
 	llvm_unreachable("Should not reach here");
@@ -0,0 +1,236 @@
+#include "HeapAllocator.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace llvm_interpreter;
+
+HeapAllocator::HeapAllocator(MemorySection& h): heap(h), bumpOnly(false), bytesInUse(0), peakBytesInUse(0)
+{
+}
+
+unsigned HeapAllocator::getSizeClass(uint64_t size)
+{
+	if (size <= 256)
+		return (size == 0) ? 0 : (size - 1) / 16;
+
+	auto sizeClass = 16u;
+	for (auto capacity = uint64_t(512); capacity < size; capacity *= 2)
+		++sizeClass;
+	return sizeClass;
+}
+
+uint64_t HeapAllocator::getSizeClassCapacity(unsigned sizeClass)
+{
+	if (sizeClass < 16)
+		return (sizeClass + 1) * 16;
+	return uint64_t(512) << (sizeClass - 16);
+}
+
+HeapAllocator::BlockHeader HeapAllocator::readHeader(Address addr) const
+{
+	if (addr < HeaderSize + 1 || addr >= heap.getUsedSize())
+		throw std::out_of_range("Freeing or reallocating an address that is not a heap block");
+
+	BlockHeader header;
+	std::memcpy(&header, heap.getRawPointerAtAddress(addr - HeaderSize), HeaderSize);
+	return header;
+}
+
+void HeapAllocator::writeHeader(Address addr, uint64_t capacity, uint64_t offset)
+{
+	auto header = BlockHeader{ capacity, offset };
+	std::memcpy(heap.getRawPointerAtAddress(addr - HeaderSize), &header, HeaderSize);
+}
+
+Address HeapAllocator::allocateFromTop(uint64_t chunkSize)
+{
+	// Chunk sizes are multiples of MinAlignment, so only the first chunk needs padding
+	return heap.allocateAligned(chunkSize, MinAlignment) + HeaderSize;
+}
+
+void HeapAllocator::insertFreeRange(Address chunk, uint64_t chunkSize)
+{
+	freeRanges.insert(std::make_pair(chunk, chunkSize));
+	freeRangesBySize.insert(std::make_pair(chunkSize, chunk));
+}
+
+void HeapAllocator::eraseFreeRange(std::map<Address, uint64_t>::iterator itr)
+{
+	auto range = freeRangesBySize.equal_range(itr->second);
+	for (auto sizeItr = range.first; sizeItr != range.second; ++sizeItr)
+	{
+		if (sizeItr->second == itr->first)
+		{
+			freeRangesBySize.erase(sizeItr);
+			break;
+		}
+	}
+	freeRanges.erase(itr);
+}
+
+Address HeapAllocator::allocateLarge(uint64_t size)
+{
+	auto capacity = getLargeCapacity(size);
+	auto chunkSize = capacity + HeaderSize;
+
+	// Best fit: take the smallest free range that is large enough, and keep what is left of it
+	auto itr = freeRangesBySize.lower_bound(chunkSize);
+	if (!bumpOnly && itr != freeRangesBySize.end())
+	{
+		auto rangeSize = itr->first;
+		auto chunk = itr->second;
+		eraseFreeRange(freeRanges.find(chunk));
+		if (rangeSize > chunkSize)
+			insertFreeRange(chunk + chunkSize, rangeSize - chunkSize);
+
+		writeHeader(chunk + HeaderSize, capacity, 0);
+		return chunk + HeaderSize;
+	}
+
+	auto addr = allocateFromTop(chunkSize);
+	writeHeader(addr, capacity, 0);
+	return addr;
+}
+
+void HeapAllocator::freeLarge(Address chunk, uint64_t chunkSize)
+{
+	auto next = freeRanges.find(chunk + chunkSize);
+	if (next != freeRanges.end())
+	{
+		chunkSize += next->second;
+		eraseFreeRange(next);
+	}
+	auto prev = freeRanges.lower_bound(chunk);
+	if (prev != freeRanges.begin())
+	{
+		--prev;
+		if (prev->first + prev->second == chunk)
+		{
+			chunk = prev->first;
+			chunkSize += prev->second;
+			eraseFreeRange(prev);
+		}
+	}
+
+	// Nobody is going to read the free pages until they are allocated again, so the host may as well have them back
+	heap.discard(chunk, chunkSize);
+	if (chunk + chunkSize == heap.getUsedSize())
+		heap.deallocate(chunkSize);
+	else
+		insertFreeRange(chunk, chunkSize);
+}
+
+Address HeapAllocator::allocate(uint64_t size, uint64_t alignment)
+{
+	assert((alignment & (alignment - 1)) == 0 && "The alignment must be a power of two");
+
+	if (alignment > MinAlignment)
+	{
+		// Allocate enough to slide the block to the next aligned address. Both addresses are multiples of MinAlignment, so if they differ there is room for the header of the aligned block in between
+		auto base = allocate(size + alignment, MinAlignment);
+		auto addr = (base + alignment - 1) / alignment * alignment;
+		if (addr != base)
+			writeHeader(addr, readHeader(base).capacity - (addr - base), addr - base);
+		return addr;
+	}
+
+	auto addr = Address(0);
+	auto capacity = uint64_t(0);
+	if (size <= MaxSmallSize)
+	{
+		auto sizeClass = getSizeClass(size);
+		capacity = getSizeClassCapacity(sizeClass);
+		auto& freeList = freeLists[sizeClass];
+		if (!bumpOnly && !freeList.empty())
+		{
+			addr = freeList.back();
+			freeList.pop_back();
+		}
+		else
+		{
+			addr = allocateFromTop(capacity + HeaderSize);
+			writeHeader(addr, capacity, 0);
+		}
+	}
+	else
+	{
+		addr = allocateLarge(size);
+		capacity = getLargeCapacity(size);
+	}
+
+	bytesInUse += capacity;
+	peakBytesInUse = std::max(peakBytesInUse, bytesInUse);
+	return addr;
+}
+
+void HeapAllocator::free(Address addr)
+{
+	if (addr == 0)
+		return;
+
+	auto header = readHeader(addr);
+	if (header.offset != 0)
+	{
+		free(addr - header.offset);
+		return;
+	}
+
+	bytesInUse -= header.capacity;
+	if (bumpOnly)
+		return;
+
+	if (header.capacity <= MaxSmallSize)
+		freeLists[getSizeClass(header.capacity)].push_back(addr);
+	else
+		freeLarge(addr - HeaderSize, header.capacity + HeaderSize);
+}
+
+Address HeapAllocator::reallocate(Address addr, uint64_t size)
+{
+	if (addr == 0)
+		return allocate(size);
+
+	auto header = readHeader(addr);
+	if (size <= header.capacity)
+		return addr;
+
+	// A large block grows in place if the memory right after it is free, or is the end of the heap
+	if (!bumpOnly && header.offset == 0 && header.capacity > MaxSmallSize)
+	{
+		auto capacity = getLargeCapacity(size);
+		auto extra = capacity - header.capacity;
+		auto blockEnd = addr + header.capacity;
+		auto grown = false;
+		if (blockEnd == heap.getUsedSize())
+		{
+			heap.allocate(extra);
+			grown = true;
+		}
+		else
+		{
+			auto next = freeRanges.find(blockEnd);
+			if (next != freeRanges.end() && next->second >= extra)
+			{
+				auto rangeSize = next->second;
+				eraseFreeRange(next);
+				if (rangeSize > extra)
+					insertFreeRange(blockEnd + extra, rangeSize - extra);
+				grown = true;
+			}
+		}
+
+		if (grown)
+		{
+			writeHeader(addr, capacity, 0);
+			bytesInUse += extra;
+			peakBytesInUse = std::max(peakBytesInUse, bytesInUse);
+			return addr;
+		}
+	}
+
+	auto newAddr = allocate(size);
+	std::memcpy(heap.getRawPointerAtAddress(newAddr), heap.getRawPointerAtAddress(addr), header.capacity);
+	free(addr);
+	return newAddr;
+}
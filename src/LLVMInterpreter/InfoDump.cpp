@@ -1,6 +1,7 @@
 #include "Memory.h"
 #include "Interpreter.h"
 
+#include "llvm/IR/Instruction.h"
 #include "llvm/Support/raw_ostream.h"
 
 #include <sstream>
@@ -13,7 +14,7 @@ using namespace llvm_interpreter;
 std::string IntValue::toString() const
 {
 	std::ostringstream ss;
-	ss << "<INT" << intVal.getBitWidth() << " " << intVal.toString(10, false) << ">";
+	ss << "<INT" << bitWidth << " " << getInt().toString(10, false) << ">";
 	return ss.str();
 }
 
@@ -68,20 +69,32 @@ std::string StructValue::toString() const
 	return ss.str();
 }
 
+std::string VectorValue::toString() const
+{
+	std::ostringstream ss;
+	ss << "< ";
+	for (auto i = 0u; i < numElems; ++i)
+		ss << getElementAtIndex(i).toString() << " ";
+	ss << ">";
+	return ss.str();
+}
+
 std::string DynamicValue::toString() const
 {
 	switch (type)
 	{
 		case DynamicValueType::INT_VALUE:
-			return data.intVal.toString();
+			return getAsIntValue().toString();
 		case DynamicValueType::FLOAT_VALUE:
-			return data.floatVal.toString();
+			return getAsFloatValue().toString();
 		case DynamicValueType::POINTER_VALUE:
-			return data.ptrVal.toString();
+			return getAsPointerValue().toString();
 		case DynamicValueType::ARRAY_VALUE:
-			return data.arrayVal.toString();
+			return getAsArrayValue().toString();
 		case DynamicValueType::STRUCT_VALUE:
-			return data.structVal.toString();
+			return getAsStructValue().toString();
+		case DynamicValueType::VECTOR_VALUE:
+			return getAsVectorValue().toString();
 		case DynamicValueType::UNDEF_VALUE:
 			return "<undef>";
 	}
@@ -91,12 +104,13 @@ void StackFrame::dumpFrame() const
 {
 	errs() << "--- Stack Frame Dump ---\n";
 
-	errs() << "Current Function = " << curFunction->getName() << "\n";
+	errs() << "Current Function = " << getFunction()->getName() << "\n";
 	errs() << "Current Frame Size = " << allocSize << "\n";
 	errs() << "Bindings: \n";
-	for (auto const& mapping: vRegs)
+	for (auto i = 0u; i < numSlots; ++i)
 	{
-		errs() << mapping.first->getName() << "  -->>  " << mapping.second.toString() << "\n";
+		auto slotValue = curFunction->getSlotValue(i);
+		errs() << ((slotValue != nullptr) ? slotValue->getName() : "<scratch>") << "  -->>  " << vRegs[i].toString() << "\n";
 	}
 
 	errs() << "---        End       ---\n";
@@ -105,24 +119,79 @@ void StackFrame::dumpFrame() const
 void StackFrames::dumpContext() const
 {
 	errs() << "Context = [ ";
-	for (auto const& frame: frames)
+	for (auto i = 0u; i < numFrames; ++i)
 	{
-		errs() << frame->getFunction()->getName() << " ";
+		errs() << frames[i]->getFunction()->getName() << " ";
 	}
 	errs() << "]\n";
 }
 
+const char* llvm_interpreter::getOpcodeName(Opcode op)
+{
+	switch (op)
+	{
+#define HANDLE_OPCODE(name) case Opcode::name: return #name;
+#include "Opcodes.def"
+	}
+	llvm_unreachable("Unknown opcode");
+}
+
+bool llvm_interpreter::isFusedOpcode(Opcode op)
+{
+	switch (op)
+	{
+#define HANDLE_OPCODE(name) case Opcode::name: return false;
+#define HANDLE_FUSED_OPCODE(name) case Opcode::name: return true;
+#include "Opcodes.def"
+	}
+	llvm_unreachable("Unknown opcode");
+}
+
+void PreparedFunction::dumpCode() const
+{
+	errs() << "--- Prepared Code Dump ---\n";
+
+	errs() << "Function = " << function->getName() << "\n";
+	for (auto i = 0u; i < blocks.size(); ++i)
+	{
+		errs() << "Block " << i << " (" << blocks[i].block->getName() << "):\n";
+		auto blockEnd = (i + 1 < blocks.size()) ? blocks[i + 1].entry : getCodeSize();
+		for (auto pc = blocks[i].entry; pc < blockEnd; ++pc)
+		{
+			errs() << "  " << pc << "\t" << getOpcodeName(code[pc].opcode) << "\t";
+			// A superinstruction also stands for the instruction right before its own
+			if (isFusedOpcode(code[pc].opcode))
+				errs() << *code[pc].inst->getPrevNode() << " ;";
+			errs() << *code[pc].inst << "\n";
+		}
+	}
+
+	for (auto i = 0u; i < edges.size(); ++i)
+	{
+		errs() << "Edge " << i << " -> Block " << edges[i].target << ":";
+		for (auto j = 0u; j < edges[i].numCopies; ++j)
+		{
+			auto& copy = getPhiCopy(edges[i], j);
+			errs() << " %" << copy.dest << " = " << ((copy.src.kind == OperandKind::REGISTER) ? "%" : "$") << copy.src.index << ";";
+		}
+		errs() << "\n";
+	}
+
+	errs() << "---          End         ---\n";
+}
+
 void MemorySection::dumpMemory(Address startAddr, unsigned size) const
 {
 	errs() << "--- Memory Dump ---\n";
 
-	errs() << "Total Memory Size = " << totalSize << "\n";
-	errs() << "Allocated Memory Size = " << usedSize << "\n";
+	errs() << "Reserved Memory Size = " << reservedSize << "\n";
+	errs() << "Committed Memory Size = " << committedSize.load() << "\n";
+	errs() << "Allocated Memory Size = " << usedSize.load() << "\n";
 	errs() << "Data Dump:\n";
 	
 	auto currAddr = startAddr;
 	auto step = 8;
-	auto endAddr = (size == 0) ? usedSize : startAddr + size;
+	auto endAddr = (size == 0) ? getUsedSize() : startAddr + size;
 	while (currAddr < endAddr)
 	{
 		errs() << "Addr " << currAddr;
@@ -4,34 +4,120 @@
 #include "llvm/IR/Constants.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include <stdexcept>
+
 using namespace llvm;
 using namespace llvm_interpreter;
 
-Interpreter::Interpreter(llvm::Module* m): module(m), dataLayout(m)
+// The global section holds the globals and the function table, which are laid out by evaluateGlobals(), and then the addresses given to blockaddress constants and the arguments of main(). The room left for the latter is GlobalHeadroom
+static const size_t GlobalHeadroom = size_t(1) << 26;
+
+static size_t getGlobalReservedSize(const Module* m)
+{
+	DataLayout dataLayout(m);
+	auto size = m->size() * dataLayout.getPointerSize();
+	for (auto const& globalVal: m->globals())
+		size += dataLayout.getTypeAllocSize(cast<PointerType>(globalVal.getType())->getElementType());
+	return size + GlobalHeadroom;
+}
+
+Interpreter::Interpreter(llvm::Module* m, const MemoryLimits& limits): Interpreter(m, std::make_shared<PreparedModule>(m), limits) {}
+
+Interpreter::Interpreter(llvm::Module* m, std::shared_ptr<PreparedModule> prepared, const MemoryLimits& limits): module(m), dataLayout(m), typeLayouts(dataLayout), process(std::make_shared<GuestProcess>(getGlobalReservedSize(m), limits)), threadId(0), globalMem(process->globalMem), functionTableBase(0), functionAddressStride(0), preparedModule(std::move(prepared)), tierUpThreshold(0), tieringEnabled(false), stackMem(process->createStack(0, dataLayout.getPointerSize())), heapMem(process->heapMem), numExecutedInstructions(0)
 {
+	numFusedExecutions.fill(0);
+
+	auto ptrSize = dataLayout.getPointerSize();
+	globalMem.setPointerSize(ptrSize);
+	heapMem.setPointerSize(ptrSize);
+}
+
+Interpreter::~Interpreter()
+{
+	// The threads hold on to the process, so the main thread is the one to let go of them. There is no safe way to stop a host thread, so a thread still running is waited for, even one blocked on a lock that the failed main thread held. Nobody is left to catch the error of a thread, so it is reported here
+	if (threadId == 0)
+	{
+		auto nullPtr = DynamicValue::getPointerValue(PointerAddressSpace::GLOBAL_SPACE, 0);
+		for (auto tid = findUnjoinedThread(); tid != 0; tid = findUnjoinedThread())
+		{
+			try
+			{
+				joinThread(tid, nullPtr.getAsPointerValue());
+			}
+			catch (const std::exception& e)
+			{
+				errs() << "Thread " << tid << " failed: " << e.what() << "\n";
+			}
+			catch (...)
+			{
+				errs() << "Thread " << tid << " failed\n";
+			}
+		}
+	}
 }
 
-Interpreter::~Interpreter() {}
+void Interpreter::setTierUpThreshold(unsigned threshold)
+{
+	tierUpThreshold = threshold;
+	if (threshold != 0 && !nativeTier)
+		nativeTier = std::make_unique<NativeTier>(getNativeEnvironment());
+	tieringEnabled = (nativeTier != nullptr);
+}
+
+void Interpreter::setNativeSelection(std::unique_ptr<FunctionSelector> selector)
+{
+	nativeSelector = std::move(selector);
+	if (!nativeTier)
+		nativeTier = std::make_unique<NativeTier>(getNativeEnvironment());
+	tieringEnabled = true;
+}
 
 Address Interpreter::allocateStackMem(StackFrame& frame, unsigned size)
 {
 	frame.increaseAllocationSize(size);
-	return stackMem.allocate(size);
+	return (Address(threadId) << StackThreadShift) | stackMem.allocate(size);
 }
 
 Address Interpreter::allocateGlobalMem(Type* type)
 {
-	if (type->isVectorTy())
-		llvm_unreachable("Vector type not supported");
-
-	auto globalSize = dataLayout.getTypeAllocSize(type);
+	auto globalSize = typeLayouts.getTypeAllocSize(type);
 	return globalMem.allocate(globalSize);
 }
 
-void Interpreter::evaluateGlobals()
+Address Interpreter::getBlockAddress(const BasicBlock* bb)
+{
+	std::lock_guard<std::mutex> lock(process->blockAddressLock);
+	auto itr = process->blockAddresses.find(bb);
+	if (itr != process->blockAddresses.end())
+		return itr->second;
+
+	// A block address only needs to be unique, so one byte of global memory is enough
+	auto blockAddr = globalMem.allocate(1);
+	process->blockAddresses.insert(std::make_pair(bb, blockAddr));
+	process->blockPtrMap.insert(std::make_pair(blockAddr, bb));
+	return blockAddr;
+}
+
+const BasicBlock* Interpreter::getBlockAtAddress(Address addr)
+{
+	std::lock_guard<std::mutex> lock(process->blockAddressLock);
+	auto itr = process->blockPtrMap.find(addr);
+	if (itr == process->blockPtrMap.end())
+		throw std::out_of_range("Branching to an address that is not a block address");
+	return itr->second;
+}
+
+const Function* Interpreter::getFunctionAtAddress(Address addr) const
 {
-	PointerValue::setPointerSize(dataLayout.getPointerSize());
+	// A bad function pointer is an error of the guest program, so it is reported the way bad memory accesses are
+	auto offset = addr - functionTableBase;
+	if (functionAddressStride == 0 || addr < functionTableBase || offset % functionAddressStride != 0 || offset / functionAddressStride >= functionTable.size())
+		throw std::out_of_range("Calling through a pointer that does not point to a function");
+	return functionTable[offset / functionAddressStride];
+}
 
+void Interpreter::evaluateGlobals()
+{
 	for (auto const& globalVal: module->globals())
 	{
 		auto elemType = cast<PointerType>(globalVal.getType())->getElementType();
@@ -39,20 +125,37 @@ void Interpreter::evaluateGlobals()
 		globalEnv.insert(std::make_pair(&globalVal, globalAddr));
 	}
 
+	// Give each function a corresponding pointer. This has to be done before the initializers are evaluated, since they may take the address of a function
+	// The function pointers are laid out as an array, so that the function at an address is found by index
+	functionAddressStride = dataLayout.getPointerSize();
+	functionTableBase = globalMem.allocate(module->size() * functionAddressStride);
+	for (auto const& f: *module)
+	{
+		auto funAddr = functionTableBase + functionTable.size() * functionAddressStride;
+		globalEnv.insert(std::make_pair(&f, funAddr));
+		functionTable.push_back(&f);
+	}
+
 	for (auto const& globalVal: module->globals())
 	{
 		auto globalAddr = globalEnv.at(&globalVal);
 		if (globalVal.hasInitializer())
-			globalMem.write(globalAddr, evaluateConstant(globalVal.getInitializer()));
+			initializeGlobalMem(globalAddr, globalVal.getInitializer());
 	}
+}
 
-	// Give each function a corresponding pointer
-	for (auto const& f: *module)
-	{
-		auto funAddr = allocateGlobalMem(f.getType());
-		globalEnv.insert(std::make_pair(&f, funAddr));
-		funPtrMap.insert(std::make_pair(funAddr, &f));
-	}
+void Interpreter::copyGlobalsFrom(const Interpreter& other, const MemoryImage& image)
+{
+	assert(module == other.module && "Copying the globals of another module");
+	assert(globalEnv.empty() && "The globals have already been set up");
+
+	globalEnv = other.globalEnv;
+	functionTable = other.functionTable;
+	functionTableBase = other.functionTableBase;
+	functionAddressStride = other.functionAddressStride;
+	process->blockAddresses = other.process->blockAddresses;
+	process->blockPtrMap = other.process->blockPtrMap;
+	globalMem.mapImage(image);
 }
 
 DynamicValue Interpreter::callFunction(const llvm::Function* f, std::vector<DynamicValue>&& argValues)
@@ -60,8 +163,6 @@ DynamicValue Interpreter::callFunction(const llvm::Function* f, std::vector<Dyna
 	assert(f && "f is NULL in runFunction()!");
 	assert(!f->isDeclaration() && "callFunction() does not handle external function!");
 
-	// Make a new stack frame... and fill it in
-	auto& calleeFrame = stack.createFrame(f);
 	assert(
 		(argValues.size() == f->arg_size() ||
 		(argValues.size() > f->arg_size() && f->getFunctionType()->isVarArg())) ||
@@ -70,20 +171,19 @@ DynamicValue Interpreter::callFunction(const llvm::Function* f, std::vector<Dyna
 		"Invalid number of values passed to function invocation!"
 	);
 
-	// Handle non-varargs arguments...
-	unsigned i = 0;
-	for (auto itr = f->arg_begin(), ite = f->arg_end(); itr != ite; ++itr, ++i)
-	{
-		calleeFrame.insertBinding(itr, std::move(argValues[i]));
-	}
+	// If this is the main function and we don't have enough formal arg, just ignore the remaining actual arg. Otherwise the remaining ones are varargs
+	auto numParams = f->arg_size();
+	auto numVarArgs = (f->getName() != "main" && argValues.size() > numParams) ? argValues.size() - numParams : 0;
 
-	// If this is the main function and we don't have enough formal arg, just ignore the remaining actual arg
-	if (f->getName() != "main")
-	{
-		// Otherwise, handle varargs arguments...
-		for (auto itr = argValues.begin() + i, ite = argValues.end(); itr != ite; ++itr)
-			calleeFrame.insertVararg(std::move(*itr));
-	}
+	// Make a new stack frame... and fill it in
+	auto& calleeFrame = stack.createFrame(getPreparedFunction(f), numVarArgs);
+
+	// Handle non-varargs arguments. The i-th argument lives in slot i
+	for (auto i = 0u; i < numParams; ++i)
+		calleeFrame.insertBinding(i, std::move(argValues[i]));
+
+	for (auto i = 0u; i < numVarArgs; ++i)
+		calleeFrame.setVararg(i, std::move(argValues[numParams + i]));
 
 	return runFunction(calleeFrame);
 }
@@ -97,118 +197,19 @@ void Interpreter::popStack()
 	stack.popFrame();
 }
 
-DynamicValue Interpreter::runFunction(StackFrame& frame)
+const PreparedFunction& Interpreter::getPreparedFunction(const Function* f)
 {
-	// Get the current function
-	auto f = frame.getFunction();
-	auto curBB = f->begin();
-
-	// This function handles the actual updating of block and instruction iterators as well as execution of all of the PHI nodes in the destination block.
-	auto switchToNewBasicBlock = [this, &curBB, &frame] (const BasicBlock* destBB)
-	{
-		auto prevBB = curBB;
-		curBB = destBB;
-
-		// We cannot update the binding for phi nodes on-the-fly because the language semantics require them to be updated "simutaneously". New values need to be cached before they can be committed into the stack frame
-		auto phiValueCache = std::vector<std::pair<const PHINode*, DynamicValue>>();
-		for (auto const& inst: *curBB)
-		{
-			auto phiNode = dyn_cast<PHINode>(&inst);
-			if (phiNode == nullptr)
-				break;
-
-			auto idx = phiNode->getBasicBlockIndex(prevBB);
-			assert(idx != -1 && "PHINode doesn't contain entry for predecessor??");
-			auto incomingVal = evaluateOperand(frame, phiNode->getIncomingValue(idx));
-			phiValueCache.push_back(std::make_pair(phiNode, std::move(incomingVal)));
-		}
-
-		for (auto& updatePair: phiValueCache)
-		{
-			frame.insertBinding(updatePair.first, std::move(updatePair.second));
-		}
-	};
-
-	while (true)
+	auto itr = preparedFunctions.find(f);
+	if (itr == preparedFunctions.end())
 	{
-		// Skip all the phi nodes first
-		auto instItr = curBB->begin();
-		while (isa<PHINode>(instItr))
-			++instItr;
-
-		// Evaluate non-terminator instructions.
-		// Those instructions won't alter control flows
-		for (auto instIte = curBB->end(); instItr != instIte; ++instItr)
-		{
-			if (instItr->isTerminator())
-				break;
-
-			evaluateInstruction(frame, instItr);
-		}
-
-		auto termInst = curBB->getTerminator();
-		switch (termInst->getOpcode())
-		{
-			case Instruction::Br:
-			{
-				auto brInst = cast<BranchInst>(termInst);
-
-				auto destBB = brInst->getSuccessor(0);
-				if (brInst->isConditional())
-				{
-					auto condVal = evaluateOperand(frame, brInst->getCondition());
-					if (!condVal.getAsIntValue().getInt().getBoolValue())
-						destBB = brInst->getSuccessor(1);
-				}
-
-				switchToNewBasicBlock(destBB);
-
-				break;
-			}
-			case Instruction::Ret:
-			{
-				auto retInst = cast<ReturnInst>(termInst);
-
-				auto retVal = DynamicValue::getUndefValue();
-				if (auto value = retInst->getReturnValue())
-					retVal = evaluateOperand(frame, value);
-
-				// Pop the stack frame
-				popStack();
-
-				return retVal;
-			}
-			case Instruction::Switch:
-			{
-				auto switchInst = cast<SwitchInst>(termInst);
-
-				auto condVal = evaluateOperand(frame, switchInst->getCondition());
-				auto const& condInt = condVal.getAsIntValue().getInt();
-
-				auto const* destBB = switchInst->getDefaultDest();
-				for (auto& caseItr: switchInst->cases())
-				{
-					auto const& caseInt = caseItr.getCaseValue()->getValue();
-					if (condInt == caseInt)
-					{
-						destBB = caseItr.getCaseSuccessor();
-						break;
-					}
-				}
-
-				switchToNewBasicBlock(destBB);
-
-				break;
-			}
-			case Instruction::Unreachable:
-				llvm_unreachable("Reached an unreachable instruction!");
-			case Instruction::IndirectBr:
-			case Instruction::Invoke:
-			case Instruction::Resume:
-			default:
-				llvm_unreachable("Unsupported terminator instruction");
-		}
+		auto& prepared = preparedModule->getPreparedFunction(f);
+		itr = preparedFunctions.insert(std::make_pair(f, &prepared)).first;
+		// Other interpreters may have translated more functions meanwhile, so the numbers may exceed what this interpreter has seen
+		inlineCaches.resize(preparedModule->getNumCallSites());
+		profiles.resize(preparedModule->getNumFunctions(), FunctionProfile{0, 0, nullptr, false, false});
+		profiles[prepared.getId()].selectedNative = nativeSelector && nativeSelector->shouldRunNatively(f->getName());
 	}
+	return *itr->second;
 }
 
 std::vector<DynamicValue> Interpreter::createArgvArray(const std::vector<std::string>& mainArgs)
@@ -248,11 +249,33 @@ std::vector<DynamicValue> Interpreter::createArgvArray(const std::vector<std::st
 	return retVec;
 }
 
+void Interpreter::reportUncompilableSelection(const Function* mainFn)
+{
+	// The entry function is always interpreted, so there is no point in reporting it
+	auto names = std::vector<StringRef>();
+	for (auto const& f: *module)
+	{
+		if (&f != mainFn && !f.isDeclaration() && nativeSelector->shouldRunNatively(f.getName()) && !nativeTier->isCompilable(&f))
+			names.push_back(f.getName());
+	}
+	if (names.empty())
+		return;
+
+	errs() << "Functions that cannot run natively, interpreting them instead:";
+	for (auto name: names)
+		errs() << " " << name;
+	errs() << "\n";
+}
+
 int Interpreter::runMain(const Function* mainFn, const std::vector< std::string>& mainArgs)
 {
+	if (nativeSelector)
+		reportUncompilableSelection(mainFn);
 	auto args = createArgvArray(mainArgs);
 
 	auto retVal = callFunction(mainFn, std::move(args));
+	// The guest program ends with its main thread, but we let the other threads finish rather than kill them
+	joinAllThreads();
 	if (retVal.isUndefValue())
 		return 0;
 	else
@@ -0,0 +1,119 @@
+#include "Memory.h"
+
+#include "llvm/Support/ErrorHandling.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace llvm_interpreter;
+
+// This file contains the management of the virtual memory behind MemorySection
+
+MemorySection::MemorySection(size_t reservedBytes): reservedSize((reservedBytes + COMMIT_GRANULARITY - 1) / COMMIT_GRANULARITY * COMMIT_GRANULARITY), committedSize(0), usedSize(1), mem(nullptr), pointerSize(8)
+{
+	// Inaccessible pages count neither towards the resident set nor towards the commit charge. A host with a limited address space (ulimit -v) may still refuse a large reservation, in which case we settle for less
+	void* region = MAP_FAILED;
+	while (region == MAP_FAILED)
+	{
+		region = mmap(nullptr, reservedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (region == MAP_FAILED)
+		{
+			if (reservedSize <= COMMIT_GRANULARITY)
+				report_fatal_error("Cannot reserve memory for the interpreter");
+			reservedSize /= 2;
+		}
+	}
+	mem = static_cast<uint8_t*>(region);
+
+	// We use a little trick here: set usedSize = 1 so that valid address starts at 1. Address 0 is reserved for NULL pointer
+	commit(1);
+}
+
+MemorySection::~MemorySection()
+{
+	munmap(mem, reservedSize);
+}
+
+void MemorySection::commit(size_t size)
+{
+	if (size > reservedSize)
+		throw std::runtime_error("The memory section is exhausted");
+
+	auto oldCommittedSize = committedSize.load(std::memory_order_relaxed);
+	auto newCommittedSize = std::min((size + COMMIT_GRANULARITY - 1) / COMMIT_GRANULARITY * COMMIT_GRANULARITY, reservedSize);
+	if (mprotect(mem + oldCommittedSize, newCommittedSize - oldCommittedSize, PROT_READ | PROT_WRITE) != 0)
+		throw std::runtime_error("The host is out of memory");
+	committedSize.store(newCommittedSize, std::memory_order_release);
+}
+
+void MemorySection::discard(Address addr, size_t size)
+{
+	auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	auto begin = (addr + pageSize - 1) / pageSize * pageSize;
+	auto end = std::min<size_t>((addr + size) / pageSize * pageSize, committedSize.load(std::memory_order_acquire));
+	if (begin < end)
+		madvise(mem + begin, end - begin, MADV_DONTNEED);
+}
+
+void MemorySection::reset()
+{
+	discard(1, usedSize.load(std::memory_order_relaxed) - 1);
+	usedSize.store(1, std::memory_order_release);
+}
+
+void MemorySection::mapImage(const MemoryImage& image)
+{
+	assert(usedSize.load(std::memory_order_relaxed) == 1 && "Mapping an image over allocated memory");
+	assert(image.getSize() >= 1 && "Address 0 is always reserved");
+	if (image.getSize() > reservedSize)
+		throw std::runtime_error("The memory section is exhausted");
+
+	// The last page of the mapping extends past the image, and reads as zeroes there. The rest of the section stays anonymous memory
+	auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	auto mappedSize = (image.getSize() + pageSize - 1) / pageSize * pageSize;
+	if (mmap(mem, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, image.getFileDescriptor(), image.getFileOffset()) == MAP_FAILED)
+		throw std::runtime_error("Cannot map a memory image");
+	if (mappedSize > committedSize.load(std::memory_order_relaxed))
+		committedSize.store(mappedSize, std::memory_order_release);
+	usedSize.store(image.getSize(), std::memory_order_release);
+}
+
+MemoryImage::MemoryImage(int f, size_t offset, size_t s): fd(f), fileOffset(offset), size(s) {}
+
+MemoryImage::MemoryImage(const MemorySection& section): fd(-1), fileOffset(0), size(section.getUsedSize())
+{
+	// The file is deleted as soon as it is created, and goes away with the last mapping of it
+	auto file = std::tmpfile();
+	if (file != nullptr)
+	{
+		fd = dup(fileno(file));
+		std::fclose(file);
+	}
+	if (fd < 0)
+		throw std::runtime_error("Cannot create a memory image");
+
+	auto data = static_cast<const uint8_t*>(section.getRawPointerAtAddress(0));
+	auto written = size_t(0);
+	while (written < size)
+	{
+		auto res = write(fd, data + written, size - written);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+		{
+			close(fd);
+			throw std::runtime_error("Cannot write a memory image");
+		}
+		written += res;
+	}
+}
+
+MemoryImage::~MemoryImage()
+{
+	close(fd);
+}
@@ -0,0 +1,650 @@
+#include "IntegerOps.h"
+#include "Memory.h"
+#include "NativeTier.h"
+#include "PreparedFunction.h"
+
+#include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/MCJIT.h"
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/PassManager.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Regex.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+using namespace llvm;
+using namespace llvm_interpreter;
+
+// This file contains the native tier: the compilation of hot functions with MCJIT, the lowering of guest memory accesses in compiled code, and the calling convention between interpreted and compiled code
+
+NativeTier::NativeTier(const Environment& e): env(e), numModules(0), numCompiledFunctions(0) {}
+
+NativeTier::~NativeTier() {}
+
+// The types that can cross the tier boundary
+static bool isScalarType(const Type* type)
+{
+	if (auto intType = dyn_cast<IntegerType>(type))
+		return intType->getBitWidth() <= 64;
+	else
+		return type->isFloatTy() || type->isDoubleTy() || type->isPointerTy();
+}
+
+// Vectors of pointers have no representation in the interpreter
+static bool isPointerVectorType(const Type* type)
+{
+	return type->isVectorTy() && type->getScalarType()->isPointerTy();
+}
+
+// Calls of these intrinsics carry no side effect compiled code has to preserve, so they are dropped
+static bool isMarkerIntrinsic(unsigned id)
+{
+	switch (id)
+	{
+		case Intrinsic::dbg_declare:
+		case Intrinsic::dbg_value:
+		case Intrinsic::lifetime_start:
+		case Intrinsic::lifetime_end:
+		case Intrinsic::invariant_start:
+		case Intrinsic::invariant_end:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// The intrinsics compiled code may call. Memory transfers get their pointers translated, and the others must not access memory at all
+static bool isSupportedIntrinsic(const Function* f)
+{
+	switch (f->getIntrinsicID())
+	{
+		case Intrinsic::memcpy:
+		case Intrinsic::memmove:
+		case Intrinsic::memset:
+			return true;
+		default:
+			return isMarkerIntrinsic(f->getIntrinsicID()) || f->doesNotAccessMemory();
+	}
+}
+
+bool NativeTier::hasGuestAddresses(const Constant* c) const
+{
+	if (auto globalVal = dyn_cast<GlobalValue>(c))
+	{
+		auto fun = dyn_cast<Function>(globalVal);
+		return (fun != nullptr && fun->isIntrinsic()) || env.globalAddresses->count(globalVal) != 0;
+	}
+	else if (isa<BlockAddress>(c))
+		return false;
+
+	for (auto const& op: c->operands())
+		if (!hasGuestAddresses(cast<Constant>(op.get())))
+			return false;
+	return true;
+}
+
+bool NativeTier::isLocallyCompilable(const Function* f)
+{
+	auto itr = locallyCompilable.find(f);
+	if (itr != locallyCompilable.end())
+		return itr->second;
+
+	auto checkBody = [this, f] ()
+	{
+		if (f->isDeclaration() || f->isVarArg())
+			return false;
+		materializeFunction(f);
+		if (!f->getReturnType()->isVoidTy() && !isScalarType(f->getReturnType()))
+			return false;
+		for (auto const& arg: f->args())
+			if (!isScalarType(arg.getType()))
+				return false;
+
+		for (auto const& bb: *f)
+		{
+			for (auto const& inst: bb)
+			{
+				if (isPointerVectorType(inst.getType()))
+					return false;
+
+				switch (inst.getOpcode())
+				{
+					case Instruction::IndirectBr:
+					case Instruction::Invoke:
+					case Instruction::Resume:
+					case Instruction::LandingPad:
+					case Instruction::VAArg:
+						return false;
+					default:
+						break;
+				}
+
+				if (auto callInst = dyn_cast<CallInst>(&inst))
+				{
+					auto calledFunc = callInst->getCalledFunction();
+					if (isa<InlineAsm>(callInst->getCalledValue()))
+						return false;
+					else if (calledFunc != nullptr && calledFunc->isIntrinsic())
+					{
+						if (!isSupportedIntrinsic(calledFunc))
+							return false;
+					}
+					else
+					{
+						// The call may go back to the interpreter, so its operands have to cross the tier boundary
+						if (!callInst->getType()->isVoidTy() && !isScalarType(callInst->getType()))
+							return false;
+						for (auto i = 0u, e = callInst->getNumArgOperands(); i < e; ++i)
+							if (!isScalarType(callInst->getArgOperand(i)->getType()))
+								return false;
+					}
+				}
+
+				// Compiled code refers to globals and functions by their guest addresses
+				for (auto const& use: inst.operands())
+				{
+					auto op = use.get();
+					if (isPointerVectorType(op->getType()))
+						return false;
+					if (auto constant = dyn_cast<Constant>(op))
+						if (!hasGuestAddresses(constant))
+							return false;
+				}
+			}
+		}
+		return true;
+	};
+
+	auto ret = checkBody();
+	locallyCompilable.insert(std::make_pair(f, ret));
+	return ret;
+}
+
+// Convert an argument word into a value of the given type
+static Value* createFromWord(IRBuilder<>& builder, Value* word, Type* type)
+{
+	auto& context = type->getContext();
+	if (type->isIntegerTy(64))
+		return word;
+	else if (type->isIntegerTy())
+		return builder.CreateTrunc(word, type);
+	else if (type->isPointerTy())
+		return builder.CreateIntToPtr(word, type);
+	else if (type->isDoubleTy())
+		return builder.CreateBitCast(word, type);
+	else
+		return builder.CreateFPTrunc(builder.CreateBitCast(word, Type::getDoubleTy(context)), type);
+}
+
+// Convert a return value into a word
+static Value* createToWord(IRBuilder<>& builder, Value* val)
+{
+	auto type = val->getType();
+	auto& context = type->getContext();
+	auto wordType = Type::getInt64Ty(context);
+	if (type->isIntegerTy(64))
+		return val;
+	else if (type->isIntegerTy())
+		return builder.CreateZExt(val, wordType);
+	else if (type->isPointerTy())
+		return builder.CreatePtrToInt(val, wordType);
+	else if (type->isDoubleTy())
+		return builder.CreateBitCast(val, wordType);
+	else
+		return builder.CreateBitCast(builder.CreateFPExt(val, Type::getDoubleTy(context)), wordType);
+}
+
+// Create a function with the EntryPoint signature that unpacks the argument words, calls target and packs its return value
+static Function* createEntryPoint(Module* module, Function* target, const std::string& name)
+{
+	auto& context = module->getContext();
+	auto wordType = Type::getInt64Ty(context);
+	auto entryType = FunctionType::get(wordType, PointerType::getUnqual(wordType), false);
+	auto entry = Function::Create(entryType, GlobalValue::ExternalLinkage, name, module);
+	// Guest errors are reported by throwing through compiled code, see lowerFunction()
+	entry->addFnAttr(Attribute::UWTable);
+
+	IRBuilder<> builder(BasicBlock::Create(context, "entry", entry));
+	Value* argWords = &*entry->arg_begin();
+
+	auto args = std::vector<Value*>();
+	auto argIdx = 0u;
+	for (auto const& param: target->args())
+	{
+		auto word = builder.CreateLoad(builder.CreateConstGEP1_32(argWords, argIdx++));
+		args.push_back(createFromWord(builder, word, param.getType()));
+	}
+
+	auto callInst = builder.CreateCall(target, args);
+	callInst->setCallingConv(target->getCallingConv());
+	if (target->getReturnType()->isVoidTy())
+		builder.CreateRet(ConstantInt::get(wordType, 0));
+	else
+		builder.CreateRet(createToWord(builder, callInst));
+
+	return entry;
+}
+
+namespace
+{
+
+// Rewrites the clone of a guest function so that it works on the guest memory in place, and hands what it cannot do by itself to the interpreter (see NativeTier.h)
+class FunctionLowering
+{
+private:
+	const NativeTier::Environment& env;
+	const ValueToValueMapTy& valueMap;
+	// The clones of the functions that are compiled along with this one
+	const std::unordered_map<const Function*, Function*>& clones;
+	Function* newFun;
+	IntegerType* wordType;
+	// The context argument of the runtime functions
+	Constant* context;
+
+	Constant* getWord(uint64_t val) { return ConstantInt::get(wordType, val); }
+	// A constant pointer to a host object or function
+	Constant* getHostPointer(const void* ptr, Type* type)
+	{
+		return ConstantExpr::getIntToPtr(getWord(reinterpret_cast<uintptr_t>(ptr)), type);
+	}
+	// Call a runtime function of the environment. Its arguments and return value are words or host pointers
+	template <typename Ret, typename... Args>
+	Value* createRuntimeCall(IRBuilder<>& builder, Ret (*fn)(void*, Args...), Type* retType, ArrayRef<Value*> args)
+	{
+		auto paramTypes = std::vector<Type*>();
+		for (auto arg: args)
+			paramTypes.push_back(arg->getType());
+		auto fnType = FunctionType::get(retType, paramTypes, false);
+		return builder.CreateCall(getHostPointer(reinterpret_cast<const void*>(fn), PointerType::getUnqual(fnType)), args);
+	}
+
+	// The host pointer for guest pointer ptr, computed right before inst
+	Value* createHostPointer(Instruction* inst, Value* ptr);
+	// Translate operand i of inst, which is a guest pointer
+	void translatePointerOperand(Instruction* inst, unsigned i)
+	{
+		inst->setOperand(i, createHostPointer(inst, inst->getOperand(i)));
+	}
+	// The untagged address of guest pointer ptr, which is what ptrtoint yields in the interpreter
+	Value* createAddress(IRBuilder<>& builder, Value* ptr)
+	{
+		return builder.CreateAnd(builder.CreatePtrToInt(ptr, wordType), ~MemorySection::getTagMask());
+	}
+	// Replace the call inst, which calls origCall->getCalledValue(), by a call into the interpreter
+	void lowerToInterpreterCall(const CallInst* origCall, CallInst* inst);
+public:
+	FunctionLowering(const NativeTier::Environment& e, const ValueToValueMapTy& vmap, const std::unordered_map<const Function*, Function*>& c, Function* f): env(e), valueMap(vmap), clones(c), newFun(f), wordType(Type::getInt64Ty(f->getContext())), context(getHostPointer(e.context, Type::getInt8PtrTy(f->getContext()))) {}
+
+	// fun is the guest function newFun is cloned from
+	void lowerFunction(const Function* fun);
+};
+
+Value* FunctionLowering::createHostPointer(Instruction* inst, Value* ptr)
+{
+	auto heapTag = MemorySection::tagAddress(PointerAddressSpace::HEAP_SPACE, 0);
+	auto stackTag = MemorySection::tagAddress(PointerAddressSpace::STACK_SPACE, 0);
+	// The stack addresses of the running thread start at its id, which the base of its stack accounts for
+	auto stackBias = reinterpret_cast<uintptr_t>(env.stackBase) - (Address(env.threadId) << env.stackThreadShift);
+
+	IRBuilder<> builder(inst);
+	auto ptrWord = builder.CreatePtrToInt(ptr, wordType);
+	auto tag = builder.CreateAnd(ptrWord, MemorySection::getTagMask());
+	auto addr = builder.CreateAnd(ptrWord, ~MemorySection::getTagMask());
+	auto isHeap = builder.CreateICmpEQ(tag, getWord(heapTag));
+	auto isStack = builder.CreateICmpEQ(tag, getWord(stackTag));
+	auto base = builder.CreateSelect(isHeap, getWord(reinterpret_cast<uintptr_t>(env.heapBase)), builder.CreateSelect(isStack, getWord(stackBias), getWord(reinterpret_cast<uintptr_t>(env.globalBase))));
+	auto fastWord = builder.CreateAdd(base, addr);
+
+	// The stacks of other threads, and pointers with an undefined tag, are left to the interpreter
+	auto isOtherStack = builder.CreateAnd(isStack, builder.CreateICmpNE(builder.CreateLShr(addr, env.stackThreadShift), getWord(env.threadId)));
+	auto isSlow = builder.CreateOr(isOtherStack, builder.CreateICmpEQ(tag, getWord(MemorySection::getTagMask())));
+	auto fastBlock = inst->getParent();
+	auto slowTerm = SplitBlockAndInsertIfThen(isSlow, inst, false, MDBuilder(inst->getContext()).createBranchWeights(1, 1000));
+	IRBuilder<> slowBuilder(slowTerm);
+	Value* translateArgs[] = { context, ptrWord };
+	auto slowWord = slowBuilder.CreatePtrToInt(createRuntimeCall(slowBuilder, env.translatePointer, Type::getInt8PtrTy(inst->getContext()), translateArgs), wordType);
+
+	builder.SetInsertPoint(inst);
+	auto hostWord = builder.CreatePHI(wordType, 2);
+	hostWord->addIncoming(fastWord, fastBlock);
+	hostWord->addIncoming(slowWord, slowTerm->getParent());
+	return builder.CreateIntToPtr(hostWord, ptr->getType());
+}
+
+void FunctionLowering::lowerToInterpreterCall(const CallInst* origCall, CallInst* inst)
+{
+	// The argument words are passed in an array on the host stack
+	auto numArgs = inst->getNumArgOperands();
+	IRBuilder<> entryBuilder(&*newFun->getEntryBlock().getFirstInsertionPt());
+	auto argWords = entryBuilder.CreateAlloca(wordType, ConstantInt::get(Type::getInt32Ty(inst->getContext()), std::max(numArgs, 1u)));
+
+	IRBuilder<> builder(inst);
+	for (auto i = 0u; i < numArgs; ++i)
+		builder.CreateStore(createToWord(builder, inst->getArgOperand(i)), builder.CreateConstGEP1_32(argWords, i));
+
+	// A direct call tells the interpreter its callee by itself
+	Value* funWord = getWord(0);
+	if (origCall->getCalledFunction() == nullptr)
+		funWord = builder.CreatePtrToInt(inst->getCalledValue(), wordType);
+
+	Value* callArgs[] = { context, getHostPointer(origCall, Type::getInt8PtrTy(inst->getContext())), funWord, argWords };
+	auto retWord = createRuntimeCall(builder, env.callInterpreter, wordType, callArgs);
+	if (!inst->getType()->isVoidTy())
+		inst->replaceAllUsesWith(createFromWord(builder, retWord, inst->getType()));
+	inst->eraseFromParent();
+}
+
+void FunctionLowering::lowerFunction(const Function* fun)
+{
+	// The attributes of the guest code describe guest pointers, which compiled code does not dereference. Guest errors are reported by throwing through compiled code, so it needs unwind tables
+	newFun->setAttributes(AttributeSet());
+	newFun->addFnAttr(Attribute::UWTable);
+
+	// Pair every instruction with its clone before the rewriting begins
+	auto insts = std::vector<std::pair<const Instruction*, Instruction*>>();
+	auto hasAlloca = false;
+	for (auto const& bb: *fun)
+	{
+		for (auto const& inst: bb)
+		{
+			hasAlloca |= isa<AllocaInst>(&inst);
+			insts.push_back(std::make_pair(&inst, cast<Instruction>(valueMap.lookup(&inst))));
+		}
+	}
+
+	// allocas live in the guest stack, and are released when the function returns
+	auto dataLayout = DataLayout(newFun->getParent());
+	Value* stackMark = nullptr;
+	if (hasAlloca)
+	{
+		IRBuilder<> entryBuilder(&*newFun->getEntryBlock().getFirstInsertionPt());
+		Value* saveArgs[] = { context };
+		stackMark = createRuntimeCall(entryBuilder, env.saveStack, wordType, saveArgs);
+	}
+
+	for (auto const& instPair: insts)
+	{
+		auto origInst = instPair.first;
+		auto inst = instPair.second;
+		IRBuilder<> builder(inst);
+		switch (inst->getOpcode())
+		{
+			case Instruction::Load:
+			case Instruction::AtomicRMW:
+			case Instruction::AtomicCmpXchg:
+				translatePointerOperand(inst, 0);
+				break;
+			case Instruction::Store:
+				translatePointerOperand(inst, 1);
+				break;
+			case Instruction::Alloca:
+			{
+				auto allocaInst = cast<AllocaInst>(inst);
+				Value* size = getWord(dataLayout.getTypeAllocSize(allocaInst->getAllocatedType()));
+				if (allocaInst->isArrayAllocation())
+					size = builder.CreateMul(size, builder.CreateZExtOrTrunc(allocaInst->getArraySize(), wordType));
+				Value* allocArgs[] = { context, size };
+				auto ptrWord = createRuntimeCall(builder, env.allocateStack, wordType, allocArgs);
+				inst->replaceAllUsesWith(builder.CreateIntToPtr(ptrWord, inst->getType()));
+				inst->eraseFromParent();
+				break;
+			}
+			case Instruction::Ret:
+				if (stackMark != nullptr)
+				{
+					Value* restoreArgs[] = { context, stackMark };
+					createRuntimeCall(builder, env.restoreStack, Type::getVoidTy(inst->getContext()), restoreArgs);
+				}
+				break;
+			case Instruction::PtrToInt:
+			{
+				// The interpreter hands out untagged addresses. Integers of up to 62 bits lose the tag anyway
+				auto intType = cast<IntegerType>(inst->getType());
+				if (intType->getBitWidth() <= 62)
+					break;
+				builder.SetInsertPoint(inst->getNextNode());
+				auto masked = cast<Instruction>(builder.CreateAnd(inst, ConstantInt::get(intType, APInt(intType->getBitWidth(), ~MemorySection::getTagMask()))));
+				inst->replaceAllUsesWith(masked);
+				masked->setOperand(0, inst);
+				break;
+			}
+			case Instruction::IntToPtr:
+			{
+				// The address space comes from the pointer the integer is derived from, as in the interpreter. It is the global one otherwise, whose tag is 0
+				auto basePtr = findBasePointer(cast<IntToPtrInst>(origInst));
+				if (basePtr != nullptr && !isa<Constant>(basePtr))
+				{
+					auto baseTag = builder.CreateAnd(builder.CreatePtrToInt(valueMap.lookup(basePtr), wordType), MemorySection::getTagMask());
+					inst->setOperand(0, builder.CreateOr(builder.CreateZExtOrTrunc(inst->getOperand(0), wordType), baseTag));
+				}
+				break;
+			}
+			case Instruction::ICmp:
+				// Pointers compare by their untagged addresses
+				if (inst->getOperand(0)->getType()->isPointerTy())
+				{
+					inst->setOperand(0, createAddress(builder, inst->getOperand(0)));
+					inst->setOperand(1, createAddress(builder, inst->getOperand(1)));
+				}
+				break;
+			case Instruction::Call:
+			{
+				auto origCall = cast<CallInst>(origInst);
+				auto callInst = cast<CallInst>(inst);
+				auto callee = origCall->getCalledFunction();
+				if (callee != nullptr && callee->isIntrinsic())
+				{
+					if (isMarkerIntrinsic(callee->getIntrinsicID()))
+					{
+						if (!inst->use_empty())
+							inst->replaceAllUsesWith(UndefValue::get(inst->getType()));
+						inst->eraseFromParent();
+					}
+					else if (isa<MemIntrinsic>(inst))
+					{
+						translatePointerOperand(inst, 0);
+						if (isa<MemTransferInst>(inst))
+							translatePointerOperand(inst, 1);
+					}
+				}
+				else if (callee != nullptr && clones.count(callee) != 0)
+				{
+					callInst->setCalledFunction(clones.at(callee));
+					callInst->setAttributes(AttributeSet());
+				}
+				else
+					lowerToInterpreterCall(origCall, callInst);
+				break;
+			}
+			default:
+				break;
+		}
+	}
+}
+
+}
+
+bool NativeTier::isCompilable(const Function* f)
+{
+	// Guest pointers are passed around as 64-bit words
+	return DataLayout(f->getParent()).getPointerSize() == 8 && isLocallyCompilable(f);
+}
+
+NativeTier::EntryPoint NativeTier::compile(const Function* f, const FunctionSelector* selector)
+{
+	if (!isCompilable(f))
+		return nullptr;
+
+	// Collect f and the compilable functions it calls, transitively, unless the selection keeps them interpreted. The other callees are called through the interpreter
+	auto functions = std::vector<const Function*>{ f };
+	auto visited = std::unordered_set<const Function*>{ f };
+	for (auto i = 0u; i < functions.size(); ++i)
+	{
+		for (auto const& bb: *functions[i])
+		{
+			for (auto const& inst: bb)
+			{
+				auto callInst = dyn_cast<CallInst>(&inst);
+				if (callInst == nullptr)
+					continue;
+
+				auto callee = callInst->getCalledFunction();
+				if (callee != nullptr && !callee->isDeclaration() && visited.insert(callee).second && isLocallyCompilable(callee) && (selector == nullptr || selector->shouldRunNatively(callee->getName())))
+					functions.push_back(callee);
+			}
+		}
+	}
+
+	// Clone the functions into a module of their own. The symbols get a prefix that is unique to the module, since every module we compile lives in the same engine
+	auto& context = f->getContext();
+	auto srcModule = f->getParent();
+	auto prefix = "__native" + std::to_string(numModules++) + "_";
+	auto module = new Module(prefix + "module", context);
+	module->setDataLayout(srcModule->getDataLayoutStr());
+	module->setTargetTriple(srcModule->getTargetTriple());
+
+	// Globals and functions become their guest addresses. Intrinsics are declared in the new module
+	auto wordType = Type::getInt64Ty(context);
+	ValueToValueMapTy valueMap;
+	std::function<void(const Constant*)> mapGlobals = [&] (const Constant* c)
+	{
+		if (auto globalVal = dyn_cast<GlobalValue>(c))
+		{
+			auto fun = dyn_cast<Function>(globalVal);
+			if (valueMap.count(globalVal) != 0)
+				return;
+			else if (fun != nullptr && fun->isIntrinsic())
+				valueMap[fun] = module->getOrInsertFunction(fun->getName(), fun->getFunctionType(), fun->getAttributes());
+			else
+				valueMap[globalVal] = ConstantExpr::getIntToPtr(ConstantInt::get(wordType, env.globalAddresses->at(globalVal)), globalVal->getType());
+		}
+		else
+		{
+			for (auto const& op: c->operands())
+				mapGlobals(cast<Constant>(op.get()));
+		}
+	};
+	for (auto fun: functions)
+		for (auto const& bb: *fun)
+			for (auto const& inst: bb)
+				for (auto const& use: inst.operands())
+					if (auto constant = dyn_cast<Constant>(use.get()))
+						mapGlobals(constant);
+
+	auto clones = std::unordered_map<const Function*, Function*>();
+	for (auto fun: functions)
+		clones[fun] = Function::Create(fun->getFunctionType(), GlobalValue::InternalLinkage, prefix + fun->getName().str(), module);
+	for (auto fun: functions)
+	{
+		auto newFun = clones[fun];
+		auto newArgItr = newFun->arg_begin();
+		for (auto const& arg: fun->args())
+			valueMap[&arg] = &*newArgItr++;
+
+		SmallVector<ReturnInst*, 8> returns;
+		CloneFunctionInto(newFun, fun, valueMap, true, returns);
+	}
+	for (auto fun: functions)
+		FunctionLowering(env, valueMap, clones, clones[fun]).lowerFunction(fun);
+
+	auto entryName = prefix + "entry";
+	createEntryPoint(module, clones[f], entryName);
+
+	// The lowering leaves a lot to simplify, and the guest code may not have been optimized at all
+	PassManager passes;
+	passes.add(new DataLayoutPass(module));
+	PassManagerBuilder passBuilder;
+	passBuilder.OptLevel = 2;
+	passBuilder.Inliner = createFunctionInliningPass();
+	passBuilder.populateModulePassManager(passes);
+	passes.run(*module);
+
+	if (!engine)
+	{
+		std::string errStr;
+		engine.reset(EngineBuilder(module).setEngineKind(EngineKind::JIT).setUseMCJIT(true).setOptLevel(CodeGenOpt::Aggressive).setErrorStr(&errStr).create());
+		if (!engine)
+		{
+			errs() << "Failed to create the native tier: " << errStr << "\n";
+			delete module;
+			return nullptr;
+		}
+	}
+	else
+		engine->addModule(module);
+
+	engine->finalizeObject();
+	auto entry = reinterpret_cast<EntryPoint>(engine->getFunctionAddress(entryName));
+	if (entry != nullptr)
+		++numCompiledFunctions;
+	return entry;
+}
+
+uint64_t NativeTier::encodeValue(const DynamicValue& val)
+{
+	if (val.isIntValue())
+		return val.getAsIntValue().getZExtValue();
+	else if (val.isFloatValue())
+		return DoubleToBits(val.getAsFloatValue().getFloat());
+	else if (val.isPointerValue())
+		return MemorySection::tagAddress(val.getAsPointerValue().getAddressSpace(), val.getAsPointerValue().getAddress());
+	else
+	{
+		// An undef argument can be anything
+		assert(val.isUndefValue() && "Only scalars are passed to native code");
+		return 0;
+	}
+}
+
+DynamicValue NativeTier::decodeValue(uint64_t word, Type* type)
+{
+	if (auto intType = dyn_cast<IntegerType>(type))
+		return DynamicValue::getIntValue(intType->getBitWidth(), NativeIntOps<0>(intType->getBitWidth()).truncate(word));
+	else if (type->isPointerTy())
+	{
+		auto addrSpace = PointerAddressSpace::GLOBAL_SPACE;
+		auto addr = MemorySection::untagAddress(word, addrSpace);
+		return DynamicValue::getPointerValue(addrSpace, addr);
+	}
+	else
+		return DynamicValue::getFloatValue(BitsToDouble(word), type->isDoubleTy());
+}
+
+FunctionSelector::FunctionSelector(Mode m): mode(m) {}
+
+FunctionSelector::~FunctionSelector() {}
+
+bool FunctionSelector::addPattern(const std::string& pattern, std::string& err)
+{
+	auto regex = std::unique_ptr<Regex>(new Regex("^(" + pattern + ")$"));
+	if (!regex->isValid(err))
+		return false;
+
+	patterns.push_back(std::move(regex));
+	return true;
+}
+
+bool FunctionSelector::isSelected(StringRef name) const
+{
+	for (auto const& regex: patterns)
+		if (regex->match(name))
+			return true;
+	return false;
+}
@@ -0,0 +1,304 @@
+#include "Interpreter.h"
+#include "PreparedFunction.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Process.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <link.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace llvm;
+using namespace llvm_interpreter;
+
+// This file saves and restores the state set up by evaluateGlobals(), so that a module whose globals are expensive to initialize pays that cost only once
+// The snapshot file is laid out as follows: the header, then the address of every global in module order, then the block address entries, and finally the global memory image, which starts at a multiple of SnapshotImageAlignment so that it can be mapped as the global section. Everything is stored in host byte order, which is fine since the file is a cache local to the machine
+
+namespace
+{
+
+const char SnapshotMagic[8] = { 'L', 'L', 'V', 'M', 'I', 'S', 'N', 'P' };
+// Bump this whenever the layout of the file or of the global memory changes
+const uint32_t SnapshotVersion = 2;
+// A multiple of the page size of every host we run on
+const uint64_t SnapshotImageAlignment = 0x10000;
+
+struct SnapshotHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t pointerSize;
+	// The key of the snapshot in hex, see Interpreter::getSnapshotKey()
+	char key[32];
+	uint64_t memorySize;
+	uint64_t imageOffset;
+	uint64_t functionTableBase;
+	uint64_t functionAddressStride;
+	uint64_t numGlobals;
+	uint64_t numFunctions;
+	uint64_t numBlockAddresses;
+};
+
+// A block address is identified by the indices of its function and of the block within the function
+struct BlockAddressEntry
+{
+	uint32_t funcIdx;
+	uint32_t blockIdx;
+	uint64_t addr;
+};
+
+// Look for the GNU build ID note among the segments of the main program, which is the first object dl_iterate_phdr() reports
+int findBuildId(struct dl_phdr_info* info, size_t, void* data)
+{
+	auto& buildId = *static_cast<std::string*>(data);
+	for (auto i = 0u; i < info->dlpi_phnum; ++i)
+	{
+		auto& phdr = info->dlpi_phdr[i];
+		if (phdr.p_type != PT_NOTE)
+			continue;
+
+		auto note = reinterpret_cast<const uint8_t*>(info->dlpi_addr + phdr.p_vaddr);
+		auto end = note + phdr.p_memsz;
+		while (note + sizeof(ElfW(Nhdr)) <= end)
+		{
+			auto nhdr = reinterpret_cast<const ElfW(Nhdr)*>(note);
+			auto name = note + sizeof(ElfW(Nhdr));
+			auto desc = name + ((nhdr->n_namesz + 3) & ~3u);
+			if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 && std::memcmp(name, "GNU", 4) == 0)
+			{
+				buildId.assign(reinterpret_cast<const char*>(desc), nhdr->n_descsz);
+				return 1;
+			}
+			note = desc + ((nhdr->n_descsz + 3) & ~3u);
+		}
+	}
+	return 1;
+}
+
+// The build ID the linker stored in the interpreter binary, which is a hash of its code. Without one, the time this file was compiled stands in for it
+const std::string& getBuildId()
+{
+	static const std::string buildId = [] ()
+	{
+		auto id = std::string();
+		dl_iterate_phdr(findBuildId, &id);
+		if (id.empty())
+			id = __DATE__ " " __TIME__;
+		return id;
+	}();
+	return buildId;
+}
+
+// Read exactly size bytes at offset of fd
+bool readFully(int fd, void* buf, size_t size, uint64_t offset)
+{
+	auto dst = static_cast<char*>(buf);
+	while (size > 0)
+	{
+		auto res = pread(fd, dst, size, offset);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return false;
+		dst += res;
+		size -= res;
+		offset += res;
+	}
+	return true;
+}
+
+// Closes a file descriptor that nobody took over
+struct FileCloser
+{
+	int fd;
+	~FileCloser()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+};
+
+}
+
+std::string Interpreter::getSnapshotKey(StringRef moduleHash, bool lazyLoad) const
+{
+	MD5 hash;
+	hash.update(moduleHash);
+	hash.update(getBuildId());
+	hash.update(std::to_string(dataLayout.getPointerSize()));
+	hash.update(lazyLoad ? "lazy" : "eager");
+	MD5::MD5Result result;
+	hash.final(result);
+	SmallString<32> hexResult;
+	MD5::stringifyResult(result, hexResult);
+	return hexResult.str().str();
+}
+
+bool Interpreter::saveGlobalsSnapshot(const std::string& path, StringRef key) const
+{
+	if (key.size() != sizeof(SnapshotHeader::key))
+		return false;
+	// Snapshots are taken before the guest program runs, so no other thread is giving out block addresses
+	auto const& blockAddresses = process->blockAddresses;
+
+	SnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SnapshotMagic, sizeof(header.magic));
+	header.version = SnapshotVersion;
+	header.pointerSize = dataLayout.getPointerSize();
+	std::memcpy(header.key, key.data(), key.size());
+	header.memorySize = globalMem.getUsedSize();
+	header.functionTableBase = functionTableBase;
+	header.functionAddressStride = functionAddressStride;
+	header.numGlobals = module->getGlobalList().size();
+	header.numFunctions = functionTable.size();
+	header.numBlockAddresses = blockAddresses.size();
+
+	auto globalAddrs = std::vector<uint64_t>();
+	globalAddrs.reserve(header.numGlobals);
+	for (auto const& globalVal: module->globals())
+		globalAddrs.push_back(globalEnv.at(&globalVal));
+
+	auto blockEntries = std::vector<BlockAddressEntry>();
+	blockEntries.reserve(header.numBlockAddresses);
+	for (auto funcIdx = 0u; funcIdx < functionTable.size() && blockEntries.size() < blockAddresses.size(); ++funcIdx)
+	{
+		auto blockIdx = 0u;
+		for (auto const& bb: *functionTable[funcIdx])
+		{
+			auto itr = blockAddresses.find(&bb);
+			if (itr != blockAddresses.end())
+				blockEntries.push_back(BlockAddressEntry{ funcIdx, blockIdx, itr->second });
+			++blockIdx;
+		}
+	}
+	assert(blockEntries.size() == blockAddresses.size() && "Block address outside of the module");
+
+	auto tablesSize = sizeof(header) + globalAddrs.size() * sizeof(uint64_t) + blockEntries.size() * sizeof(BlockAddressEntry);
+	header.imageOffset = (tablesSize + SnapshotImageAlignment - 1) / SnapshotImageAlignment * SnapshotImageAlignment;
+
+	// Write to a temporary file first and rename it, so that a concurrent run never maps a partially written snapshot
+	auto tmpPath = path + ".tmp" + std::to_string(sys::Process::GetRandomNumber());
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!file)
+			return false;
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(globalAddrs.data()), globalAddrs.size() * sizeof(uint64_t));
+		file.write(reinterpret_cast<const char*>(blockEntries.data()), blockEntries.size() * sizeof(BlockAddressEntry));
+		auto padding = std::vector<char>(header.imageOffset - tablesSize, 0);
+		file.write(padding.data(), padding.size());
+		file.write(static_cast<const char*>(globalMem.getRawPointerAtAddress(0)), header.memorySize);
+		if (!file)
+		{
+			file.close();
+			std::remove(tmpPath.c_str());
+			return false;
+		}
+	}
+
+	if (std::rename(tmpPath.c_str(), path.c_str()) != 0)
+	{
+		std::remove(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool Interpreter::loadGlobalsSnapshot(const std::string& path, StringRef key)
+{
+	assert(globalEnv.empty() && "The globals have already been set up");
+
+	// Only the header and the tables are read. The memory image is mapped copy-on-write as the global section, so loading does not depend on its size, and the pages the program does not write stay shared with the page cache
+	FileCloser file{ open(path.c_str(), O_RDONLY) };
+	if (file.fd < 0)
+		return false;
+	struct stat fileStat;
+	if (fstat(file.fd, &fileStat) != 0)
+		return false;
+	auto fileSize = static_cast<uint64_t>(fileStat.st_size);
+
+	SnapshotHeader header;
+	if (fileSize < sizeof(header) || !readFully(file.fd, &header, sizeof(header), 0))
+		return false;
+
+	if (std::memcmp(header.magic, SnapshotMagic, sizeof(header.magic)) != 0 || header.version != SnapshotVersion)
+		return false;
+	if (key != StringRef(header.key, sizeof(header.key)))
+		return false;
+	if (header.pointerSize != dataLayout.getPointerSize() || header.numGlobals != module->getGlobalList().size() || header.numFunctions != module->size())
+		return false;
+	auto tablesSize = sizeof(header) + header.numGlobals * sizeof(uint64_t) + header.numBlockAddresses * sizeof(BlockAddressEntry);
+	if (header.memorySize == 0 || header.imageOffset % SnapshotImageAlignment != 0 || header.imageOffset < tablesSize || fileSize != header.imageOffset + header.memorySize)
+		return false;
+
+	auto globalAddrs = std::vector<uint64_t>(header.numGlobals);
+	auto blockEntries = std::vector<BlockAddressEntry>(header.numBlockAddresses);
+	if (!readFully(file.fd, globalAddrs.data(), globalAddrs.size() * sizeof(uint64_t), sizeof(header)))
+		return false;
+	if (!readFully(file.fd, blockEntries.data(), blockEntries.size() * sizeof(BlockAddressEntry), sizeof(header) + globalAddrs.size() * sizeof(uint64_t)))
+		return false;
+
+	// Resolve the block addresses before touching the interpreter, so that a stale entry leaves it untouched
+	auto blocks = std::vector<const BasicBlock*>();
+	blocks.reserve(header.numBlockAddresses);
+	{
+		auto functions = std::vector<const Function*>();
+		for (auto const& f: *module)
+			functions.push_back(&f);
+		for (auto const& entry: blockEntries)
+		{
+			if (entry.funcIdx >= functions.size())
+				return false;
+			auto f = functions[entry.funcIdx];
+			materializeFunction(f);
+			if (entry.blockIdx >= f->size())
+				return false;
+			auto bbItr = f->begin();
+			std::advance(bbItr, entry.blockIdx);
+			blocks.push_back(&*bbItr);
+		}
+	}
+
+	// The image goes first, since it is the one step that may still fail. The section keeps the mapping once the file is closed
+	{
+		MemoryImage image(file.fd, header.imageOffset, header.memorySize);
+		file.fd = -1;
+		try
+		{
+			globalMem.mapImage(image);
+		}
+		catch (const std::runtime_error&)
+		{
+			return false;
+		}
+	}
+
+	auto globalIdx = 0u;
+	for (auto const& globalVal: module->globals())
+		globalEnv.insert(std::make_pair(&globalVal, globalAddrs[globalIdx++]));
+
+	functionAddressStride = header.functionAddressStride;
+	functionTableBase = header.functionTableBase;
+	for (auto const& f: *module)
+	{
+		auto funAddr = functionTableBase + functionTable.size() * functionAddressStride;
+		globalEnv.insert(std::make_pair(&f, funAddr));
+		functionTable.push_back(&f);
+	}
+
+	for (auto i = 0u; i < header.numBlockAddresses; ++i)
+	{
+		process->blockAddresses.insert(std::make_pair(blocks[i], blockEntries[i].addr));
+		process->blockPtrMap.insert(std::make_pair(blockEntries[i].addr, blocks[i]));
+	}
+	return true;
+}
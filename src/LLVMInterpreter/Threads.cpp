@@ -0,0 +1,172 @@
+#include "Interpreter.h"
+
+#include "llvm/IR/Function.h"
+
+#include <exception>
+#include <stdexcept>
+#include <thread>
+
+using namespace llvm;
+using namespace llvm_interpreter;
+
+// This file contains the threads of the guest program. Every guest thread runs on a host thread, with an interpreter of its own: the interpreters of a program share the translated code and the GuestProcess, and each of them has its own stack frames and stack section
+
+namespace llvm_interpreter
+{
+
+struct GuestThread
+{
+	// Released once the thread is joined
+	std::unique_ptr<Interpreter> interpreter;
+	std::thread hostThread;
+	// The value the start routine returned, or the exception it failed with
+	DynamicValue retVal;
+	std::exception_ptr error;
+	bool joined;
+
+	GuestThread(): retVal(DynamicValue::getUndefValue()), joined(false) {}
+};
+
+}
+
+GuestProcess::GuestProcess(size_t globalReservedSize, const MemoryLimits& limits): globalMem(globalReservedSize), heapMem(limits.heapBytes), heapAllocator(heapMem), stackReservedSize(limits.stackBytes) {}
+
+GuestProcess::~GuestProcess() {}
+
+MemorySection& GuestProcess::createStack(unsigned tid, unsigned pointerSize)
+{
+	assert(tid == stacks.size() && "Threads are created in the order of their ids");
+	MemorySection* stack = nullptr;
+	if (!freeStacks.empty())
+	{
+		stack = freeStacks.back();
+		freeStacks.pop_back();
+	}
+	else
+	{
+		stackPool.emplace_back(stackReservedSize);
+		stack = &stackPool.back();
+		stack->setPointerSize(pointerSize);
+	}
+	stacks.push_back(stack);
+	return *stack;
+}
+
+void GuestProcess::releaseStack(unsigned tid)
+{
+	// Pointers into the stack of the exited thread stop working, and the pages of the stack go back to the host until a new thread takes it
+	auto stack = stacks[tid];
+	stacks[tid] = nullptr;
+	stack->reset();
+	freeStacks.push_back(stack);
+}
+
+Interpreter::Interpreter(const Interpreter& parent, unsigned tid): module(parent.module), dataLayout(module), typeLayouts(dataLayout), process(parent.process), threadId(tid), globalEnv(parent.globalEnv), globalMem(process->globalMem), functionTable(parent.functionTable), functionTableBase(parent.functionTableBase), functionAddressStride(parent.functionAddressStride), preparedModule(parent.preparedModule), tierUpThreshold(0), tieringEnabled(false), stackMem(process->createStack(tid, dataLayout.getPointerSize())), heapMem(process->heapMem), numExecutedInstructions(0)
+{
+	numFusedExecutions.fill(0);
+	externals.setOutputStream(parent.externals.getOutputStream());
+}
+
+MemorySection& Interpreter::getThreadStackMem(unsigned tid)
+{
+	// The stack stays in the process after we let go of the lock, so the access is safe even if the thread is joined meanwhile
+	std::lock_guard<std::mutex> lock(process->threadLock);
+	if (tid >= process->stacks.size() || process->stacks[tid] == nullptr)
+		throw std::out_of_range("Accessing the stack of a thread that has exited");
+	return *process->stacks[tid];
+}
+
+DynamicValue Interpreter::createThread(const PointerValue& threadIdPtr, const PointerValue& startRoutine, DynamicValue&& arg)
+{
+	auto f = getFunctionAtAddress(startRoutine.getAddress());
+	if (f->isDeclaration())
+		throw std::runtime_error("Starting a thread in an external function");
+
+	auto args = std::vector<DynamicValue>();
+	args.push_back(std::move(arg));
+	auto tid = 0u;
+	{
+		// The host thread is started before we let go of the lock, so that whoever finds the thread in process->threads can join it
+		std::lock_guard<std::mutex> lock(process->threadLock);
+		process->threads.push_back(std::make_unique<GuestThread>());
+		auto thread = process->threads.back().get();
+		tid = process->threads.size();
+		try
+		{
+			thread->interpreter.reset(new Interpreter(*this, tid));
+			thread->hostThread = std::thread(
+				[thread, f] (std::vector<DynamicValue> args)
+				{
+					try
+					{
+						thread->retVal = thread->interpreter->callFunction(f, std::move(args));
+					}
+					catch (...)
+					{
+						thread->error = std::current_exception();
+					}
+				},
+				std::move(args)
+			);
+		}
+		catch (...)
+		{
+			// The thread never existed, so its id and stack are free again
+			if (thread->interpreter)
+			{
+				thread->interpreter.reset();
+				process->releaseStack(tid);
+				process->stacks.pop_back();
+			}
+			process->threads.pop_back();
+			throw;
+		}
+	}
+
+	// pthread_t is an integer as wide as a pointer
+	writeToPointer(threadIdPtr, DynamicValue::getIntValue(dataLayout.getPointerSizeInBits(), tid));
+	return DynamicValue::getIntValue(32, 0);
+}
+
+DynamicValue Interpreter::joinThread(unsigned tid, const PointerValue& retValPtr)
+{
+	GuestThread* thread = nullptr;
+	{
+		std::lock_guard<std::mutex> lock(process->threadLock);
+		if (tid == 0 || tid > process->threads.size() || process->threads[tid - 1]->joined)
+			throw std::out_of_range("Joining a thread that does not exist or has already been joined");
+		thread = process->threads[tid - 1].get();
+		thread->joined = true;
+	}
+
+	thread->hostThread.join();
+	numExecutedInstructions += thread->interpreter->getNumExecutedInstructions();
+	{
+		std::lock_guard<std::mutex> lock(process->threadLock);
+		thread->interpreter.reset();
+		process->releaseStack(tid);
+	}
+	if (thread->error)
+		std::rethrow_exception(thread->error);
+
+	if (retValPtr.getAddress() != 0)
+		writeToPointer(retValPtr, thread->retVal.isUndefValue() ? DynamicValue::getPointerValue(PointerAddressSpace::GLOBAL_SPACE, 0) : thread->retVal);
+	return DynamicValue::getIntValue(32, 0);
+}
+
+unsigned Interpreter::findUnjoinedThread()
+{
+	std::lock_guard<std::mutex> lock(process->threadLock);
+	for (auto i = 0u; i < process->threads.size(); ++i)
+		if (!process->threads[i]->joined)
+			return i + 1;
+	return 0;
+}
+
+void Interpreter::joinAllThreads()
+{
+	// Threads may spawn other threads while we wait, so look for unjoined threads until there are none
+	auto nullPtr = DynamicValue::getPointerValue(PointerAddressSpace::GLOBAL_SPACE, 0);
+	for (auto tid = findUnjoinedThread(); tid != 0; tid = findUnjoinedThread())
+		joinThread(tid, nullPtr.getAsPointerValue());
+}
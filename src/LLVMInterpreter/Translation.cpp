@@ -0,0 +1,1028 @@
+#include "PreparedFunction.h"
+
+#include "llvm/IR/CallSite.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DataLayout.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PatternMatch.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+
+using namespace llvm;
+using namespace llvm_interpreter;
+
+// This file contains the translation from llvm::Function to the pre-decoded instruction format executed by the interpreter
+
+namespace llvm_interpreter
+{
+
+class FunctionTranslator
+{
+private:
+	PreparedFunction& fn;
+	const DataLayout& dataLayout;
+	TranslationContext& context;
+
+	std::unordered_map<const BasicBlock*, unsigned> blockIndices;
+	std::unordered_map<const Value*, unsigned> slotNumbers;
+	std::map<std::pair<const BasicBlock*, const BasicBlock*>, unsigned> edgeIndices;
+	// The slot used to break cycles of phi copies, allocated on demand. 0 means it is not allocated yet: the scratch slot comes after the phi slots, so it is never slot 0
+	unsigned scratchSlot;
+
+	void numberSlots();
+	unsigned getScratchSlot();
+
+	unsigned getBlockIndex(const BasicBlock* bb) const
+	{
+		return blockIndices.at(bb);
+	}
+	unsigned getEdgeIndex(const BasicBlock* from, const BasicBlock* to);
+	void sequentializeCopies(std::vector<PhiCopy>& copies);
+
+	PreparedInstruction createInstruction(Opcode op, const Instruction* inst);
+	Operand translateOperand(const Value* v);
+	void addOperand(PreparedInstruction& pInst, const Value* v);
+
+	PreparedInstruction translateSimpleInstruction(Opcode op, const Instruction* inst);
+	PreparedInstruction translateAtomicAccess(Opcode op, const Instruction* inst, Type* valType);
+	PreparedInstruction translateBitCast(const Instruction* inst);
+	PreparedInstruction translateIntToPtr(const Instruction* inst);
+	void addGEPIndices(PreparedInstruction& pInst, const GetElementPtrInst* gepInst);
+	PreparedInstruction translateGEP(const GetElementPtrInst* gepInst);
+	PreparedInstruction translateCall(const Instruction* inst);
+	PreparedInstruction translateVectorOperation(const Instruction* inst);
+	PreparedInstruction translateShuffleVector(const ShuffleVectorInst* shuffleInst);
+	PreparedInstruction translateNativeSwitch(const SwitchInst* switchInst);
+	PreparedInstruction translateIndirectBr(const IndirectBrInst* ibrInst);
+	PreparedInstruction translateTerminator(const Instruction* inst);
+	PreparedInstruction translateInstruction(const Instruction* inst);
+	bool translateFusedPair(const Instruction* first, const Instruction* second, PreparedInstruction& pInst);
+public:
+	FunctionTranslator(PreparedFunction& f, const DataLayout& d, TranslationContext& c): fn(f), dataLayout(d), context(c), scratchSlot(0) {}
+
+	void translate();
+};
+
+}
+
+const Value* llvm_interpreter::findBasePointer(const IntToPtrInst* itp)
+{
+	Value* srcValue = nullptr;
+	auto op = itp->getOperand(0);
+	if (PatternMatch::match(op, PatternMatch::m_PtrToInt(PatternMatch::m_Value(srcValue))))
+	{
+		return srcValue->stripPointerCasts();
+	}
+	else if (PatternMatch::match(op,
+			PatternMatch::m_Add(
+				PatternMatch::m_PtrToInt(
+				PatternMatch::m_Value(srcValue)),
+			PatternMatch::m_Value())))
+	{
+		return srcValue->stripPointerCasts();
+	}
+
+	return nullptr;
+}
+
+// Whether inst is a load or a store with an atomic ordering
+static bool isAtomicAccess(const Instruction* inst)
+{
+	if (auto loadInst = dyn_cast<LoadInst>(inst))
+		return loadInst->isAtomic();
+	else if (auto storeInst = dyn_cast<StoreInst>(inst))
+		return storeInst->isAtomic();
+	else
+		return false;
+}
+
+// The typed load or store of values of type ty (see Opcodes.def), or the generic LOAD or STORE if there is none for ty
+static Opcode getTypedAccessOpcode(Type* ty, bool isStore)
+{
+	if (auto intType = dyn_cast<IntegerType>(ty))
+	{
+		switch (intType->getBitWidth())
+		{
+			case 8:
+				return isStore ? Opcode::STORE_I8 : Opcode::LOAD_I8;
+			case 16:
+				return isStore ? Opcode::STORE_I16 : Opcode::LOAD_I16;
+			case 32:
+				return isStore ? Opcode::STORE_I32 : Opcode::LOAD_I32;
+			case 64:
+				return isStore ? Opcode::STORE_I64 : Opcode::LOAD_I64;
+		}
+	}
+	else if (ty->isFloatTy())
+		return isStore ? Opcode::STORE_F32 : Opcode::LOAD_F32;
+	else if (ty->isDoubleTy())
+		return isStore ? Opcode::STORE_F64 : Opcode::LOAD_F64;
+	else if (ty->isPointerTy())
+		return isStore ? Opcode::STORE_PTR : Opcode::LOAD_PTR;
+
+	return isStore ? Opcode::STORE : Opcode::LOAD;
+}
+
+// Whether inst computes its result lane by lane from vector operands
+static bool isVectorOperation(const Instruction* inst)
+{
+	if (isa<BinaryOperator>(inst) || isa<CastInst>(inst) || isa<CmpInst>(inst))
+		return inst->getType()->isVectorTy() || inst->getOperand(0)->getType()->isVectorTy();
+	else if (auto selectInst = dyn_cast<SelectInst>(inst))
+		return selectInst->getCondition()->getType()->isVectorTy();
+	else
+		return false;
+}
+
+// The scalar opcode that an element-wise vector operation applies to every lane
+static Opcode getElementOpcode(const Instruction* inst)
+{
+	switch (inst->getOpcode())
+	{
+		case Instruction::Add:
+			return Opcode::ADD;
+		case Instruction::Sub:
+			return Opcode::SUB;
+		case Instruction::Mul:
+			return Opcode::MUL;
+		case Instruction::UDiv:
+			return Opcode::UDIV;
+		case Instruction::SDiv:
+			return Opcode::SDIV;
+		case Instruction::URem:
+			return Opcode::UREM;
+		case Instruction::SRem:
+			return Opcode::SREM;
+		case Instruction::And:
+			return Opcode::AND;
+		case Instruction::Or:
+			return Opcode::OR;
+		case Instruction::Xor:
+			return Opcode::XOR;
+		case Instruction::Shl:
+			return Opcode::SHL;
+		case Instruction::LShr:
+			return Opcode::LSHR;
+		case Instruction::AShr:
+			return Opcode::ASHR;
+		case Instruction::FAdd:
+			return Opcode::FADD;
+		case Instruction::FSub:
+			return Opcode::FSUB;
+		case Instruction::FMul:
+			return Opcode::FMUL;
+		case Instruction::FDiv:
+			return Opcode::FDIV;
+		case Instruction::FRem:
+			return Opcode::FREM;
+		case Instruction::ICmp:
+			return Opcode::ICMP;
+		case Instruction::FCmp:
+			return Opcode::FCMP;
+		case Instruction::Trunc:
+			return Opcode::TRUNC;
+		case Instruction::ZExt:
+			return Opcode::ZEXT;
+		case Instruction::SExt:
+			return Opcode::SEXT;
+		case Instruction::FPTrunc:
+			return Opcode::FPTRUNC;
+		case Instruction::FPExt:
+			return Opcode::FPEXT;
+		case Instruction::FPToUI:
+		case Instruction::FPToSI:
+			return Opcode::FPTOI;
+		case Instruction::UIToFP:
+			return Opcode::UITOFP;
+		case Instruction::SIToFP:
+			return Opcode::SITOFP;
+		default:
+			llvm_unreachable("Unsupported vector operation");
+	}
+}
+
+void FunctionTranslator::numberSlots()
+{
+	auto f = fn.getFunction();
+
+	auto addSlot = [this] (const Value* v)
+	{
+		slotNumbers.insert(std::make_pair(v, fn.slotValues.size()));
+		fn.slotValues.push_back(v);
+	};
+
+	for (auto const& arg: f->args())
+		addSlot(&arg);
+
+	for (auto const& bb: *f)
+		for (auto const& inst: bb)
+			if (!inst.getType()->isVoidTy())
+				addSlot(&inst);
+}
+
+unsigned FunctionTranslator::getScratchSlot()
+{
+	if (scratchSlot == 0)
+	{
+		scratchSlot = fn.slotValues.size();
+		fn.slotValues.push_back(nullptr);
+	}
+	return scratchSlot;
+}
+
+unsigned FunctionTranslator::getEdgeIndex(const BasicBlock* from, const BasicBlock* to)
+{
+	auto itr = edgeIndices.find(std::make_pair(from, to));
+	if (itr != edgeIndices.end())
+		return itr->second;
+
+	auto copies = std::vector<PhiCopy>();
+	for (auto const& inst: *to)
+	{
+		auto phiNode = dyn_cast<PHINode>(&inst);
+		if (phiNode == nullptr)
+			break;
+
+		auto idx = phiNode->getBasicBlockIndex(from);
+		assert(idx != -1 && "PHINode doesn't contain entry for predecessor??");
+		copies.push_back(PhiCopy{slotNumbers.at(phiNode), translateOperand(phiNode->getIncomingValue(idx))});
+	}
+	sequentializeCopies(copies);
+
+	// The entry of the target block is filled in once all blocks are translated
+	auto edgeIdx = fn.edges.size();
+	fn.edges.push_back(PreparedEdge{getBlockIndex(to), 0, static_cast<unsigned>(fn.phiCopies.size()), static_cast<unsigned>(copies.size())});
+	fn.phiCopies.insert(fn.phiCopies.end(), copies.begin(), copies.end());
+	edgeIndices.insert(std::make_pair(std::make_pair(from, to), edgeIdx));
+	return edgeIdx;
+}
+
+// The phis of a block are assigned simultaneously, while the copies of an edge are performed one at a time. Order the copies so that no copy overwrites a slot that a later copy still reads, and break the cycles (e.g. two phis swapping their values) with the scratch slot
+void FunctionTranslator::sequentializeCopies(std::vector<PhiCopy>& copies)
+{
+	auto pending = std::vector<PhiCopy>();
+	for (auto const& copy: copies)
+		if (copy.src.kind != OperandKind::REGISTER || copy.src.index != copy.dest)
+			pending.push_back(copy);
+	copies.clear();
+
+	auto isReadByPending = [&pending] (unsigned slot)
+	{
+		return std::any_of(pending.begin(), pending.end(),
+			[slot] (const PhiCopy& copy)
+			{
+				return copy.src.kind == OperandKind::REGISTER && copy.src.index == slot;
+			}
+		);
+	};
+
+	while (!pending.empty())
+	{
+		auto itr = std::find_if(pending.begin(), pending.end(),
+			[&isReadByPending] (const PhiCopy& copy)
+			{
+				return !isReadByPending(copy.dest);
+			}
+		);
+		if (itr != pending.end())
+		{
+			copies.push_back(*itr);
+			pending.erase(itr);
+			continue;
+		}
+
+		// Every pending copy is part of a cycle. Save one of the destinations in the scratch slot and let its readers read the scratch slot instead, which turns the cycle into a chain
+		auto scratch = getScratchSlot();
+		auto savedSlot = pending.front().dest;
+		copies.push_back(PhiCopy{scratch, Operand{OperandKind::REGISTER, savedSlot}});
+		for (auto& copy: pending)
+			if (copy.src.kind == OperandKind::REGISTER && copy.src.index == savedSlot)
+				copy.src.index = scratch;
+	}
+}
+
+PreparedInstruction FunctionTranslator::createInstruction(Opcode op, const Instruction* inst)
+{
+	// Value-initialization zeroes all the fields we do not care about
+	auto pInst = PreparedInstruction();
+	pInst.opcode = op;
+	pInst.inst = inst;
+	pInst.firstOperand = fn.operands.size();
+
+	auto type = inst->getType();
+	if (!type->isVoidTy())
+		pInst.dest = slotNumbers.at(inst);
+
+	if (auto intType = dyn_cast<IntegerType>(type))
+		pInst.bitWidth = intType->getBitWidth();
+	else if (type->isFloatTy() || type->isDoubleTy())
+		pInst.bitWidth = type->getPrimitiveSizeInBits();
+	else if (type->isPointerTy())
+		pInst.bitWidth = dataLayout.getPointerSizeInBits();
+
+	return pInst;
+}
+
+Operand FunctionTranslator::translateOperand(const Value* v)
+{
+	if (auto cv = dyn_cast<Constant>(v))
+		return Operand{OperandKind::CONSTANT, context.constantPool.getIndex(cv)};
+	else
+		return Operand{OperandKind::REGISTER, slotNumbers.at(v)};
+}
+
+void FunctionTranslator::addOperand(PreparedInstruction& pInst, const Value* v)
+{
+	assert(pInst.firstOperand + pInst.numOperands == fn.operands.size() && "Operands of an instruction must be contiguous");
+
+	fn.operands.push_back(translateOperand(v));
+	++pInst.numOperands;
+}
+
+PreparedInstruction FunctionTranslator::translateSimpleInstruction(Opcode op, const Instruction* inst)
+{
+	auto pInst = createInstruction(op, inst);
+	for (auto const& use: inst->operands())
+		addOperand(pInst, use.get());
+	return pInst;
+}
+
+PreparedInstruction FunctionTranslator::translateAtomicAccess(Opcode op, const Instruction* inst, Type* valType)
+{
+	// The value is loaded or stored whole by a host atomic, as the bits it has in memory
+	auto isScalar = (valType->isIntegerTy() && valType->getIntegerBitWidth() <= 64) || valType->isFloatTy() || valType->isDoubleTy() || valType->isPointerTy();
+	if (!isScalar)
+		llvm_unreachable("Atomic loads and stores are only supported on integers of at most 64 bits, floats, doubles and pointers");
+	auto pInst = translateSimpleInstruction(op, inst);
+	pInst.type = valType;
+	pInst.typeSize = dataLayout.getTypeStoreSize(valType);
+	return pInst;
+}
+
+PreparedInstruction FunctionTranslator::translateBitCast(const Instruction* inst)
+{
+	auto srcType = inst->getOperand(0)->getType();
+	auto dstType = inst->getType();
+	auto isFPType = [] (const Type* type)
+	{
+		return type->isFloatTy() || type->isDoubleTy();
+	};
+
+	if (dstType->isPointerTy())
+	{
+		if (!srcType->isPointerTy())
+			llvm_unreachable("Invalid Bitcast");
+		return translateSimpleInstruction(Opcode::BITCAST, inst);
+	}
+	else if (dstType->isIntegerTy())
+	{
+		if (isFPType(srcType))
+			return translateSimpleInstruction(Opcode::BITCAST_FP_TO_INT, inst);
+		else if (srcType->isIntegerTy())
+			return translateSimpleInstruction(Opcode::BITCAST, inst);
+		else
+			llvm_unreachable("Invalid BitCast");
+	}
+	else if (isFPType(dstType))
+	{
+		if (srcType->isIntegerTy())
+			return translateSimpleInstruction(Opcode::BITCAST_INT_TO_FP, inst);
+		else
+			return translateSimpleInstruction(Opcode::BITCAST_FP, inst);
+	}
+	else
+		llvm_unreachable("Invalid Bitcast");
+}
+
+PreparedInstruction FunctionTranslator::translateIntToPtr(const Instruction* inst)
+{
+	auto pInst = translateSimpleInstruction(Opcode::INTTOPTR, inst);
+
+	// If the integer is derived from a pointer that lives in the frame, the pointer is passed as an extra operand. The address space of the result is then taken from it
+	auto basePtr = findBasePointer(cast<IntToPtrInst>(inst));
+	if (basePtr != nullptr && !isa<Constant>(basePtr))
+		addOperand(pInst, basePtr);
+
+	return pInst;
+}
+
+// Fold the constant indices of gepInst into pInst.gepOffset, and add each variable index as an operand of pInst along with its GEP step. The GEP base must be the last operand added so far
+void FunctionTranslator::addGEPIndices(PreparedInstruction& pInst, const GetElementPtrInst* gepInst)
+{
+	pInst.gepOffset = 0;
+	pInst.firstAux = fn.gepSteps.size();
+	for (auto itr = gep_type_begin(gepInst), ite = gep_type_end(gepInst); itr != ite; ++itr)
+	{
+		auto idx = itr.getOperand();
+		if (auto structType = dyn_cast<StructType>(*itr))
+		{
+			auto fieldNum = cast<ConstantInt>(idx)->getZExtValue();
+			pInst.gepOffset += dataLayout.getStructLayout(structType)->getElementOffset(fieldNum);
+			continue;
+		}
+
+		auto scale = dataLayout.getTypeAllocSize(cast<SequentialType>(*itr)->getElementType());
+		if (auto cInt = dyn_cast<ConstantInt>(idx))
+			pInst.gepOffset += static_cast<uint64_t>(cInt->getSExtValue()) * scale;
+		else
+		{
+			addOperand(pInst, idx);
+			fn.gepSteps.push_back(GEPStep{scale});
+			++pInst.numAux;
+		}
+	}
+}
+
+PreparedInstruction FunctionTranslator::translateGEP(const GetElementPtrInst* gepInst)
+{
+	if (gepInst->getType()->isVectorTy())
+		llvm_unreachable("GEP on vectors of pointers not supported");
+
+	// Operands: the GEP base, then the variable indices
+	auto pInst = createInstruction(Opcode::GEP, gepInst);
+	addOperand(pInst, gepInst->getPointerOperand());
+	addGEPIndices(pInst, gepInst);
+	assert(pInst.numAux + 1 == pInst.numOperands);
+
+	return pInst;
+}
+
+PreparedInstruction FunctionTranslator::translateCall(const Instruction* inst)
+{
+	ImmutableCallSite cs(inst);
+	assert(cs);
+
+	// A call marked tail (or musttail) does not access the allocas of its caller. If it is directly followed by the return of its result, the frame of the caller is dead by the time the callee runs
+	auto isTailCall = false;
+	if (cast<CallInst>(inst)->isTailCall())
+	{
+		auto retInst = dyn_cast_or_null<ReturnInst>(inst->getNextNode());
+		isTailCall = (retInst != nullptr) && (retInst->getReturnValue() == nullptr || retInst->getReturnValue() == inst);
+	}
+
+	// Operand 0 is the called value. The rest are the actual arguments
+	auto pInst = createInstruction(isTailCall ? Opcode::TAIL_CALL : Opcode::CALL, inst);
+	pInst.callee = cs.getCalledFunction();
+	pInst.callSite = context.numCallSites++;
+	addOperand(pInst, cs.getCalledValue());
+	for (auto itr = cs.arg_begin(), ite = cs.arg_end(); itr != ite; ++itr)
+		addOperand(pInst, *itr);
+
+	return pInst;
+}
+
+PreparedInstruction FunctionTranslator::translateVectorOperation(const Instruction* inst)
+{
+	auto op = Opcode::VECTOR_BINOP;
+	if (isa<CmpInst>(inst))
+		op = Opcode::VECTOR_CMP;
+	else if (isa<BitCastInst>(inst))
+		op = Opcode::VECTOR_BITCAST;
+	else if (isa<CastInst>(inst))
+		op = Opcode::VECTOR_CAST;
+	else if (isa<SelectInst>(inst))
+		op = Opcode::VECTOR_SELECT;
+
+	auto pInst = translateSimpleInstruction(op, inst);
+	pInst.type = inst->getType();
+	if (op == Opcode::VECTOR_BINOP || op == Opcode::VECTOR_CMP || op == Opcode::VECTOR_CAST)
+		pInst.elementOpcode = getElementOpcode(inst);
+	if (op == Opcode::VECTOR_CMP)
+		pInst.predicate = cast<CmpInst>(inst)->getPredicate();
+	return pInst;
+}
+
+PreparedInstruction FunctionTranslator::translateShuffleVector(const ShuffleVectorInst* shuffleInst)
+{
+	// Operands: the two input vectors. The mask is a constant, which goes to the side table
+	auto pInst = createInstruction(Opcode::SHUFFLEVECTOR, shuffleInst);
+	pInst.type = shuffleInst->getType();
+	addOperand(pInst, shuffleInst->getOperand(0));
+	addOperand(pInst, shuffleInst->getOperand(1));
+
+	SmallVector<int, 16> mask;
+	shuffleInst->getShuffleMask(mask);
+	pInst.firstAux = fn.shuffleMasks.size();
+	pInst.numAux = mask.size();
+	fn.shuffleMasks.insert(fn.shuffleMasks.end(), mask.begin(), mask.end());
+	return pInst;
+}
+
+// A switch on an integer of at most 64 bits gets a jump table if at least a third of the table entries would be actual cases. Otherwise the cases are sorted and searched by bisection
+static const unsigned MinJumpTableCases = 4;
+static const unsigned JumpTableSparseness = 3;
+
+PreparedInstruction FunctionTranslator::translateNativeSwitch(const SwitchInst* switchInst)
+{
+	auto parent = switchInst->getParent();
+	auto cases = std::vector<NativeSwitchCase>();
+	for (auto& caseItr: switchInst->cases())
+		cases.push_back(NativeSwitchCase{caseItr.getCaseValue()->getSExtValue(), getEdgeIndex(parent, caseItr.getCaseSuccessor())});
+	std::sort(cases.begin(), cases.end(),
+		[] (const NativeSwitchCase& lhs, const NativeSwitchCase& rhs)
+		{
+			return lhs.value < rhs.value;
+		}
+	);
+
+	auto defaultEdge = getEdgeIndex(parent, switchInst->getDefaultDest());
+
+	// The range wraps around to 0 if the cases span all 64-bit values
+	auto range = cases.empty() ? 0 : static_cast<uint64_t>(cases.back().value) - static_cast<uint64_t>(cases.front().value) + 1;
+	if (cases.size() >= MinJumpTableCases && range != 0 && range <= cases.size() * JumpTableSparseness)
+	{
+		auto pInst = createInstruction(Opcode::SWITCH_TABLE, switchInst);
+		addOperand(pInst, switchInst->getCondition());
+		pInst.targets[0] = defaultEdge;
+		pInst.switchBase = cases.front().value;
+
+		pInst.firstAux = fn.jumpTables.size();
+		pInst.numAux = range;
+		fn.jumpTables.resize(fn.jumpTables.size() + range, defaultEdge);
+		for (auto const& switchCase: cases)
+			fn.jumpTables[pInst.firstAux + (static_cast<uint64_t>(switchCase.value) - static_cast<uint64_t>(pInst.switchBase))] = switchCase.target;
+		return pInst;
+	}
+	else
+	{
+		auto pInst = createInstruction(Opcode::SWITCH_SEARCH, switchInst);
+		addOperand(pInst, switchInst->getCondition());
+		pInst.targets[0] = defaultEdge;
+
+		pInst.firstAux = fn.nativeSwitchCases.size();
+		pInst.numAux = cases.size();
+		fn.nativeSwitchCases.insert(fn.nativeSwitchCases.end(), cases.begin(), cases.end());
+		return pInst;
+	}
+}
+
+PreparedInstruction FunctionTranslator::translateIndirectBr(const IndirectBrInst* ibrInst)
+{
+	auto pInst = createInstruction(Opcode::INDIRECTBR, ibrInst);
+	addOperand(pInst, ibrInst->getAddress());
+
+	auto targets = std::vector<IndirectTarget>();
+	for (auto i = 0u, e = ibrInst->getNumDestinations(); i < e; ++i)
+	{
+		auto dest = ibrInst->getDestination(i);
+		targets.push_back(IndirectTarget{dest, getEdgeIndex(ibrInst->getParent(), dest)});
+	}
+
+	// The same block may be listed more than once
+	auto blockLess = [] (const IndirectTarget& lhs, const IndirectTarget& rhs)
+	{
+		return lhs.block < rhs.block;
+	};
+	auto blockEqual = [] (const IndirectTarget& lhs, const IndirectTarget& rhs)
+	{
+		return lhs.block == rhs.block;
+	};
+	std::sort(targets.begin(), targets.end(), blockLess);
+	targets.erase(std::unique(targets.begin(), targets.end(), blockEqual), targets.end());
+
+	pInst.firstAux = fn.indirectTargets.size();
+	pInst.numAux = targets.size();
+	fn.indirectTargets.insert(fn.indirectTargets.end(), targets.begin(), targets.end());
+	return pInst;
+}
+
+PreparedInstruction FunctionTranslator::translateTerminator(const Instruction* inst)
+{
+	switch (inst->getOpcode())
+	{
+		case Instruction::Br:
+		{
+			auto brInst = cast<BranchInst>(inst);
+			if (brInst->isConditional())
+			{
+				auto pInst = createInstruction(Opcode::COND_BR, inst);
+				addOperand(pInst, brInst->getCondition());
+				pInst.targets[0] = getEdgeIndex(inst->getParent(), brInst->getSuccessor(0));
+				pInst.targets[1] = getEdgeIndex(inst->getParent(), brInst->getSuccessor(1));
+				return pInst;
+			}
+			else
+			{
+				auto pInst = createInstruction(Opcode::BR, inst);
+				pInst.targets[0] = getEdgeIndex(inst->getParent(), brInst->getSuccessor(0));
+				return pInst;
+			}
+		}
+		case Instruction::Ret:
+		{
+			auto retInst = cast<ReturnInst>(inst);
+			auto pInst = createInstruction(Opcode::RET, inst);
+			if (auto value = retInst->getReturnValue())
+				addOperand(pInst, value);
+			return pInst;
+		}
+		case Instruction::Switch:
+		{
+			auto switchInst = cast<SwitchInst>(inst);
+			if (switchInst->getCondition()->getType()->getIntegerBitWidth() <= 64)
+				return translateNativeSwitch(switchInst);
+
+			auto pInst = createInstruction(Opcode::SWITCH, inst);
+			addOperand(pInst, switchInst->getCondition());
+			pInst.targets[0] = getEdgeIndex(inst->getParent(), switchInst->getDefaultDest());
+
+			pInst.firstAux = fn.switchCases.size();
+			for (auto& caseItr: switchInst->cases())
+			{
+				fn.switchCases.push_back(SwitchCase{caseItr.getCaseValue()->getValue(), getEdgeIndex(inst->getParent(), caseItr.getCaseSuccessor())});
+				++pInst.numAux;
+			}
+			return pInst;
+		}
+		case Instruction::IndirectBr:
+			return translateIndirectBr(cast<IndirectBrInst>(inst));
+		case Instruction::Unreachable:
+			return createInstruction(Opcode::UNREACHABLE, inst);
+		case Instruction::Invoke:
+		case Instruction::Resume:
+		default:
+			llvm_unreachable("Unsupported terminator instruction");
+	}
+}
+
+PreparedInstruction FunctionTranslator::translateInstruction(const Instruction* inst)
+{
+	if (inst->isTerminator())
+		return translateTerminator(inst);
+	if (isVectorOperation(inst))
+		return translateVectorOperation(inst);
+
+	switch (inst->getOpcode())
+	{
+		// Standard binary operators...
+		case Instruction::Add:
+			return translateSimpleInstruction(Opcode::ADD, inst);
+		case Instruction::Sub:
+			return translateSimpleInstruction(Opcode::SUB, inst);
+		case Instruction::Mul:
+			return translateSimpleInstruction(Opcode::MUL, inst);
+		case Instruction::UDiv:
+			return translateSimpleInstruction(Opcode::UDIV, inst);
+		case Instruction::SDiv:
+			return translateSimpleInstruction(Opcode::SDIV, inst);
+		case Instruction::URem:
+			return translateSimpleInstruction(Opcode::UREM, inst);
+		case Instruction::SRem:
+			return translateSimpleInstruction(Opcode::SREM, inst);
+		case Instruction::FAdd:
+			return translateSimpleInstruction(Opcode::FADD, inst);
+		case Instruction::FSub:
+			return translateSimpleInstruction(Opcode::FSUB, inst);
+		case Instruction::FMul:
+			return translateSimpleInstruction(Opcode::FMUL, inst);
+		case Instruction::FDiv:
+			return translateSimpleInstruction(Opcode::FDIV, inst);
+		case Instruction::FRem:
+			return translateSimpleInstruction(Opcode::FREM, inst);
+
+		// Logical operators...
+		case Instruction::And:
+			return translateSimpleInstruction(Opcode::AND, inst);
+		case Instruction::Or:
+			return translateSimpleInstruction(Opcode::OR, inst);
+		case Instruction::Xor:
+			return translateSimpleInstruction(Opcode::XOR, inst);
+		case Instruction::Shl:
+			return translateSimpleInstruction(Opcode::SHL, inst);
+		case Instruction::LShr:
+			return translateSimpleInstruction(Opcode::LSHR, inst);
+		case Instruction::AShr:
+			return translateSimpleInstruction(Opcode::ASHR, inst);
+		case Instruction::ICmp:
+		case Instruction::FCmp:
+		{
+			auto op = (inst->getOpcode() == Instruction::ICmp) ? Opcode::ICMP : Opcode::FCMP;
+			auto pInst = translateSimpleInstruction(op, inst);
+			pInst.predicate = cast<CmpInst>(inst)->getPredicate();
+			return pInst;
+		}
+
+		// Convert instructions...
+		case Instruction::Trunc:
+			return translateSimpleInstruction(Opcode::TRUNC, inst);
+		case Instruction::ZExt:
+			return translateSimpleInstruction(Opcode::ZEXT, inst);
+		case Instruction::SExt:
+			return translateSimpleInstruction(Opcode::SEXT, inst);
+		case Instruction::FPTrunc:
+		{
+			if (!(inst->getOperand(0)->getType()->isDoubleTy() && inst->getType()->isFloatTy()))
+				llvm_unreachable("Invalid FPTrunc instruction");
+			return translateSimpleInstruction(Opcode::FPTRUNC, inst);
+		}
+		case Instruction::FPExt:
+		{
+			if (!(inst->getType()->isDoubleTy() && inst->getOperand(0)->getType()->isFloatTy()))
+				llvm_unreachable("Invalid FPExt instruction");
+			return translateSimpleInstruction(Opcode::FPEXT, inst);
+		}
+		// Since APInt can represent both UI and SI, we process them in the same way
+		case Instruction::FPToUI:
+		case Instruction::FPToSI:
+			return translateSimpleInstruction(Opcode::FPTOI, inst);
+		case Instruction::UIToFP:
+			return translateSimpleInstruction(Opcode::UITOFP, inst);
+		case Instruction::SIToFP:
+			return translateSimpleInstruction(Opcode::SITOFP, inst);
+		case Instruction::IntToPtr:
+			return translateIntToPtr(inst);
+		case Instruction::PtrToInt:
+			return translateSimpleInstruction(Opcode::PTRTOINT, inst);
+		case Instruction::BitCast:
+			return translateBitCast(inst);
+
+		// Memory instructions...
+		case Instruction::Alloca:
+		{
+			auto allocInst = cast<AllocaInst>(inst);
+
+			// The element count is only evaluated at runtime if it is not the implicit 1
+			auto pInst = createInstruction(Opcode::ALLOCA, inst);
+			if (allocInst->isArrayAllocation())
+				addOperand(pInst, allocInst->getArraySize());
+			pInst.typeSize = dataLayout.getTypeAllocSize(allocInst->getAllocatedType());
+			return pInst;
+		}
+		case Instruction::Load:
+		{
+			if (isAtomicAccess(inst))
+				return translateAtomicAccess(Opcode::ATOMIC_LOAD, inst, inst->getType());
+			auto pInst = translateSimpleInstruction(getTypedAccessOpcode(inst->getType(), false), inst);
+			pInst.type = inst->getType();
+			return pInst;
+		}
+		case Instruction::Store:
+		{
+			auto valType = cast<StoreInst>(inst)->getValueOperand()->getType();
+			if (isAtomicAccess(inst))
+				return translateAtomicAccess(Opcode::ATOMIC_STORE, inst, valType);
+			return translateSimpleInstruction(getTypedAccessOpcode(valType, true), inst);
+		}
+		case Instruction::AtomicCmpXchg:
+		case Instruction::AtomicRMW:
+		{
+			// Operands: the address, then the compared and new values of a cmpxchg, or the operand of an atomicrmw
+			auto isCmpXchg = (inst->getOpcode() == Instruction::AtomicCmpXchg);
+			auto pInst = translateSimpleInstruction(isCmpXchg ? Opcode::CMPXCHG : Opcode::ATOMICRMW, inst);
+			auto valType = inst->getOperand(1)->getType();
+			if (isCmpXchg && valType->isPointerTy())
+				pInst.bitWidth = dataLayout.getPointerSizeInBits();
+			else if (valType->isIntegerTy() && valType->getIntegerBitWidth() <= 64)
+				pInst.bitWidth = valType->getIntegerBitWidth();
+			else
+				llvm_unreachable("Atomic operations are only supported on integers of at most 64 bits, and on pointers for cmpxchg");
+			pInst.typeSize = dataLayout.getTypeStoreSize(valType);
+			if (isCmpXchg)
+				pInst.type = inst->getType();
+			else
+				pInst.predicate = cast<AtomicRMWInst>(inst)->getOperation();
+			return pInst;
+		}
+		case Instruction::Fence:
+			return createInstruction(Opcode::FENCE, inst);
+		case Instruction::GetElementPtr:
+			return translateGEP(cast<GetElementPtrInst>(inst));
+
+		// Other instructions...
+		case Instruction::ExtractValue:
+		case Instruction::InsertValue:
+		{
+			auto op = (inst->getOpcode() == Instruction::ExtractValue) ? Opcode::EXTRACTVALUE : Opcode::INSERTVALUE;
+			auto pInst = translateSimpleInstruction(op, inst);
+
+			auto indices = (op == Opcode::EXTRACTVALUE) ? cast<ExtractValueInst>(inst)->getIndices() : cast<InsertValueInst>(inst)->getIndices();
+			pInst.firstAux = fn.aggregateIndices.size();
+			pInst.numAux = indices.size();
+			fn.aggregateIndices.insert(fn.aggregateIndices.end(), indices.begin(), indices.end());
+			return pInst;
+		}
+		case Instruction::Select:
+			return translateSimpleInstruction(Opcode::SELECT, inst);
+		case Instruction::Call:
+			return translateCall(inst);
+		case Instruction::ExtractElement:
+		{
+			auto pInst = translateSimpleInstruction(Opcode::EXTRACTELEMENT, inst);
+			pInst.type = inst->getType();
+			return pInst;
+		}
+		case Instruction::InsertElement:
+		{
+			auto pInst = translateSimpleInstruction(Opcode::INSERTELEMENT, inst);
+			pInst.type = inst->getType();
+			return pInst;
+		}
+		case Instruction::ShuffleVector:
+			return translateShuffleVector(cast<ShuffleVectorInst>(inst));
+
+		// Instructions that should not be here
+		case Instruction::PHI:
+			llvm_unreachable("Illegal instruction type!");
+
+		// Unimplemented instructions
+		case Instruction::VAArg:
+		case Instruction::LandingPad:
+			llvm_unreachable("Unimplemented instruction type!");
+
+		// Unsupported instructions
+		case Instruction::AddrSpaceCast:
+		default:
+			llvm_unreachable("Unsupported instruction type!");
+	}
+}
+
+// Translate first and second into one superinstruction if they form one of the idioms listed in Opcodes.def. This requires second to be the only user of first, so that the result of first never needs to be stored in its slot
+bool FunctionTranslator::translateFusedPair(const Instruction* first, const Instruction* second, PreparedInstruction& pInst)
+{
+	if (!first->hasOneUse() || *first->user_begin() != second)
+		return false;
+	// Atomic loads and stores keep their own opcodes
+	if (isAtomicAccess(first) || isAtomicAccess(second))
+		return false;
+
+	if (auto cmpInst = dyn_cast<ICmpInst>(first))
+	{
+		auto brInst = dyn_cast<BranchInst>(second);
+		if (brInst == nullptr || !brInst->isConditional())
+			return false;
+
+		pInst = createInstruction(Opcode::ICMP_BR, brInst);
+		pInst.predicate = cmpInst->getPredicate();
+		addOperand(pInst, cmpInst->getOperand(0));
+		addOperand(pInst, cmpInst->getOperand(1));
+		pInst.targets[0] = getEdgeIndex(brInst->getParent(), brInst->getSuccessor(0));
+		pInst.targets[1] = getEdgeIndex(brInst->getParent(), brInst->getSuccessor(1));
+		return true;
+	}
+	else if (auto gepInst = dyn_cast<GetElementPtrInst>(first))
+	{
+		if (auto loadInst = dyn_cast<LoadInst>(second))
+		{
+			// Operands: the GEP base, then the variable GEP indices
+			pInst = createInstruction(Opcode::GEP_LOAD, loadInst);
+			pInst.type = loadInst->getType();
+			pInst.elementOpcode = getTypedAccessOpcode(loadInst->getType(), false);
+			addOperand(pInst, gepInst->getPointerOperand());
+			addGEPIndices(pInst, gepInst);
+			return true;
+		}
+		else if (auto storeInst = dyn_cast<StoreInst>(second))
+		{
+			// Storing the GEP result itself is not an address computation
+			if (storeInst->getPointerOperand() != gepInst)
+				return false;
+
+			// Operands: the stored value, the GEP base, then the variable GEP indices
+			pInst = createInstruction(Opcode::GEP_STORE, storeInst);
+			pInst.elementOpcode = getTypedAccessOpcode(storeInst->getValueOperand()->getType(), true);
+			addOperand(pInst, storeInst->getValueOperand());
+			addOperand(pInst, gepInst->getPointerOperand());
+			addGEPIndices(pInst, gepInst);
+			return true;
+		}
+		return false;
+	}
+	else if (auto loadInst = dyn_cast<LoadInst>(first))
+	{
+		auto intType = dyn_cast<IntegerType>(second->getType());
+		if (!isa<BinaryOperator>(second) || intType == nullptr || intType->getBitWidth() > 64)
+			return false;
+
+		auto op = Opcode::LOAD_ADD;
+		switch (second->getOpcode())
+		{
+			case Instruction::Add:
+				op = Opcode::LOAD_ADD;
+				break;
+			case Instruction::Sub:
+				op = Opcode::LOAD_SUB;
+				break;
+			case Instruction::Mul:
+				op = Opcode::LOAD_MUL;
+				break;
+			case Instruction::And:
+				op = Opcode::LOAD_AND;
+				break;
+			case Instruction::Or:
+				op = Opcode::LOAD_OR;
+				break;
+			case Instruction::Xor:
+				op = Opcode::LOAD_XOR;
+				break;
+			default:
+				return false;
+		}
+
+		// Operands: the load address, then the other operand of the binary operator
+		pInst = createInstruction(op, second);
+		pInst.type = loadInst->getType();
+		pInst.loadIsRHS = (second->getOperand(1) == loadInst);
+		addOperand(pInst, loadInst->getPointerOperand());
+		addOperand(pInst, second->getOperand(pInst.loadIsRHS ? 0 : 1));
+		return true;
+	}
+
+	return false;
+}
+
+void FunctionTranslator::translate()
+{
+	auto f = fn.getFunction();
+
+	numberSlots();
+
+	// Number the blocks first so that forward branches can be resolved
+	for (auto const& bb: *f)
+	{
+		blockIndices.insert(std::make_pair(&bb, fn.blocks.size()));
+		fn.blocks.push_back(PreparedBlock{&bb, 0});
+	}
+
+	auto blockIdx = 0u;
+	for (auto const& bb: *f)
+	{
+		auto& pBlock = fn.blocks[blockIdx++];
+		pBlock.entry = fn.code.size();
+
+		// Phi nodes are handled by the edges leading to the block
+		for (auto itr = bb.begin(), ite = bb.end(); itr != ite; ++itr)
+		{
+			auto inst = &*itr;
+			if (isa<PHINode>(inst))
+				continue;
+
+			auto next = inst->getNextNode();
+			auto fusedInst = PreparedInstruction();
+			if (context.fuseInstructions && next != nullptr && translateFusedPair(inst, next, fusedInst))
+			{
+				fn.code.push_back(fusedInst);
+				++itr;
+			}
+			else
+				fn.code.push_back(translateInstruction(inst));
+		}
+	}
+
+	for (auto& edge: fn.edges)
+		edge.entry = fn.blocks[edge.target].entry;
+}
+
+void llvm_interpreter::materializeFunction(const Function* f)
+{
+	if (!f->isMaterializable())
+		return;
+
+	// Materializing fills in the body of a function we otherwise treat as immutable
+	if (auto errCode = const_cast<Function*>(f)->Materialize())
+		report_fatal_error("Failed to read the body of " + f->getName() + " from the bitcode: " + errCode.message());
+}
+
+std::unique_ptr<PreparedFunction> PreparedFunction::translate(const Function* f, const DataLayout& dataLayout, TranslationContext& context)
+{
+	assert(f && !f->isDeclaration() && "Cannot translate an external function!");
+	materializeFunction(f);
+
+	auto fn = std::unique_ptr<PreparedFunction>(new PreparedFunction(f, context.numFunctions++));
+	FunctionTranslator(*fn, dataLayout, context).translate();
+	return fn;
+}
+
+PreparedModule::PreparedModule(const Module* m): dataLayout(m) {}
+
+const PreparedFunction& PreparedModule::getPreparedFunction(const Function* f)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	auto itr = preparedFunctions.find(f);
+	if (itr == preparedFunctions.end())
+		itr = preparedFunctions.insert(std::make_pair(f, PreparedFunction::translate(f, dataLayout, translation))).first;
+	return *itr->second;
+}
+
+const Constant* PreparedModule::getConstant(unsigned idx) const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return translation.constantPool.getConstant(idx);
+}
+
+unsigned PreparedModule::getNumFunctions() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return translation.numFunctions;
+}
+
+unsigned PreparedModule::getNumCallSites() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return translation.numCallSites;
+}
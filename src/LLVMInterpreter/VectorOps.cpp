@@ -0,0 +1,467 @@
+#include "IntegerOps.h"
+#include "VectorOps.h"
+
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#endif
+
+using namespace llvm;
+using namespace llvm_interpreter;
+
+// This file contains the element-wise kernels of the vector instructions. The common operations on lanes that the elements fill go through host SIMD registers (AVX2 or SSE2, whichever the build targets). Everything else, as well as the lanes left over at the end of a vector, is computed one lane at a time with the scalar semantics
+
+#if defined(__AVX2__)
+using SIMDInt = __m256i;
+using SIMDFloat = __m256;
+using SIMDDouble = __m256d;
+#define SIMD_OP(name) _mm256_##name
+#define SIMD_SI_OP(name) _mm256_##name##_si256
+#elif defined(__SSE2__)
+using SIMDInt = __m128i;
+using SIMDFloat = __m128;
+using SIMDDouble = __m128d;
+#define SIMD_OP(name) _mm_##name
+#define SIMD_SI_OP(name) _mm_##name##_si128
+#endif
+
+#ifdef SIMD_OP
+
+static const unsigned SIMDSize = sizeof(SIMDInt);
+
+// A kernel that applies one intrinsic to two registers
+#define SIMD_KERNEL(RegType, intrinsic) [] (RegType x, RegType y) { return intrinsic(x, y); }
+
+// Apply kernel to the operands one host register at a time. Return the number of bytes done, which leaves out the tail that does not fill a register
+template <typename Kernel>
+static unsigned simdIntLoop(const uint8_t* a, const uint8_t* b, uint8_t* r, unsigned numBytes, Kernel kernel)
+{
+	auto done = 0u;
+	for (; done + SIMDSize <= numBytes; done += SIMDSize)
+	{
+		auto x = SIMD_SI_OP(loadu)(reinterpret_cast<const SIMDInt*>(a + done));
+		auto y = SIMD_SI_OP(loadu)(reinterpret_cast<const SIMDInt*>(b + done));
+		SIMD_SI_OP(storeu)(reinterpret_cast<SIMDInt*>(r + done), kernel(x, y));
+	}
+	return done;
+}
+
+template <typename Kernel>
+static unsigned simdFloatLoop(const float* a, const float* b, float* r, unsigned numBytes, Kernel kernel)
+{
+	auto done = 0u;
+	for (; done + SIMDSize <= numBytes; done += SIMDSize)
+	{
+		auto idx = done / sizeof(float);
+		SIMD_OP(storeu_ps)(r + idx, kernel(SIMD_OP(loadu_ps)(a + idx), SIMD_OP(loadu_ps)(b + idx)));
+	}
+	return done;
+}
+
+template <typename Kernel>
+static unsigned simdDoubleLoop(const double* a, const double* b, double* r, unsigned numBytes, Kernel kernel)
+{
+	auto done = 0u;
+	for (; done + SIMDSize <= numBytes; done += SIMDSize)
+	{
+		auto idx = done / sizeof(double);
+		SIMD_OP(storeu_pd)(r + idx, kernel(SIMD_OP(loadu_pd)(a + idx), SIMD_OP(loadu_pd)(b + idx)));
+	}
+	return done;
+}
+
+// Integer arithmetic wraps around at the lane size, which is only right if the elements fill their lanes
+static unsigned evaluateSIMDIntArith(Opcode op, unsigned laneSize, const uint8_t* a, const uint8_t* b, uint8_t* r, unsigned numBytes)
+{
+	switch (op)
+	{
+		case Opcode::ADD:
+			switch (laneSize)
+			{
+				case 1:
+					return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(add_epi8)));
+				case 2:
+					return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(add_epi16)));
+				case 4:
+					return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(add_epi32)));
+				default:
+					return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(add_epi64)));
+			}
+		case Opcode::SUB:
+			switch (laneSize)
+			{
+				case 1:
+					return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(sub_epi8)));
+				case 2:
+					return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(sub_epi16)));
+				case 4:
+					return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(sub_epi32)));
+				default:
+					return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(sub_epi64)));
+			}
+		case Opcode::MUL:
+			// There is no bytewise multiplication, and the 64-bit one needs AVX-512
+			if (laneSize == 2)
+				return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(mullo_epi16)));
+#if defined(__AVX2__) || defined(__SSE4_1__)
+			if (laneSize == 4)
+				return simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_OP(mullo_epi32)));
+#endif
+			return 0;
+		default:
+			return 0;
+	}
+}
+
+static unsigned evaluateSIMDFloatArith(Opcode op, const VectorValue& lhs, const VectorValue& rhs, VectorValue& res)
+{
+	auto numBytes = res.getDataSize();
+	if (res.getElementBitWidth() == 32)
+	{
+		auto a = lhs.getLanes<float>();
+		auto b = rhs.getLanes<float>();
+		auto r = res.getLanes<float>();
+		switch (op)
+		{
+			case Opcode::FADD:
+				return simdFloatLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDFloat, SIMD_OP(add_ps)));
+			case Opcode::FSUB:
+				return simdFloatLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDFloat, SIMD_OP(sub_ps)));
+			case Opcode::FMUL:
+				return simdFloatLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDFloat, SIMD_OP(mul_ps)));
+			case Opcode::FDIV:
+				return simdFloatLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDFloat, SIMD_OP(div_ps)));
+			default:
+				return 0;
+		}
+	}
+	else
+	{
+		auto a = lhs.getLanes<double>();
+		auto b = rhs.getLanes<double>();
+		auto r = res.getLanes<double>();
+		switch (op)
+		{
+			case Opcode::FADD:
+				return simdDoubleLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDDouble, SIMD_OP(add_pd)));
+			case Opcode::FSUB:
+				return simdDoubleLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDDouble, SIMD_OP(sub_pd)));
+			case Opcode::FMUL:
+				return simdDoubleLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDDouble, SIMD_OP(mul_pd)));
+			case Opcode::FDIV:
+				return simdDoubleLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDDouble, SIMD_OP(div_pd)));
+			default:
+				return 0;
+		}
+	}
+}
+
+// Compute the leading lanes of res with SIMD. Return the number of lanes done
+static unsigned evaluateSIMDBinOp(Opcode op, const VectorValue& lhs, const VectorValue& rhs, VectorValue& res)
+{
+	auto a = lhs.getData();
+	auto b = rhs.getData();
+	auto r = res.getData();
+	auto numBytes = res.getDataSize();
+	auto laneSize = res.getLaneSize();
+
+	auto numBytesDone = 0u;
+	switch (op)
+	{
+		// The bitwise operations do not care about lane boundaries
+		case Opcode::AND:
+			numBytesDone = simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_SI_OP(and)));
+			break;
+		case Opcode::OR:
+			numBytesDone = simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_SI_OP(or)));
+			break;
+		case Opcode::XOR:
+			numBytesDone = simdIntLoop(a, b, r, numBytes, SIMD_KERNEL(SIMDInt, SIMD_SI_OP(xor)));
+			break;
+		case Opcode::ADD:
+		case Opcode::SUB:
+		case Opcode::MUL:
+			if (res.hasFullLanes())
+				numBytesDone = evaluateSIMDIntArith(op, laneSize, a, b, r, numBytes);
+			break;
+		case Opcode::FADD:
+		case Opcode::FSUB:
+		case Opcode::FMUL:
+		case Opcode::FDIV:
+			numBytesDone = evaluateSIMDFloatArith(op, lhs, rhs, res);
+			break;
+		default:
+			break;
+	}
+	return numBytesDone / laneSize;
+}
+
+#undef SIMD_KERNEL
+
+#else
+
+static unsigned evaluateSIMDBinOp(Opcode, const VectorValue&, const VectorValue&, VectorValue&)
+{
+	return 0;
+}
+
+#endif
+
+const char* llvm_interpreter::getVectorKernelISA()
+{
+#if defined(__AVX2__)
+	return "AVX2";
+#elif defined(__SSE2__)
+	return "SSE2";
+#else
+	return "none";
+#endif
+}
+
+DynamicValue llvm_interpreter::createVectorValue(Type* type)
+{
+	auto vecType = cast<VectorType>(type);
+	auto elemType = vecType->getElementType();
+	if (auto intType = dyn_cast<IntegerType>(elemType))
+	{
+		if (intType->getBitWidth() > 64)
+			llvm_unreachable("Vectors of integers wider than 64 bits are not supported");
+		return DynamicValue::getVectorValue(vecType->getNumElements(), intType->getBitWidth(), false);
+	}
+	else if (elemType->isFloatTy() || elemType->isDoubleTy())
+		return DynamicValue::getVectorValue(vecType->getNumElements(), elemType->getScalarSizeInBits(), true);
+	else
+		llvm_unreachable("Vector element type not supported");
+}
+
+static double getFloatLane(const VectorValue& vec, unsigned idx)
+{
+	return (vec.getElementBitWidth() == 64) ? vec.getLanes<double>()[idx] : vec.getLanes<float>()[idx];
+}
+
+static void setFloatLane(VectorValue& vec, unsigned idx, double f)
+{
+	if (vec.getElementBitWidth() == 64)
+		vec.getLanes<double>()[idx] = f;
+	else
+		vec.getLanes<float>()[idx] = static_cast<float>(f);
+}
+
+// The scalar semantics of the integer binary operators, see NativeIntOps
+static uint64_t applyIntBinOp(Opcode op, const NativeIntOps<0>& ops, uint64_t x, uint64_t y)
+{
+	switch (op)
+	{
+		case Opcode::ADD:
+			return ops.add(x, y);
+		case Opcode::SUB:
+			return ops.sub(x, y);
+		case Opcode::MUL:
+			return ops.mul(x, y);
+		case Opcode::UDIV:
+			return ops.udiv(x, y);
+		case Opcode::SDIV:
+			return ops.sdiv(x, y);
+		case Opcode::UREM:
+			return ops.urem(x, y);
+		case Opcode::SREM:
+			return ops.srem(x, y);
+		case Opcode::AND:
+			return ops.bitAnd(x, y);
+		case Opcode::OR:
+			return ops.bitOr(x, y);
+		case Opcode::XOR:
+			return ops.bitXor(x, y);
+		case Opcode::SHL:
+			return ops.shl(x, y);
+		case Opcode::LSHR:
+			return ops.lshr(x, y);
+		case Opcode::ASHR:
+			return ops.ashr(x, y);
+		default:
+			llvm_unreachable("Not an integer binary operator");
+	}
+}
+
+static double applyFloatBinOp(Opcode op, double x, double y)
+{
+	switch (op)
+	{
+		case Opcode::FADD:
+			return x + y;
+		case Opcode::FSUB:
+			return x - y;
+		case Opcode::FMUL:
+			return x * y;
+		case Opcode::FDIV:
+			return x / y;
+		case Opcode::FREM:
+			return std::fmod(x, y);
+		default:
+			llvm_unreachable("Not a floating point binary operator");
+	}
+}
+
+void llvm_interpreter::evaluateVectorBinOp(Opcode op, const VectorValue& lhs, const VectorValue& rhs, VectorValue& res)
+{
+	assert(lhs.getNumElements() == res.getNumElements() && rhs.getNumElements() == res.getNumElements());
+
+	auto numElems = res.getNumElements();
+	auto firstLane = evaluateSIMDBinOp(op, lhs, rhs, res);
+	if (res.isFloatVector())
+	{
+		for (auto i = firstLane; i < numElems; ++i)
+			setFloatLane(res, i, applyFloatBinOp(op, getFloatLane(lhs, i), getFloatLane(rhs, i)));
+	}
+	else
+	{
+		auto ops = NativeIntOps<0>(res.getElementBitWidth());
+		for (auto i = firstLane; i < numElems; ++i)
+			res.setRawLane(i, applyIntBinOp(op, ops, lhs.getRawLane(i), rhs.getRawLane(i)));
+	}
+}
+
+void llvm_interpreter::evaluateVectorCast(Opcode op, const VectorValue& src, VectorValue& res)
+{
+	assert(src.getNumElements() == res.getNumElements());
+
+	auto numElems = res.getNumElements();
+	auto srcOps = NativeIntOps<0>(src.isFloatVector() ? 64 : src.getElementBitWidth());
+	auto dstOps = NativeIntOps<0>(res.isFloatVector() ? 64 : res.getElementBitWidth());
+	switch (op)
+	{
+		case Opcode::TRUNC:
+		case Opcode::ZEXT:
+			// Lanes are kept zero-extended
+			for (auto i = 0u; i < numElems; ++i)
+				res.setRawLane(i, dstOps.truncate(src.getRawLane(i)));
+			break;
+		case Opcode::SEXT:
+			for (auto i = 0u; i < numElems; ++i)
+				res.setRawLane(i, dstOps.truncate(srcOps.signExtend(src.getRawLane(i))));
+			break;
+		case Opcode::FPTRUNC:
+		case Opcode::FPEXT:
+			for (auto i = 0u; i < numElems; ++i)
+				setFloatLane(res, i, getFloatLane(src, i));
+			break;
+		case Opcode::FPTOI:
+			// Negative values come from fptosi, and the large positive ones from fptoui
+			for (auto i = 0u; i < numElems; ++i)
+			{
+				auto f = getFloatLane(src, i);
+				auto bits = (f < 0) ? static_cast<uint64_t>(static_cast<int64_t>(f)) : static_cast<uint64_t>(f);
+				res.setRawLane(i, dstOps.truncate(bits));
+			}
+			break;
+		case Opcode::UITOFP:
+			for (auto i = 0u; i < numElems; ++i)
+				setFloatLane(res, i, static_cast<double>(src.getRawLane(i)));
+			break;
+		case Opcode::SITOFP:
+			for (auto i = 0u; i < numElems; ++i)
+				setFloatLane(res, i, static_cast<double>(srcOps.signExtend(src.getRawLane(i))));
+			break;
+		default:
+			llvm_unreachable("Not an element-wise conversion");
+	}
+}
+
+void llvm_interpreter::selectVectorLanes(const VectorValue& cond, const VectorValue& lhs, const VectorValue& rhs, VectorValue& res)
+{
+	assert(cond.getNumElements() == res.getNumElements());
+
+	auto laneSize = res.getLaneSize();
+	for (auto i = 0u, e = res.getNumElements(); i < e; ++i)
+	{
+		auto& src = (cond.getRawLane(i) != 0) ? lhs : rhs;
+		std::memcpy(res.getData() + i * laneSize, src.getData() + i * laneSize, laneSize);
+	}
+}
+
+// Extract width bits starting at bit pos of a little-endian bit string
+static uint64_t getBitField(const std::vector<uint64_t>& words, unsigned pos, unsigned width)
+{
+	auto word = pos / 64;
+	auto shift = pos % 64;
+	auto bits = words[word] >> shift;
+	if (shift != 0 && shift + width > 64)
+		bits |= words[word + 1] << (64 - shift);
+	return (width == 64) ? bits : bits & ((UINT64_C(1) << width) - 1);
+}
+
+// Set width bits starting at bit pos of a little-endian bit string, whose bits there must be clear
+static void setBitField(std::vector<uint64_t>& words, unsigned pos, unsigned width, uint64_t bits)
+{
+	auto word = pos / 64;
+	auto shift = pos % 64;
+	words[word] |= bits << shift;
+	if (shift != 0 && shift + width > 64)
+		words[word + 1] |= bits >> (64 - shift);
+}
+
+DynamicValue llvm_interpreter::bitcastVectorValue(const DynamicValue& val, Type* dstType)
+{
+	// Vectors whose elements fill their lanes are laid out like their bit strings
+	if (val.isVectorValue() && dstType->isVectorTy())
+	{
+		auto& srcVec = val.getAsVectorValue();
+		auto retVal = createVectorValue(dstType);
+		auto& dstVec = retVal.getAsVectorValue();
+		if (srcVec.hasFullLanes() && dstVec.hasFullLanes())
+		{
+			assert(srcVec.getDataSize() == dstVec.getDataSize());
+			std::memcpy(dstVec.getData(), srcVec.getData(), dstVec.getDataSize());
+			return retVal;
+		}
+	}
+
+	auto numBits = dstType->getPrimitiveSizeInBits();
+	auto words = std::vector<uint64_t>((numBits + 63) / 64, 0);
+	if (val.isVectorValue())
+	{
+		auto& srcVec = val.getAsVectorValue();
+		auto width = srcVec.getElementBitWidth();
+		for (auto i = 0u, e = srcVec.getNumElements(); i < e; ++i)
+			setBitField(words, i * width, width, srcVec.getRawLane(i));
+	}
+	else if (val.isIntValue())
+		words[0] = val.getAsIntValue().getZExtValue();
+	else if (val.isFloatValue())
+	{
+		auto fpVal = val.getAsFloatValue();
+		words[0] = fpVal.isDouble() ? DoubleToBits(fpVal.getFloat()) : FloatToBits(static_cast<float>(fpVal.getFloat()));
+	}
+	else if (!val.isUndefValue())
+		llvm_unreachable("Invalid vector bitcast");
+
+	if (dstType->isVectorTy())
+	{
+		auto retVal = createVectorValue(dstType);
+		auto& dstVec = retVal.getAsVectorValue();
+		auto width = dstVec.getElementBitWidth();
+		for (auto i = 0u, e = dstVec.getNumElements(); i < e; ++i)
+			dstVec.setRawLane(i, getBitField(words, i * width, width));
+		return retVal;
+	}
+	else if (auto intType = dyn_cast<IntegerType>(dstType))
+		return DynamicValue::getIntValue(intType->getBitWidth(), getBitField(words, 0, intType->getBitWidth()));
+	else if (dstType->isDoubleTy())
+		return DynamicValue::getFloatValue(BitsToDouble(words[0]), true);
+	else if (dstType->isFloatTy())
+		return DynamicValue::getFloatValue(BitsToFloat(static_cast<uint32_t>(words[0])), false);
+	else
+		llvm_unreachable("Invalid vector bitcast");
+}
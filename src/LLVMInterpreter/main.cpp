@@ -1,9 +1,15 @@
+#include "Batch.h"
 #include "Interpreter.h"
+#include "VectorOps.h"
 
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Process.h"
 #include "llvm/Support/raw_ostream.h"
@@ -11,6 +17,10 @@
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetSelect.h"
 
+#include <algorithm>
+#include <chrono>
+#include <sys/resource.h>
+
 using namespace llvm;
 using namespace llvm_interpreter;
 
@@ -18,6 +28,69 @@ cl::opt<std::string> InputFile(cl::desc("<input bitcode>"), cl::Positional, cl::
 
 cl::list<std::string> InputArgv(cl::ConsumeAfter, cl::desc("<program arguments>..."));
 
+cl::opt<bool> PrintStats("stats", cl::desc("Print the number of executed instructions and the interpretation speed"), cl::init(false));
+
+cl::opt<unsigned> TierUpThreshold("tier-up", cl::desc("Compile a function natively once its calls plus loop iterations reach this count (0 disables tiering)"), cl::init(0));
+
+cl::list<std::string> InterpretOnly("interpret-only", cl::CommaSeparated, cl::desc("Only interpret the functions whose name matches one of these regular expressions, and run the others natively"), cl::value_desc("regex"));
+
+cl::list<std::string> RunNatively("run-natively", cl::CommaSeparated, cl::desc("Run the functions whose name matches one of these regular expressions natively"), cl::value_desc("regex"));
+
+cl::opt<bool> LazyLoad("lazy", cl::desc("Read function bodies from the bitcode file only when they are first called"), cl::init(false));
+
+cl::opt<std::string> SnapshotDir("snapshot-dir", cl::desc("Cache the initialized globals of each module in this directory, and reuse them on later runs"), cl::value_desc("directory"), cl::init(""));
+
+cl::opt<std::string> BatchFile("batch", cl::desc("Run main() once per line of this file, which holds the program arguments of the run, and print a JSON summary of the runs"), cl::value_desc("file"), cl::init(""));
+
+cl::opt<unsigned> NumThreads("threads", cl::desc("Number of threads of the batch mode (0 uses every hardware thread)"), cl::init(0));
+
+cl::opt<bool> BumpHeap("bump-heap", cl::desc("Never reuse freed heap memory, to compare the memory footprint against the heap allocator"), cl::init(false));
+
+cl::opt<unsigned> MaxHeap("max-heap", cl::desc("Address space reserved for the heap of the guest program, in MB"), cl::init(MemoryLimits().heapBytes >> 20));
+
+cl::opt<unsigned> MaxStack("max-stack", cl::desc("Address space reserved for the stack of every thread of the guest program, in MB"), cl::init(MemoryLimits().stackBytes >> 20));
+
+cl::opt<bool> NoFusion("no-fusion", cl::desc("Do not fuse common instruction pairs into superinstructions"), cl::init(false));
+
+// Return the MD5 hash of a file in hex, or an empty string if the file cannot be read
+static std::string hashFile(const std::string& path)
+{
+	auto bufferOrErr = MemoryBuffer::getFile(path);
+	if (!bufferOrErr)
+		return "";
+
+	MD5 hash;
+	hash.update(bufferOrErr.get()->getBuffer());
+	MD5::MD5Result result;
+	hash.final(result);
+	SmallString<32> hexResult;
+	MD5::stringifyResult(result, hexResult);
+	return hexResult.str().str();
+}
+
+// Read the argument vectors of a batch, one per non-empty line. Each vector starts with the name of the module, like argv does
+static bool readBatchFile(const std::string& path, std::vector<std::vector<std::string>>& argvs)
+{
+	auto bufferOrErr = MemoryBuffer::getFile(path);
+	if (!bufferOrErr)
+		return false;
+
+	SmallVector<StringRef, 64> lines;
+	SplitString(bufferOrErr.get()->getBuffer(), lines, "\r\n");
+	for (auto line: lines)
+	{
+		SmallVector<StringRef, 8> args;
+		SplitString(line, args);
+		if (args.empty())
+			continue;
+
+		argvs.emplace_back(1, InputFile);
+		for (auto arg: args)
+			argvs.back().push_back(arg.str());
+	}
+	return true;
+}
+
 // Main driver of the interpreter
 int main(int argc, char** argv, char* const *envp)
 {
@@ -35,21 +108,24 @@ int main(int argc, char** argv, char* const *envp)
 	// Disable core file
 	sys::Process::PreventCoreFiles();
 
-	// Read and parse the IR file
+	// Read and parse the IR file. In lazy mode, the bitcode file is memory-mapped and only the module-level entities are read upfront. Function bodies are materialized when the interpreter first reaches them
 	SMDiagnostic err;
-	auto module = std::unique_ptr<Module>(ParseIRFile(InputFile, err, context));
+	auto module = std::unique_ptr<Module>(LazyLoad ? getLazyIRFileModule(InputFile, err, context) : ParseIRFile(InputFile, err, context));
 	if (!module)
 	{
 		err.print(argv[0], errs());
 		std::exit(1);
 	}
 
-	// Load the whole bitcode file eagerly
-	if (auto errCode = module->materializeAllPermanently())
+	// Otherwise load the whole bitcode file eagerly
+	if (!LazyLoad)
 	{
-		errs() << argv[0] << ": bitcode didn't read correctly.\n";
-		errs() << "Reason: " << errCode.message() << "\n";
-		std::exit(1);
+		if (auto errCode = module->materializeAllPermanently())
+		{
+			errs() << argv[0] << ": bitcode didn't read correctly.\n";
+			errs() << "Reason: " << errCode.message() << "\n";
+			std::exit(1);
+		}
 	}
 
 	// Add the module's name to the start of the vector of arguments to main().
@@ -61,12 +137,120 @@ int main(int argc, char** argv, char* const *envp)
 		return -1;
 	}
 
-	Interpreter interpreter(module.get());
+	auto limits = MemoryLimits();
+	limits.heapBytes = size_t(MaxHeap) << 20;
+	limits.stackBytes = size_t(MaxStack) << 20;
+	Interpreter interpreter(module.get(), limits);
+	interpreter.setInstructionFusion(!NoFusion);
+	interpreter.setTierUpThreshold(TierUpThreshold);
 
-	interpreter.evaluateGlobals();
+	// Mixed-mode execution
+	if (!BatchFile.empty() && (TierUpThreshold != 0 || !InterpretOnly.empty() || !RunNatively.empty()))
+	{
+		errs() << "-batch cannot be used with -tier-up, -interpret-only or -run-natively\n";
+		return -1;
+	}
+	if (!InterpretOnly.empty() && !RunNatively.empty())
+	{
+		errs() << "-interpret-only and -run-natively cannot be used together\n";
+		return -1;
+	}
+	if (!InterpretOnly.empty() || !RunNatively.empty())
+	{
+		auto mode = InterpretOnly.empty() ? FunctionSelector::Mode::COMPILE_SELECTED : FunctionSelector::Mode::INTERPRET_SELECTED;
+		auto& patterns = InterpretOnly.empty() ? RunNatively : InterpretOnly;
+
+		auto selector = std::make_unique<FunctionSelector>(mode);
+		for (auto const& pattern: patterns)
+		{
+			std::string regexErr;
+			if (!selector->addPattern(pattern, regexErr))
+			{
+				errs() << "Invalid function pattern \'" << pattern << "\': " << regexErr << "\n";
+				return -1;
+			}
+		}
+		interpreter.setNativeSelection(std::move(selector));
+	}
+
+	// The globals snapshot is keyed by the hash of the input file, the build of the interpreter and the options that affect the globals. It is taken before runMain(), which allocates the arguments of main in global memory
+	auto snapshotPath = std::string();
+	auto snapshotKey = std::string();
+	if (!SnapshotDir.empty() && InputFile != "-")
+	{
+		auto moduleHash = hashFile(InputFile);
+		if (!moduleHash.empty())
+		{
+			snapshotKey = interpreter.getSnapshotKey(moduleHash, LazyLoad);
+			snapshotPath = SnapshotDir + "/" + snapshotKey + ".snapshot";
+		}
+	}
+	auto snapshotLoaded = !snapshotPath.empty() && interpreter.loadGlobalsSnapshot(snapshotPath, snapshotKey);
+	auto snapshotSaved = false;
+	if (!snapshotLoaded)
+	{
+		interpreter.evaluateGlobals();
+		snapshotSaved = !snapshotPath.empty() && interpreter.saveGlobalsSnapshot(snapshotPath, snapshotKey);
+		if (!snapshotPath.empty() && !snapshotSaved)
+			errs() << "Warning: cannot write the globals snapshot " << snapshotPath << "\n";
+	}
+
+	// In batch mode, the interpreter set up above only provides the globals every run starts with
+	if (!BatchFile.empty())
+	{
+		auto argvs = std::vector<std::vector<std::string>>();
+		if (!readBatchFile(BatchFile, argvs))
+		{
+			errs() << "Cannot read the batch file " << BatchFile << "\n";
+			return -1;
+		}
+
+		BatchRunner runner(module.get(), entryFn, interpreter, NumThreads);
+		runner.setInstructionFusion(!NoFusion);
+		runner.setBumpHeap(BumpHeap);
+		runner.setMemoryLimits(limits);
+		auto startTime = std::chrono::steady_clock::now();
+		auto results = runner.run(argvs);
+		auto endTime = std::chrono::steady_clock::now();
+		BatchRunner::printResults(outs(), results);
+
+		auto numFailed = std::count_if(results.begin(), results.end(), [] (const BatchRunResult& result) { return !result.error.empty(); });
+		errs() << "Batch: " << results.size() << " runs, " << numFailed << " failed, " << format("%.3f", std::chrono::duration<double>(endTime - startTime).count()) << "s\n";
+		return numFailed == 0 ? 0 : 1;
+	}
+
+	interpreter.setBumpHeap(BumpHeap);
+	auto startTime = std::chrono::steady_clock::now();
 	auto retInt = interpreter.runMain(entryFn, InputArgv);
+	auto endTime = std::chrono::steady_clock::now();
 
 	errs() << "Interpreter returns value " << retInt << "\n";
 
+	if (PrintStats)
+	{
+		auto seconds = std::chrono::duration<double>(endTime - startTime).count();
+		auto numInsts = interpreter.getNumExecutedInstructions();
+		errs() << "Dispatch mode: " << Interpreter::getDispatchMode() << "\n";
+		errs() << "Vector kernels: " << getVectorKernelISA() << "\n";
+		errs() << "Executed instructions: " << numInsts << "\n";
+		errs() << "Execution time: " << format("%.3f", seconds) << "s\n";
+		if (seconds > 0)
+			errs() << "Instructions per second: " << format("%.0f", numInsts / seconds) << "\n";
+
+		if (!snapshotPath.empty())
+			errs() << "Globals snapshot: " << (snapshotLoaded ? "loaded" : snapshotSaved ? "saved" : "not saved") << "\n";
+		// ru_maxrss is in kilobytes on Linux
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		errs() << "Heap allocator: " << (BumpHeap ? "bump" : "size classes") << "\n";
+		errs() << "Peak heap in use: " << interpreter.getPeakHeapBytes() << " bytes\n";
+		errs() << "Peak resident set size: " << usage.ru_maxrss << " KB\n";
+		errs() << "Natively compiled functions: " << interpreter.getNumCompiledFunctions() << "\n";
+		errs() << "Superinstructions executed:\n";
+#define HANDLE_OPCODE(name)
+#define HANDLE_FUSED_OPCODE(name) errs() << "  " << getOpcodeName(Opcode::name) << ": " << interpreter.getNumFusedExecutions(Opcode::name) << "\n";
+#include "Opcodes.def"
+	}
+
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,142 @@
+#include "Interpreter.h"
+
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <thread>
+
+using namespace llvm;
+using namespace llvm_interpreter;
+
+// Stress test of interpreters running side by side in one process. Every host thread loads a module of its own, in an LLVMContext of its own, and runs its main() over and over with a fresh interpreter each time. A run has to print the same output and return the same exit code as the first run of its thread, since the interpreters share no state
+// The test is meant to be run on a ThreadSanitizer build (-DTHREAD_SANITIZER=ON), with modules whose guest programs spawn threads of their own, so that the state shared by the threads of a guest program is exercised as well
+
+cl::list<std::string> InputFiles(cl::Positional, cl::OneOrMore, cl::desc("<input bitcode>..."));
+
+cl::opt<unsigned> NumThreads("threads", cl::desc("Number of host threads, each running its own interpreters. Thread i runs the (i mod n)-th of the n input modules (0 uses every hardware thread)"), cl::init(0));
+
+cl::opt<unsigned> NumIterations("iterations", cl::desc("Number of times every thread runs its module"), cl::init(10));
+
+namespace
+{
+
+// What a thread saw, or why it stopped
+struct ThreadResult
+{
+	std::string inputFile;
+	unsigned numRuns;
+	uint64_t numExecutedInstructions;
+	std::string error;
+};
+
+// Run one iteration of the module, and return its exit code. The output of the guest program is appended to output
+int runOnce(Module* module, const Function* mainFn, const std::string& inputFile, std::string& output, uint64_t& numExecutedInstructions)
+{
+	raw_string_ostream os(output);
+	Interpreter interpreter(module);
+	interpreter.setOutputStream(os);
+	interpreter.evaluateGlobals();
+	auto exitCode = interpreter.runMain(mainFn, std::vector<std::string>(1, inputFile));
+	numExecutedInstructions += interpreter.getNumExecutedInstructions();
+	os.flush();
+	return exitCode;
+}
+
+void runThread(ThreadResult& result)
+{
+	LLVMContext context;
+	SMDiagnostic err;
+	auto module = std::unique_ptr<Module>(ParseIRFile(result.inputFile, err, context));
+	if (!module)
+	{
+		result.error = "cannot read " + result.inputFile + ": " + err.getMessage().str();
+		return;
+	}
+	if (auto errCode = module->materializeAllPermanently())
+	{
+		result.error = "cannot read " + result.inputFile + ": " + errCode.message();
+		return;
+	}
+	auto mainFn = module->getFunction("main");
+	if (mainFn == nullptr)
+	{
+		result.error = "no main() in " + result.inputFile;
+		return;
+	}
+
+	try
+	{
+		auto expectedOutput = std::string();
+		auto expectedExitCode = runOnce(module.get(), mainFn, result.inputFile, expectedOutput, result.numExecutedInstructions);
+		for (result.numRuns = 1; result.numRuns < NumIterations; ++result.numRuns)
+		{
+			auto output = std::string();
+			auto exitCode = runOnce(module.get(), mainFn, result.inputFile, output, result.numExecutedInstructions);
+			if (exitCode != expectedExitCode || output != expectedOutput)
+			{
+				result.error = "run " + std::to_string(result.numRuns) + " of " + result.inputFile + " differs from the first one";
+				return;
+			}
+		}
+	}
+	catch (const std::exception& e)
+	{
+		result.error = "run " + std::to_string(result.numRuns) + " of " + result.inputFile + " failed: " + e.what();
+	}
+}
+
+}
+
+int main(int argc, char** argv)
+{
+	sys::PrintStackTraceOnErrorSignal();
+	PrettyStackTraceProgram X(argc, argv);
+
+	cl::ParseCommandLineOptions(argc, argv, "stress test of interpreters running in parallel\n");
+
+	auto numThreads = NumThreads.getValue();
+	if (numThreads == 0)
+		numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	auto results = std::vector<ThreadResult>(numThreads);
+	for (auto i = 0u; i < numThreads; ++i)
+	{
+		results[i].inputFile = InputFiles[i % InputFiles.size()];
+		results[i].numRuns = 0;
+		results[i].numExecutedInstructions = 0;
+	}
+
+	auto startTime = std::chrono::steady_clock::now();
+	auto threads = std::vector<std::thread>();
+	for (auto& result: results)
+		threads.emplace_back(runThread, std::ref(result));
+	for (auto& thread: threads)
+		thread.join();
+	auto endTime = std::chrono::steady_clock::now();
+
+	auto numFailed = 0u;
+	auto numRuns = 0u;
+	auto numInsts = uint64_t(0);
+	for (auto const& result: results)
+	{
+		numRuns += result.numRuns;
+		numInsts += result.numExecutedInstructions;
+		if (!result.error.empty())
+		{
+			errs() << "Error: " << result.error << "\n";
+			++numFailed;
+		}
+	}
+	errs() << "Stress test: " << numThreads << " threads, " << numRuns << " runs, " << numInsts << " instructions, " << numFailed << " failed threads, " << format("%.3f", std::chrono::duration<double>(endTime - startTime).count()) << "s\n";
+	return numFailed == 0 ? 0 : 1;
+}
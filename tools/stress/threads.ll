@@ -0,0 +1,93 @@
+; Guest program for the stress test (see tools/StressTest.cpp). main() spawns 4 threads that
+; - write into the stack of the main thread, through the pointer they are started with
+; - increment a shared counter with atomicrmw, and publish their progress with atomic stores
+; - race to install a pointer with cmpxchg
+; - jump through a block address taken by the main thread, loaded atomically
+; It prints "42 42 40000 1 8 10000 1" whatever the interleaving
+
+@fmt = private constant [22 x i8] c"%d %d %d %d %d %d %d\0A\00"
+@slot = global i8* null
+@counter = global i64 0
+@target = global i8* null
+@progress = global i32 0
+@last = global i8* null
+
+declare i32 @printf(i8*, ...)
+declare i32 @pthread_create(i64*, i8*, i8* (i8*)*, i8*)
+declare i32 @pthread_join(i64, i8**)
+
+define i32 @jump(i8* %target) {
+entry:
+  indirectbr i8* %target, [label %a, label %b]
+a:
+  ret i32 1
+b:
+  ret i32 2
+}
+
+define i8* @worker(i8* %arg) {
+entry:
+  %local = bitcast i8* %arg to i32*
+  store i32 42, i32* %local
+  br label %loop
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %old = atomicrmw add i64* @counter, i64 1 seq_cst
+  %i.next = add i32 %i, 1
+  store atomic i32 %i.next, i32* @progress seq_cst, align 4
+  %more = icmp slt i32 %i.next, 10000
+  br i1 %more, label %loop, label %done
+done:
+  %pair = cmpxchg i8** @slot, i8* null, i8* %arg seq_cst seq_cst
+  store atomic i8* %arg, i8** @last seq_cst, align 8
+  %target = load atomic i8** @target seq_cst, align 8
+  %res = call i32 @jump(i8* %target)
+  %ret = inttoptr i32 %res to i8*
+  ret i8* %ret
+}
+
+define i32 @main() {
+entry:
+  %locals = alloca [4 x i32]
+  %tids = alloca [4 x i64]
+  %retval = alloca i8*
+  store i8* blockaddress(@jump, %b), i8** @target
+  br label %spawn
+spawn:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %spawn ]
+  %local = getelementptr [4 x i32]* %locals, i32 0, i32 %i
+  %arg = bitcast i32* %local to i8*
+  %tid.ptr = getelementptr [4 x i64]* %tids, i32 0, i32 %i
+  %c = call i32 @pthread_create(i64* %tid.ptr, i8* null, i8* (i8*)* @worker, i8* %arg)
+  %i.next = add i32 %i, 1
+  %more = icmp slt i32 %i.next, 4
+  br i1 %more, label %spawn, label %join
+join:
+  %j = phi i32 [ 0, %spawn ], [ %j.next, %join ]
+  %sum = phi i32 [ 0, %spawn ], [ %sum.next, %join ]
+  %tid.ptr2 = getelementptr [4 x i64]* %tids, i32 0, i32 %j
+  %tid = load i64* %tid.ptr2
+  %r = call i32 @pthread_join(i64 %tid, i8** %retval)
+  %ret = load i8** %retval
+  %ret.int = ptrtoint i8* %ret to i32
+  %sum.next = add i32 %sum, %ret.int
+  %j.next = add i32 %j, 1
+  %more2 = icmp slt i32 %j.next, 4
+  br i1 %more2, label %join, label %out
+out:
+  %first.ptr = getelementptr [4 x i32]* %locals, i32 0, i32 0
+  %first = load i32* %first.ptr
+  %last.ptr = getelementptr [4 x i32]* %locals, i32 0, i32 3
+  %last = load i32* %last.ptr
+  %count = load atomic i64* @counter seq_cst, align 8
+  %count32 = trunc i64 %count to i32
+  %slot = load i8** @slot
+  %installed = icmp ne i8* %slot, null
+  %installed32 = zext i1 %installed to i32
+  %progress = load atomic i32* @progress seq_cst, align 4
+  %last.thread = load atomic i8** @last seq_cst, align 8
+  %finished = icmp ne i8* %last.thread, null
+  %finished32 = zext i1 %finished to i32
+  %p = call i32 (i8*, ...)* @printf(i8* getelementptr ([22 x i8]* @fmt, i32 0, i32 0), i32 %first, i32 %last, i32 %count32, i32 %installed32, i32 %sum.next, i32 %progress, i32 %finished32)
+  ret i32 0
+}